@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdlib.h>
 #include <ctype.h>
 
 #include "hal.h"
@@ -22,6 +23,13 @@
 #include "fetch_dac.h"
 #include "fetch_spi.h"
 #include "fetch_i2c.h"
+#include "fetch_ctrl.h"
+#include "fetch_sweep.h"
+#include "fetch_counter.h"
+#include "fetch_pwm.h"
+#include "fetch_encoder.h"
+#include "fetch_flash.h"
+#include "fetch_can.h"
 
 #include "fetch_defs.h"
 #include "fetch.h"
@@ -55,6 +63,13 @@ static fetch_command_t fetch_commands[] = {
     { fetch_dac_dispatch,       "dac",              "DAC command set\n(see dac.help)" },
     { fetch_spi_dispatch,       "spi",              "SPI command set\n(see spi.help)" },
     { fetch_i2c_dispatch,       "i2c",              "I2C command set\n(see i2c.help)" },
+    { fetch_ctrl_dispatch,      "ctrl",             "Control loop command set\n(see ctrl.help)" },
+    { fetch_sweep_dispatch,     "sweep",            "Frequency sweep command set\n(see sweep.help)" },
+    { fetch_counter_dispatch,   "counter",          "Frequency counter command set\n(see counter.help)" },
+    { fetch_pwm_dispatch,       "pwm",              "PWM output command set\n(see pwm.help)" },
+    { fetch_encoder_dispatch,   "encoder",          "Quadrature encoder command set\n(see encoder.help)" },
+    { fetch_flash_dispatch,     "flash",            "SPI NOR flash command set\n(see flash.help)" },
+    { fetch_can_dispatch,       "can",              "CAN bus command set\n(see can.help)" },
     { fetch_test_cmd,           "test",             NULL },
     { fetch_test_sdio_cmd,      "testsdio",         "test sdio" },
     { NULL, NULL, NULL }
@@ -190,6 +205,13 @@ static bool fetch_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char
   }
 
   // Add any new peripheral reset functions here
+  fetch_ctrl_reset(chp);
+  fetch_sweep_reset(chp);
+  fetch_counter_reset(chp);
+  fetch_pwm_reset(chp);
+  fetch_encoder_reset(chp);
+  fetch_flash_reset(chp);
+  fetch_can_reset(chp);
   fetch_adc_reset(chp);
   fetch_dac_reset(chp);
   fetch_spi_reset(chp);
@@ -213,6 +235,13 @@ void fetch_init(BaseSequentialStream * chp)
   fetch_dac_init(chp);
   fetch_spi_init(chp);
   fetch_i2c_init(chp);
+  fetch_ctrl_init(chp);
+  fetch_sweep_init(chp);
+  fetch_counter_init(chp);
+  fetch_pwm_init(chp);
+  fetch_encoder_init(chp);
+  fetch_flash_init(chp);
+  fetch_can_init(chp);
 }
 
 /*! \brief parse the Fetch Statement
@@ -452,4 +481,68 @@ bool fetch_input_check( BaseSequentialStream * chp, char * cmd_list[], uint32_t
   return true;
 }
 
+/*! \brief true if a data token is a hex blob, "x:" followed by hex digit pairs
+ */
+bool fetch_is_hex_blob( const char * str )
+{
+  return str != NULL && (str[0] == 'x' || str[0] == 'X') && str[1] == ':';
+}
+
+/*! \brief convert byte arguments into a buffer
+ *
+ *  Each token is either a single byte in number_base or a hex blob
+ *  (x:DEADBEEF) of any length, decoded straight into buf. Blobs carry two
+ *  characters per byte instead of a token per byte, so about twice the
+ *  payload fits in a line.
+ *
+ *  \param[out] count  bytes written to buf
+ *  \returns false after reporting an error
+ */
+bool fetch_parse_bytes( BaseSequentialStream * chp, char * data_list[], int number_base, uint8_t * buf, uint32_t max, uint32_t * count )
+{
+  char * endptr;
+  int32_t value;
+
+  *count = 0;
+
+  for( uint32_t i = 0; data_list[i] != NULL; i++ )
+  {
+    if( fetch_is_hex_blob(data_list[i]) )
+    {
+      value = hex_decode(&data_list[i][2], &buf[*count], max - *count);
+
+      if( value < 0 )
+      {
+        util_message_error(chp, "invalid hex data or more than %u bytes", max);
+        return false;
+      }
+      *count += value;
+      continue;
+    }
+
+    if( *count >= max )
+    {
+      util_message_error(chp, "more than %u bytes", max);
+      return false;
+    }
+
+    value = strtol(data_list[i], &endptr, number_base);
+
+    if( *endptr != '\0' )
+    {
+      util_message_error(chp, "invalid data argument");
+      return false;
+    }
+    else if( value < 0 || value > 0xff )
+    {
+      util_message_error(chp, "invalid data byte");
+      return false;
+    }
+
+    buf[(*count)++] = value;
+  }
+
+  return true;
+}
+
 /*! @} */
@@ -104,6 +104,8 @@ static uint32_t adc_vref_mv = FETCH_DEFAULT_VREF_MV;
 
 static ADCDriver * adc_drv = NULL;
 
+static ADCDriver * adc_claimed_drv = NULL;   //!< converting from interrupt context
+
 static binary_semaphore_t adc_data_ready_sem;
 
 static systime_t adc_start_timestamp = 0;
@@ -154,6 +156,40 @@ static void fetch_adc_end_cb(ADCDriver * adcp, adcsample_t * buffer, size_t n)
 	}
 }
 
+/*! \brief hand an ADC to a user that starts conversions from interrupt context
+ *
+ *  Between its conversions the driver is back in ADC_READY, so a state
+ *  check alone would let the shell start a conversion in the middle of
+ *  the user's. adc.config, adc.start and sweep refuse a claimed ADC.
+ *  \returns false if already claimed or a shell conversion is running
+ */
+bool fetch_adc_claim(ADCDriver * adcp)
+{
+  if( adc_claimed_drv != NULL || adcp->state != ADC_READY )
+  {
+    return false;
+  }
+
+  adc_claimed_drv = adcp;
+
+  return true;
+}
+
+/*! \brief return the ADC, once no more conversions are started for it
+ */
+void fetch_adc_release(ADCDriver * adcp)
+{
+  if( adc_claimed_drv == adcp )
+  {
+    adc_claimed_drv = NULL;
+  }
+}
+
+bool fetch_adc_claimed(ADCDriver * adcp)
+{
+  return adcp != NULL && adcp == adc_claimed_drv;
+}
+
 /*! \brief display adc help
  */
 static bool fetch_adc_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
@@ -214,6 +250,13 @@ static bool fetch_adc_start_cmd(BaseSequentialStream * chp, char * cmd_list[], c
     return false;
   }
 
+  if( fetch_adc_claimed(adc_drv) )
+  {
+    util_message_error(chp, "ADC in use by the control loop");
+    util_message_info(chp, "use ctrl.stop");
+    return false;
+  }
+
   if( adc_drv->state != ADC_READY )
   {
     util_message_error(chp, "ADC not ready");
@@ -247,6 +290,13 @@ static bool fetch_adc_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], ch
     return false;
   }
 
+  if( fetch_adc_claimed(adc_drv) )
+  {
+    util_message_error(chp, "ADC in use by the control loop");
+    util_message_info(chp, "use ctrl.stop");
+    return false;
+  }
+
 	adcStopConversion(adc_drv);
   
   adc_end_timestamp = chVTGetSystemTime();
@@ -365,6 +415,14 @@ static bool fetch_adc_config_cmd(BaseSequentialStream * chp, char * cmd_list[],
       return false;
   }
 
+  if( fetch_adc_claimed(adc_drv) )
+  {
+    util_message_error(chp, "ADC in use by the control loop");
+    util_message_info(chp, "use ctrl.stop");
+    adc_drv = NULL;
+    return false;
+  }
+
   switch( token_match( data_list[ADC_CONFIG_RES], FETCH_MAX_DATA_STRLEN,
                        adc_res_tok, NELEMS(adc_res_tok)) )
   {
@@ -0,0 +1,1142 @@
+/*! \file fetch_can.c
+  *
+  * CAN bus sniffing on CAN1
+  *
+  * \sa fetch.c
+  * @defgroup fetch_can Fetch CAN
+  * @{
+  */
+
+/*!
+ * <hr>
+ *
+ *  CAN1 is on PH13 (TX) and PI9 (RX), the transceiver is enabled with
+ *  GPIOF_CAN_SHDN low. The controller is driven here directly: the RX FIFO
+ *  interrupts copy every frame into a ring with a microsecond time stamp,
+ *  so nothing depends on a thread keeping up with the three frame deep
+ *  hardware FIFOs at 1 Mbit/s. can.frames drains the ring.
+ *
+ *  Filter banks 0-13 are CAN1's, in 32 bit mask mode. Even banks feed
+ *  FIFO 0, odd banks FIFO 1. With no banks set every frame is accepted,
+ *  split over both FIFOs by one identifier bit (bit 0 of a standard id).
+ *
+ *  can.periodic sends frames from a 1ms TIM14 scheduler interrupt, each
+ *  slot with its own period and phase offset against the scheduler start.
+ *  A release that finds all three mailboxes busy is retried every tick
+ *  until the next release, which counts it as missed.
+ *
+ *  The slcan bridge takes the controller and the ring over with the
+ *  fetch_can_bridge_ functions, can.config, can.frames and can.reset are
+ *  refused until it closes. can_sem serialises the two threads.
+ *
+ * <hr>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_messages.h"
+#include "util_ring.h"
+#include "util_timestamp.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+
+#include "fetch_can.h"
+
+#ifndef FETCH_CAN_RX_DEPTH
+#define FETCH_CAN_RX_DEPTH          1024      //!< frames, must be a power of two
+#endif
+
+#ifndef FETCH_CAN_RX_BATCH
+#define FETCH_CAN_RX_BATCH          256       //!< frames per can.frames
+#endif
+
+#define CAN_MIN_BITRATE             10000
+#define CAN_MAX_BITRATE             1000000
+#define CAN_MIN_TQ                  8         //!< time quanta per bit
+#define CAN_MAX_TQ                  25
+#define CAN_MAX_BS1                 16
+#define CAN_MAX_BS2                 8
+#define CAN_MAX_BRP                 1024
+#define CAN_FILTER_BANKS            14        //!< CAN1 share, CAN2 starts at 14
+#define CAN_INIT_TIMEOUT_MS         10
+#define CAN_IRQ_PRIORITY            STM32_CAN_CAN1_IRQ_PRIORITY
+
+#define CAN_PERIODIC_GPTD           GPTD14
+#define CAN_PERIODIC_GPT_FREQUENCY  1000000
+#define CAN_PERIODIC_TICK_US        1000      //!< scheduler resolution
+#define CAN_PERIODIC_SLOTS          16
+#define CAN_PERIODIC_MAX_PERIOD_MS  60000
+
+#define CAN_MAX_STD_ID              0x7ff
+#define CAN_MAX_EXT_ID              0x1fffffff
+
+// filter and mailbox identifier register layout
+#define CAN_FR_STID_SHIFT           21
+#define CAN_FR_EXID_SHIFT           3
+#define CAN_FR_IDE                  (1U << 2)
+#define CAN_FR_RTR                  (1U << 1)
+
+static bool fetch_can_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_can_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_can_filter_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_can_frames_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_can_periodic_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_can_stats_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_can_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+static const char can_config_help_string[] = "Start the controller\n" \
+                      "Usage: config(<bitrate>,[<mode>])\n" \
+                      "\tbitrate = 10000 ... 1000000 {exact with a 42MHz clock}\n" \
+                      "\tmode = SILENT {default, never drives the bus} | NORMAL | LOOPBACK | SILENT_LOOPBACK";
+
+static const char can_filter_help_string[] = "Set or clear an acceptance filter bank\n" \
+                      "Usage: filter(<bank>,[<id>,<mask>,[<format>]])\n" \
+                      "\tbank = 0 ... 13 {even banks use FIFO 0, odd FIFO 1}\n" \
+                      "\tformat = STD {default} | EXT\n" \
+                      "\ta frame is accepted when (frame id & mask) == (id & mask), no banks accepts all";
+
+static const char can_frames_help_string[] = "Return the received frames\n" \
+                      "Usage: frames()\n" \
+                      "\ttime_us = <since config>, id = <id | 0x80000000 extended | 0x40000000 remote>\n" \
+                      "\tdata = <dlc bytes of each data frame, in order>\n" \
+                      "\toverflows = <lost, ring full>, overruns = <lost, hardware FIFO full>";
+
+static const char can_periodic_help_string[] = "Send a frame periodically, or clear a slot\n" \
+                      "Usage: periodic(<slot>,[<id>,<format>,<period>,<offset>,[<base>],[<byte 0>,...,<byte 7>]])\n" \
+                      "\tslot = 0 ... 15, format = STD | EXT\n" \
+                      "\tperiod = 1 ... 60000 {ms}, offset = 0 ... period - 1 {ms after scheduler start}\n" \
+                      "\tbytes may also be a hex blob, x:DEADBEEF\n" \
+                      "\tthe controller must be configured NORMAL or a LOOPBACK mode";
+
+static const char can_stats_help_string[] = "Periodic frame statistics since the last call\n" \
+                      "Usage: stats()\n" \
+                      "\tlate_max_us = <worst release to mailbox delay>, jitter_us = <late max - late min>\n" \
+                      "\tmissed = <releases dropped, no free mailbox before the next one>";
+
+static fetch_command_t fetch_can_commands[] = {
+  /*  function                    command string      help string */
+    { fetch_can_help_cmd,         "help",             "Display CAN help" },
+    { fetch_can_config_cmd,       "config",           can_config_help_string },
+    { fetch_can_filter_cmd,       "filter",           can_filter_help_string },
+    { fetch_can_frames_cmd,       "frames",           can_frames_help_string },
+    { fetch_can_periodic_cmd,     "periodic",         can_periodic_help_string },
+    { fetch_can_stats_cmd,        "stats",            can_stats_help_string },
+    { fetch_can_reset_cmd,        "reset",            "Stop the controller, clear the filters and periodic frames\nUsage: reset()" },
+    { NULL, NULL, NULL }
+  };
+
+enum {
+  CAN_MODE_SILENT = 0,
+  CAN_MODE_NORMAL,
+  CAN_MODE_LOOPBACK,
+  CAN_MODE_SILENT_LOOPBACK
+};
+
+//! same order as the CAN_MODE_ values
+static const char * can_mode_tok[] = {"SILENT", "NORMAL", "LOOPBACK", "SILENT_LOOPBACK"};
+static const uint32_t can_mode_btr[] = {CAN_BTR_SILM, 0, CAN_BTR_LBKM, CAN_BTR_SILM | CAN_BTR_LBKM};
+
+static const char * can_format_tok[] = {"STD", "EXT"};
+
+/*! \brief one acceptance filter bank, in the filter register layout
+ */
+typedef struct can_filter
+{
+  bool      enabled;
+  uint32_t  id;
+  uint32_t  mask;
+} can_filter_t;
+
+static can_filter_t can_filters[CAN_FILTER_BANKS];
+
+static bool can_running = false;
+static bool can_bridged = false;
+static binary_semaphore_t can_sem;
+
+//! woken with FETCH_CAN_RX_EVENT for every received frame while bridged
+static thread_t * volatile can_bridge_thread = NULL;
+
+// receive state, written by the RX interrupts only
+static volatile uint32_t can_rx_overruns;
+static util_timestamp_t can_rx_time;          //!< since the controller started
+
+/*! \brief one periodic transmit slot, the statistics cover the time since the last can.stats
+ */
+typedef struct can_periodic
+{
+  bool          active;
+  can_frame_t   frame;
+  uint32_t      period_ms;
+  uint32_t      due;            //!< next release, in scheduler ticks
+  bool          pending;        //!< released, waiting for a free mailbox
+  uint32_t      pending_due;
+  uint32_t      sent;
+  uint32_t      missed;
+  uint32_t      late_min_us;
+  uint32_t      late_max_us;
+} can_periodic_t;
+
+static can_periodic_t can_periodic[CAN_PERIODIC_SLOTS];
+static volatile uint32_t can_periodic_tick;
+static bool can_periodic_running = false;
+
+static can_frame_t can_rx_buffer[FETCH_CAN_RX_DEPTH];
+static util_ring_t can_rx_ring;
+
+/*! \brief move the oldest frame of a FIFO into the ring
+ *
+ *  One frame per interrupt: FMP only drops after the mailbox is released,
+ *  and the interrupt stays pending while frames are left.
+ *  RF1R has the same layout as RF0R.
+ */
+static void can_rx_fifo(uint32_t fifo)
+{
+  volatile uint32_t * rfr = (fifo == 0) ? &CAN1->RF0R : &CAN1->RF1R;
+  CAN_FIFOMailBox_TypeDef * mailbox = &CAN1->sFIFOMailBox[fifo];
+  can_frame_t frame;
+  uint32_t rir;
+
+  if( *rfr & CAN_RF0R_FOVR0 )
+  {
+    can_rx_overruns++;
+    *rfr = CAN_RF0R_FOVR0;
+  }
+
+  if( (*rfr & CAN_RF0R_FMP0) == 0 )
+  {
+    return;
+  }
+
+  rir = mailbox->RIR;
+  if( rir & CAN_FR_IDE )
+  {
+    frame.id = (rir >> CAN_FR_EXID_SHIFT) | CAN_FRAME_EXT;
+  }
+  else
+  {
+    frame.id = rir >> CAN_FR_STID_SHIFT;
+  }
+  if( rir & CAN_FR_RTR )
+  {
+    frame.id |= CAN_FRAME_RTR;
+  }
+
+  frame.dlc = mailbox->RDTR & CAN_RDT0R_DLC;
+  if( frame.dlc > 8 )
+  {
+    frame.dlc = 8;
+  }
+
+  // the data registers hold the bytes in bus order, lowest byte first
+  frame.data32[0] = mailbox->RDLR;
+  frame.data32[1] = mailbox->RDHR;
+  *rfr = CAN_RF0R_RFOM0;
+
+  frame.time_us = util_timestamp_update(&can_rx_time);
+  util_ring_put(&can_rx_ring, &frame);
+
+  if( can_bridge_thread != NULL )
+  {
+    chSysLockFromISR();
+    chEvtSignalI(can_bridge_thread, FETCH_CAN_RX_EVENT);
+    chSysUnlockFromISR();
+  }
+}
+
+OSAL_IRQ_HANDLER(STM32_CAN1_RX0_HANDLER)
+{
+  OSAL_IRQ_PROLOGUE();
+
+  can_rx_fifo(0);
+
+  OSAL_IRQ_EPILOGUE();
+}
+
+OSAL_IRQ_HANDLER(STM32_CAN1_RX1_HANDLER)
+{
+  OSAL_IRQ_PROLOGUE();
+
+  can_rx_fifo(1);
+
+  OSAL_IRQ_EPILOGUE();
+}
+
+/*! \brief bit timing for a bitrate, sample point near 87.5%
+ *
+ *  The most time quanta that divide the clock exactly are used, they give
+ *  the finest sample point and resynchronisation.
+ *  \returns false if no setting hits the bitrate exactly
+ */
+static bool can_bit_timing(uint32_t bitrate, uint32_t * btr, uint32_t * sample_point)
+{
+  for( uint32_t tq = CAN_MAX_TQ; tq >= CAN_MIN_TQ; tq-- )
+  {
+    uint32_t brp = STM32_PCLK1 / (bitrate * tq);
+    uint32_t bs1, bs2;
+
+    if( brp == 0 || brp > CAN_MAX_BRP || brp * bitrate * tq != STM32_PCLK1 )
+    {
+      continue;
+    }
+
+    // one quantum is the sync segment
+    bs1 = ((tq * 7 + 4) / 8) - 1;
+    if( bs1 > CAN_MAX_BS1 )
+    {
+      bs1 = CAN_MAX_BS1;
+    }
+    bs2 = tq - 1 - bs1;
+    if( bs2 < 1 || bs2 > CAN_MAX_BS2 )
+    {
+      continue;
+    }
+
+    *btr = CAN_BTR_SJW(0) | CAN_BTR_TS2(bs2 - 1) | CAN_BTR_TS1(bs1 - 1) | CAN_BTR_BRP(brp - 1);
+    *sample_point = ((1 + bs1) * 1000) / tq;
+    return true;
+  }
+
+  return false;
+}
+
+/*! \brief load the filter banks, the controller keeps running
+ */
+static void can_load_filters(void)
+{
+  bool any = false;
+
+  CAN1->FMR = CAN_FMR_FINIT | (CAN_FILTER_BANKS << 8);
+  CAN1->FA1R = 0;
+  CAN1->FM1R = 0;
+  CAN1->FS1R = (1U << CAN_FILTER_BANKS) - 1;
+  CAN1->FFA1R = 0xaaaaaaaa & ((1U << CAN_FILTER_BANKS) - 1);
+
+  for( uint32_t bank = 0; bank < CAN_FILTER_BANKS; bank++ )
+  {
+    if( can_filters[bank].enabled )
+    {
+      CAN1->sFilterRegister[bank].FR1 = can_filters[bank].id;
+      CAN1->sFilterRegister[bank].FR2 = can_filters[bank].mask;
+      CAN1->FA1R |= 1U << bank;
+      any = true;
+    }
+  }
+
+  if( !any )
+  {
+    // even identifiers to FIFO 0, odd to FIFO 1
+    CAN1->sFilterRegister[0].FR1 = 0;
+    CAN1->sFilterRegister[0].FR2 = 1U << CAN_FR_STID_SHIFT;
+    CAN1->sFilterRegister[1].FR1 = 1U << CAN_FR_STID_SHIFT;
+    CAN1->sFilterRegister[1].FR2 = 1U << CAN_FR_STID_SHIFT;
+    CAN1->FA1R = 0x3;
+  }
+
+  CAN1->FMR &= ~CAN_FMR_FINIT;
+}
+
+/*! \brief wait for the controller to enter or leave initialisation
+ */
+static bool can_wait_init(bool init)
+{
+  systime_t start = chVTGetSystemTime();
+
+  while( ((CAN1->MSR & CAN_MSR_INAK) != 0) != init )
+  {
+    if( chVTTimeElapsedSinceX(start) >= MS2ST(CAN_INIT_TIMEOUT_MS) )
+    {
+      return false;
+    }
+    chThdSleep(1);
+  }
+
+  return true;
+}
+
+static uint32_t can_rx_take_overruns(void)
+{
+  uint32_t count;
+
+  chSysLock();
+  count = can_rx_overruns;
+  can_rx_overruns = 0;
+  chSysUnlock();
+
+  return count;
+}
+
+static void can_stop(void)
+{
+  nvicDisableVector(STM32_CAN1_RX0_NUMBER);
+  nvicDisableVector(STM32_CAN1_RX1_NUMBER);
+  can_bridge_thread = NULL;
+  can_bridged = false;
+
+  if( can_running )
+  {
+    rccDisableCAN1(FALSE);
+  }
+  palSetPad(GPIOF, GPIOF_CAN_SHDN);
+
+  can_running = false;
+}
+
+/*! \brief (re)start the controller with a bit timing and mode
+ */
+static bool can_start(uint32_t btr)
+{
+  can_stop();
+
+  rccEnableCAN1(FALSE);
+  rccResetCAN1();
+
+  CAN1->MCR = CAN_MCR_INRQ;
+  if( !can_wait_init(true) )
+  {
+    rccDisableCAN1(FALSE);
+    return false;
+  }
+
+  CAN1->BTR = btr;
+  can_load_filters();
+
+  chSysLock();
+  util_ring_reset(&can_rx_ring);
+  can_rx_overruns = 0;
+  util_timestamp_init(&can_rx_time);
+  chSysUnlock();
+
+  CAN1->IER = CAN_IER_FMPIE0 | CAN_IER_FMPIE1;
+  nvicEnableVector(STM32_CAN1_RX0_NUMBER, CAN_IRQ_PRIORITY);
+  nvicEnableVector(STM32_CAN1_RX1_NUMBER, CAN_IRQ_PRIORITY);
+  can_running = true;
+
+  palClearPad(GPIOF, GPIOF_CAN_SHDN);
+
+  // automatic bus-off recovery, transmit in request order
+  CAN1->MCR = CAN_MCR_ABOM | CAN_MCR_TXFP;
+
+  // leaving initialisation takes 11 recessive bits on the bus
+  if( !can_wait_init(false) )
+  {
+    can_stop();
+    return false;
+  }
+
+  return true;
+}
+
+/*! \brief take can_sem for a shell command
+ *  \returns false, without the semaphore, while the slcan bridge is open
+ */
+static bool can_shell_acquire(BaseSequentialStream * chp)
+{
+  chBSemWait(&can_sem);
+
+  if( can_bridged )
+  {
+    chBSemSignal(&can_sem);
+    util_message_error(chp, "CAN held by the slcan bridge");
+    return false;
+  }
+
+  return true;
+}
+
+/*! \brief running in a mode that puts frames on the bus or loops them back
+ */
+static bool can_transmit_mode(void)
+{
+  return can_running && (CAN1->BTR & (CAN_BTR_SILM | CAN_BTR_LBKM)) != CAN_BTR_SILM;
+}
+
+/*! \brief queue a frame in a free transmit mailbox
+ *  \returns false if the controller is stopped, silent or all mailboxes are busy
+ */
+static bool can_transmitI(const can_frame_t * frame)
+{
+  CAN_TxMailBox_TypeDef * mailbox;
+  uint32_t tir;
+
+  if( !can_transmit_mode() ||
+      (CAN1->TSR & (CAN_TSR_TME0 | CAN_TSR_TME1 | CAN_TSR_TME2)) == 0 )
+  {
+    return false;
+  }
+
+  mailbox = &CAN1->sTxMailBox[(CAN1->TSR & CAN_TSR_CODE) >> 24];
+
+  if( frame->id & CAN_FRAME_EXT )
+  {
+    tir = ((frame->id & CAN_MAX_EXT_ID) << CAN_FR_EXID_SHIFT) | CAN_FR_IDE;
+  }
+  else
+  {
+    tir = (frame->id & CAN_MAX_STD_ID) << CAN_FR_STID_SHIFT;
+  }
+  if( frame->id & CAN_FRAME_RTR )
+  {
+    tir |= CAN_FR_RTR;
+  }
+
+  mailbox->TDTR = frame->dlc;
+  mailbox->TDLR = frame->data32[0];
+  mailbox->TDHR = frame->data32[1];
+  mailbox->TIR = tir | CAN_TI0R_TXRQ;
+
+  return true;
+}
+
+/*! \brief scheduler tick, releases due frames and retries the waiting ones
+ *
+ *  late_us is measured from the ideal release instant: whole ticks of
+ *  waiting for a mailbox plus the timer count since the update event, which
+ *  covers the interrupt latency.
+ */
+static void can_periodic_gpt_cb(GPTDriver * gptp)
+{
+  uint32_t tick = ++can_periodic_tick;
+
+  chSysLockFromISR();
+
+  for( uint32_t i = 0; i < CAN_PERIODIC_SLOTS; i++ )
+  {
+    can_periodic_t * slot = &can_periodic[i];
+
+    if( !slot->active )
+    {
+      continue;
+    }
+
+    if( (int32_t)(tick - slot->due) >= 0 )
+    {
+      // the last release never got a mailbox, it is replaced by this one
+      if( slot->pending )
+      {
+        slot->missed++;
+      }
+      slot->pending = true;
+      slot->pending_due = slot->due;
+      slot->due += slot->period_ms;
+    }
+
+    if( slot->pending && can_transmitI(&slot->frame) )
+    {
+      uint32_t late_us = (tick - slot->pending_due) * CAN_PERIODIC_TICK_US + gptp->tim->CNT;
+
+      slot->pending = false;
+      slot->sent++;
+      if( late_us < slot->late_min_us )
+      {
+        slot->late_min_us = late_us;
+      }
+      if( late_us > slot->late_max_us )
+      {
+        slot->late_max_us = late_us;
+      }
+    }
+  }
+
+  chSysUnlockFromISR();
+}
+
+static void can_periodic_stop(void)
+{
+  if( can_periodic_running )
+  {
+    gptStopTimer(&CAN_PERIODIC_GPTD);
+    gptStop(&CAN_PERIODIC_GPTD);
+    can_periodic_running = false;
+  }
+
+  for( uint32_t i = 0; i < CAN_PERIODIC_SLOTS; i++ )
+  {
+    can_periodic[i].active = false;
+  }
+}
+
+static bool fetch_can_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  util_message_info(chp, "Fetch CAN Help:");
+  util_message_info(chp, "the second USB serial port is an SLCAN adapter, refused here while it is open");
+  fetch_display_help(chp, fetch_can_commands);
+
+  return true;
+}
+
+static bool fetch_can_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  uint32_t bitrate, btr, sample_point;
+  int32_t mode = CAN_MODE_SILENT;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 2) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing bitrate");
+    return false;
+  }
+
+  bitrate = strtoul(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || bitrate < CAN_MIN_BITRATE || bitrate > CAN_MAX_BITRATE )
+  {
+    util_message_error(chp, "invalid bitrate. Range: %u-%u", CAN_MIN_BITRATE, CAN_MAX_BITRATE);
+    return false;
+  }
+
+  if( !can_bit_timing(bitrate, &btr, &sample_point) )
+  {
+    util_message_error(chp, "bitrate not reachable exactly");
+    return false;
+  }
+
+  if( data_list[1] != NULL &&
+      (mode = token_match(data_list[1], FETCH_MAX_DATA_STRLEN, can_mode_tok, NELEMS(can_mode_tok))) == TOKEN_NOT_FOUND )
+  {
+    util_message_error(chp, "invalid mode");
+    return false;
+  }
+
+  if( !can_shell_acquire(chp) )
+  {
+    return false;
+  }
+
+  if( !can_start(btr | can_mode_btr[mode]) )
+  {
+    chBSemSignal(&can_sem);
+    util_message_error(chp, "controller did not start, bus not idle");
+    return false;
+  }
+  chBSemSignal(&can_sem);
+
+  util_message_uint32(chp, "bitrate", &bitrate, 1);
+  util_message_uint32(chp, "sample_point", &sample_point, 1);
+
+  return true;
+}
+
+static bool fetch_can_filter_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  can_filter_t filter = { false, 0, 0 };
+  uint32_t bank, id, mask;
+  int32_t format = 0;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 4) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing bank");
+    return false;
+  }
+
+  bank = strtoul(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || bank >= CAN_FILTER_BANKS )
+  {
+    util_message_error(chp, "invalid bank. Range: 0-%u", CAN_FILTER_BANKS - 1);
+    return false;
+  }
+
+  if( data_list[1] != NULL )
+  {
+    if( data_list[2] == NULL )
+    {
+      util_message_error(chp, "missing mask");
+      return false;
+    }
+
+    if( data_list[3] != NULL &&
+        (format = token_match(data_list[3], FETCH_MAX_DATA_STRLEN, can_format_tok, NELEMS(can_format_tok))) == TOKEN_NOT_FOUND )
+    {
+      util_message_error(chp, "invalid format");
+      return false;
+    }
+
+    id = strtoul(data_list[1], &endptr, 0);
+
+    if( *endptr != '\0' || id > (format ? CAN_MAX_EXT_ID : CAN_MAX_STD_ID) )
+    {
+      util_message_error(chp, "invalid id");
+      return false;
+    }
+
+    mask = strtoul(data_list[2], &endptr, 0);
+
+    if( *endptr != '\0' || mask > (format ? CAN_MAX_EXT_ID : CAN_MAX_STD_ID) )
+    {
+      util_message_error(chp, "invalid mask");
+      return false;
+    }
+
+    // IDE is always compared, so a bank only matches its own format
+    if( format )
+    {
+      filter.id = (id << CAN_FR_EXID_SHIFT) | CAN_FR_IDE;
+      filter.mask = (mask << CAN_FR_EXID_SHIFT) | CAN_FR_IDE;
+    }
+    else
+    {
+      filter.id = id << CAN_FR_STID_SHIFT;
+      filter.mask = (mask << CAN_FR_STID_SHIFT) | CAN_FR_IDE;
+    }
+    filter.enabled = true;
+  }
+
+  // filters may change under the slcan bridge too
+  chBSemWait(&can_sem);
+  can_filters[bank] = filter;
+  if( can_running )
+  {
+    can_load_filters();
+  }
+  chBSemSignal(&can_sem);
+
+  return true;
+}
+
+static bool fetch_can_frames_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint32_t time_us[FETCH_CAN_RX_BATCH];
+  static uint32_t id[FETCH_CAN_RX_BATCH];
+  static uint8_t dlc[FETCH_CAN_RX_BATCH];
+  static uint8_t data[FETCH_CAN_RX_BATCH * 8];
+  can_frame_t frame;
+  uint32_t count = 0;
+  uint32_t data_count = 0;
+  uint32_t pending, overflows, overruns;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  if( !can_shell_acquire(chp) )
+  {
+    return false;
+  }
+
+  while( count < FETCH_CAN_RX_BATCH && util_ring_get(&can_rx_ring, &frame) )
+  {
+    time_us[count] = frame.time_us;
+    id[count] = frame.id;
+    dlc[count] = frame.dlc;
+    if( (frame.id & CAN_FRAME_RTR) == 0 )
+    {
+      memcpy(&data[data_count], frame.data, frame.dlc);
+      data_count += frame.dlc;
+    }
+    count++;
+  }
+
+  pending = util_ring_count(&can_rx_ring);
+  overflows = util_ring_take_overflows(&can_rx_ring);
+  overruns = can_rx_take_overruns();
+  chBSemSignal(&can_sem);
+
+  util_message_uint32(chp, "count", &count, 1);
+  util_message_uint32(chp, "pending", &pending, 1);
+  util_message_uint32(chp, "overflows", &overflows, 1);
+  util_message_uint32(chp, "overruns", &overruns, 1);
+  util_message_uint32(chp, "time_us", time_us, count);
+  util_message_hex_uint32(chp, "id", id, count);
+  util_message_uint8(chp, "dlc", dlc, count);
+  util_message_hex_uint8(chp, "data", data, data_count);
+
+  return true;
+}
+
+static bool fetch_can_periodic_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static const GPTConfig can_periodic_gpt_cfg = {
+    .frequency = CAN_PERIODIC_GPT_FREQUENCY,
+    .callback  = can_periodic_gpt_cb,
+    .cr2       = 0,
+    .dier      = 0
+  };
+  can_periodic_t periodic;
+  uint32_t slot, id, byte_count, first;
+  uint32_t offset = 0;
+  int32_t format;
+  int number_base = 16;
+  uint32_t data_start = 5;
+  bool any = false;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 14) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing slot");
+    return false;
+  }
+
+  slot = strtoul(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || slot >= CAN_PERIODIC_SLOTS )
+  {
+    util_message_error(chp, "invalid slot. Range: 0-%u", CAN_PERIODIC_SLOTS - 1);
+    return false;
+  }
+
+  memset(&periodic, 0, sizeof(periodic));
+
+  if( data_list[1] != NULL )
+  {
+    if( data_list[2] == NULL || data_list[3] == NULL || data_list[4] == NULL )
+    {
+      util_message_error(chp, "missing format, period or offset");
+      return false;
+    }
+
+    if( (format = token_match(data_list[2], FETCH_MAX_DATA_STRLEN, can_format_tok, NELEMS(can_format_tok))) == TOKEN_NOT_FOUND )
+    {
+      util_message_error(chp, "invalid format");
+      return false;
+    }
+
+    id = strtoul(data_list[1], &endptr, 0);
+
+    if( *endptr != '\0' || id > (format ? CAN_MAX_EXT_ID : CAN_MAX_STD_ID) )
+    {
+      util_message_error(chp, "invalid id");
+      return false;
+    }
+
+    periodic.period_ms = strtoul(data_list[3], &endptr, 0);
+
+    if( *endptr != '\0' || periodic.period_ms == 0 || periodic.period_ms > CAN_PERIODIC_MAX_PERIOD_MS )
+    {
+      util_message_error(chp, "invalid period. Range: 1-%u", CAN_PERIODIC_MAX_PERIOD_MS);
+      return false;
+    }
+
+    offset = strtoul(data_list[4], &endptr, 0);
+
+    if( *endptr != '\0' || offset >= periodic.period_ms )
+    {
+      util_message_error(chp, "invalid offset, below the period");
+      return false;
+    }
+
+    if( data_list[5] != NULL && !fetch_is_hex_blob(data_list[5]) )
+    {
+      number_base = strtol(data_list[5], &endptr, 0);
+
+      if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+      {
+        util_message_error(chp, "invalid number base");
+        return false;
+      }
+      data_start = 6;
+    }
+
+    if( !fetch_parse_bytes(chp, &data_list[data_start], number_base, periodic.frame.data, 8, &byte_count) )
+    {
+      return false;
+    }
+
+    periodic.frame.id = id | (format ? CAN_FRAME_EXT : 0);
+    periodic.frame.dlc = byte_count;
+    periodic.late_min_us = UINT32_MAX;
+    periodic.active = true;
+  }
+
+  if( !can_shell_acquire(chp) )
+  {
+    return false;
+  }
+
+  if( periodic.active && !can_transmit_mode() )
+  {
+    chBSemSignal(&can_sem);
+    util_message_error(chp, "controller stopped or silent");
+    util_message_info(chp, "use can.config with NORMAL or a LOOPBACK mode");
+    return false;
+  }
+
+  chSysLock();
+
+  // offsets are against the scheduler start
+  if( !can_periodic_running )
+  {
+    can_periodic_tick = 0;
+  }
+
+  if( periodic.active )
+  {
+    // the first release after now that keeps the phase to the scheduler start
+    first = can_periodic_tick + 1;
+    periodic.due = first + ((offset + periodic.period_ms - (first % periodic.period_ms)) % periodic.period_ms);
+  }
+  can_periodic[slot] = periodic;
+
+  for( uint32_t i = 0; i < CAN_PERIODIC_SLOTS; i++ )
+  {
+    any |= can_periodic[i].active;
+  }
+
+  chSysUnlock();
+
+  if( any && !can_periodic_running )
+  {
+    gptStart(&CAN_PERIODIC_GPTD, &can_periodic_gpt_cfg);
+    gptStartContinuous(&CAN_PERIODIC_GPTD, (CAN_PERIODIC_GPT_FREQUENCY / 1000000) * CAN_PERIODIC_TICK_US);
+    can_periodic_running = true;
+  }
+  else if( !any )
+  {
+    can_periodic_stop();
+  }
+
+  chBSemSignal(&can_sem);
+
+  return true;
+}
+
+static bool fetch_can_stats_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  uint32_t slot[CAN_PERIODIC_SLOTS];
+  uint32_t id[CAN_PERIODIC_SLOTS];
+  uint32_t period_ms[CAN_PERIODIC_SLOTS];
+  uint32_t sent[CAN_PERIODIC_SLOTS];
+  uint32_t missed[CAN_PERIODIC_SLOTS];
+  uint32_t late_max_us[CAN_PERIODIC_SLOTS];
+  uint32_t jitter_us[CAN_PERIODIC_SLOTS];
+  uint32_t count = 0;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  chSysLock();
+
+  for( uint32_t i = 0; i < CAN_PERIODIC_SLOTS; i++ )
+  {
+    can_periodic_t * periodic = &can_periodic[i];
+
+    if( !periodic->active )
+    {
+      continue;
+    }
+
+    slot[count] = i;
+    id[count] = periodic->frame.id;
+    period_ms[count] = periodic->period_ms;
+    sent[count] = periodic->sent;
+    missed[count] = periodic->missed;
+    late_max_us[count] = periodic->late_max_us;
+    jitter_us[count] = (periodic->sent > 0) ? periodic->late_max_us - periodic->late_min_us : 0;
+    count++;
+
+    periodic->sent = 0;
+    periodic->missed = 0;
+    periodic->late_min_us = UINT32_MAX;
+    periodic->late_max_us = 0;
+  }
+
+  chSysUnlock();
+
+  util_message_uint32(chp, "count", &count, 1);
+  util_message_uint32(chp, "slot", slot, count);
+  util_message_hex_uint32(chp, "id", id, count);
+  util_message_uint32(chp, "period_ms", period_ms, count);
+  util_message_uint32(chp, "sent", sent, count);
+  util_message_uint32(chp, "missed", missed, count);
+  util_message_uint32(chp, "late_max_us", late_max_us, count);
+  util_message_uint32(chp, "jitter_us", jitter_us, count);
+
+  return true;
+}
+
+static bool fetch_can_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  if( !can_shell_acquire(chp) )
+  {
+    return false;
+  }
+  chBSemSignal(&can_sem);
+
+  return fetch_can_reset(chp);
+}
+
+void fetch_can_init(BaseSequentialStream * chp)
+{
+  static bool can_init_flag = false;
+
+  if( can_init_flag )
+    return;
+
+  util_ring_init(&can_rx_ring, can_rx_buffer, sizeof(can_frame_t), FETCH_CAN_RX_DEPTH);
+  chBSemObjectInit(&can_sem, false);
+
+  can_init_flag = true;
+}
+
+/*! \brief dispatch a CAN command
+ */
+bool fetch_can_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  return fetch_dispatch(chp, fetch_can_commands, cmd_list[FETCH_TOK_SUBCMD_0], cmd_list, data_list);
+}
+
+/*! \brief stop the controller and clear the filters
+ *
+ *  A full fetch reset closes the slcan bridge as well, it sees the bus
+ *  gone on its next fetch_can_bridge_receive.
+ */
+bool fetch_can_reset(BaseSequentialStream * chp)
+{
+  chBSemWait(&can_sem);
+
+  can_periodic_stop();
+  can_stop();
+  util_ring_reset(&can_rx_ring);
+  can_rx_overruns = 0;
+
+  for( uint32_t bank = 0; bank < CAN_FILTER_BANKS; bank++ )
+  {
+    can_filters[bank].enabled = false;
+  }
+
+  chBSemSignal(&can_sem);
+
+  return true;
+}
+
+/*! \brief check a bitrate before the controller is started with it
+ *  \returns false if the bit timing cannot hit the bitrate exactly
+ */
+bool fetch_can_bitrate_valid(uint32_t bitrate)
+{
+  uint32_t btr, sample_point;
+
+  return can_bit_timing(bitrate, &btr, &sample_point);
+}
+
+/*! \brief start the controller for the slcan bridge
+ *
+ *  The calling thread is signalled with FETCH_CAN_RX_EVENT for received
+ *  frames.
+ *  \returns false if the shell has the controller running or it did not start
+ */
+bool fetch_can_bridge_open(uint32_t bitrate, bool listen_only)
+{
+  uint32_t btr, sample_point;
+  bool ok = false;
+
+  if( !can_bit_timing(bitrate, &btr, &sample_point) )
+  {
+    return false;
+  }
+
+  chBSemWait(&can_sem);
+
+  if( !can_running && can_start(btr | can_mode_btr[listen_only ? CAN_MODE_SILENT : CAN_MODE_NORMAL]) )
+  {
+    // slots left from a shell session that stopped the controller
+    can_periodic_stop();
+
+    can_bridged = true;
+    can_bridge_thread = chThdGetSelfX();
+    ok = true;
+  }
+
+  chBSemSignal(&can_sem);
+
+  return ok;
+}
+
+void fetch_can_bridge_close(void)
+{
+  chBSemWait(&can_sem);
+
+  if( can_bridged )
+  {
+    can_stop();
+  }
+
+  chBSemSignal(&can_sem);
+}
+
+/*! \brief move received frames out of the ring for the bridge
+ *  \param[out] lost  frames dropped since the last call, ring or hardware FIFO full
+ *  \returns number of frames, -1 if the bridge is not open
+ */
+int32_t fetch_can_bridge_receive(can_frame_t * frames, uint32_t max, uint32_t * lost)
+{
+  int32_t count = 0;
+
+  chBSemWait(&can_sem);
+
+  if( !can_bridged )
+  {
+    chBSemSignal(&can_sem);
+    return -1;
+  }
+
+  while( (uint32_t)count < max && util_ring_get(&can_rx_ring, &frames[count]) )
+  {
+    count++;
+  }
+  *lost = util_ring_take_overflows(&can_rx_ring) + can_rx_take_overruns();
+
+  chBSemSignal(&can_sem);
+
+  return count;
+}
+
+/*! \brief error status register, for bus warning and error passive flags
+ */
+uint32_t fetch_can_errors(void)
+{
+  return can_running ? CAN1->ESR : 0;
+}
+
+/*! \brief queue a frame for transmission
+ *  \returns false if the controller is stopped, silent or all three mailboxes are busy
+ */
+bool fetch_can_transmit(const can_frame_t * frame)
+{
+  bool ok;
+
+  chSysLock();
+  ok = can_transmitI(frame);
+  chSysUnlock();
+
+  return ok;
+}
+
+/*! @} */
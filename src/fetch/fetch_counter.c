@@ -0,0 +1,574 @@
+/*! \file fetch_counter.c
+  *
+  * Frequency, period and pulse width measurement with timer input capture
+  *
+  * \sa fetch.c
+  * @defgroup fetch_counter Fetch Counter
+  * @{
+  */
+
+/*!
+ * <hr>
+ *
+ *  Inputs are 32 bit timer channel 1 pins from gpio_pins, clocked at TIMCLK1.
+ *
+ *  frequency: a short polled capture of 8 edges estimates the frequency.
+ *  Below FETCH_COUNTER_MAX_IRQ_RATE * 8 the input is reciprocal counted:
+ *  every (prescaled) edge is timestamped by input capture and
+ *
+ *      f = edges * clock / (last timestamp - first timestamp)
+ *
+ *  so the error is one timer tick over the gate time, independent of the
+ *  input frequency. Faster inputs on an ETR pin are counted directly by the
+ *  timer in external clock mode 2 against the cycle counter.
+ *
+ *  pulse: PWM input mode. IC1 captures the period on the rising edge and
+ *  resets the counter, IC2 captures the falling edge (high time).
+ *
+ *  Raw counts and the clock are returned so the host can compute the
+ *  result at full precision.
+ *
+ * <hr>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_messages.h"
+#include "util_io.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+
+#include "fetch_encoder.h"
+
+#include "fetch_counter.h"
+
+#ifndef FETCH_COUNTER_MAX_IRQ_RATE
+#define FETCH_COUNTER_MAX_IRQ_RATE    50000   //!< capture interrupts per second
+#endif
+
+#ifndef FETCH_COUNTER_MAX_GATE_MS
+#define FETCH_COUNTER_MAX_GATE_MS     10000   //!< cycle counter wraps after ~25s
+#endif
+
+#ifndef FETCH_COUNTER_IRQ_PRIORITY
+#define FETCH_COUNTER_IRQ_PRIORITY    7
+#endif
+
+#define COUNTER_CLOCK                 STM32_TIMCLK1
+#define COUNTER_PROBE_MS              2
+#define COUNTER_PROBE_EDGES           8
+#define COUNTER_ETR_DIVIDE_ABOVE      10000000  //!< ETR input must stay below TIMCLK/4
+
+/*! \brief a timer channel 1 input
+ */
+typedef struct counter_input
+{
+  ioportid_t      port;
+  uint32_t        pin;
+  uint32_t        af;
+  TIM_TypeDef   * tim;
+  uint32_t        irq;
+  bool            has_etr;
+} counter_input_t;
+
+static const counter_input_t counter_inputs[] = {
+  { GPIOA, GPIOA_PIN15, 1, TIM2, STM32_TIM2_NUMBER, true  },  // TIM2_CH1/ETR
+  { GPIOH, GPIOH_PIN10, 2, TIM5, STM32_TIM5_NUMBER, false },  // TIM5_CH1
+};
+
+static bool fetch_counter_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_counter_frequency_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_counter_pulse_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_counter_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+static const char counter_frequency_help_string[] = "Measure frequency\n" \
+                      "Usage: frequency(<port>,<pin>,<gate>)\n" \
+                      "\tport/pin = a,15 {TIM2 CH1/ETR} | h,10 {TIM5 CH1}\n" \
+                      "\tgate = <milliseconds>\n" \
+                      "\tfrequency = edges * clock / ticks";
+
+static const char counter_pulse_help_string[] = "Measure one period and its high time\n" \
+                      "Usage: pulse(<port>,<pin>,<timeout>)\n" \
+                      "\tport/pin = a,15 {TIM2 CH1/ETR} | h,10 {TIM5 CH1}\n" \
+                      "\ttimeout = <milliseconds>";
+
+static fetch_command_t fetch_counter_commands[] = {
+  /*  function                      command string      help string */
+    { fetch_counter_help_cmd,       "help",             "Display counter help" },
+    { fetch_counter_frequency_cmd,  "frequency",        counter_frequency_help_string },
+    { fetch_counter_pulse_cmd,      "pulse",            counter_pulse_help_string },
+    { fetch_counter_reset_cmd,      "reset",            "Reset counter inputs" },
+    { NULL, NULL, NULL }
+  };
+
+static const counter_input_t * counter_active = NULL;
+
+static volatile bool counter_started = false;
+static volatile uint32_t counter_edges = 0;
+static volatile uint32_t counter_first = 0;
+static volatile uint32_t counter_last = 0;
+
+/*! \brief capture interrupt, timestamp every prescaled edge
+ */
+static void counter_serve_interrupt(TIM_TypeDef * tim)
+{
+  uint32_t sr = tim->SR;
+
+  tim->SR = ~sr;
+
+  if( sr & TIM_SR_CC1IF )
+  {
+    uint32_t value = tim->CCR1;
+
+    if( !counter_started )
+    {
+      counter_first = value;
+      counter_started = true;
+    }
+    else
+    {
+      counter_last = value;
+      counter_edges++;
+    }
+  }
+}
+
+CH_IRQ_HANDLER(STM32_TIM2_HANDLER)
+{
+  CH_IRQ_PROLOGUE();
+  counter_serve_interrupt(TIM2);
+  CH_IRQ_EPILOGUE();
+}
+
+CH_IRQ_HANDLER(STM32_TIM5_HANDLER)
+{
+  CH_IRQ_PROLOGUE();
+  counter_serve_interrupt(TIM5);
+  CH_IRQ_EPILOGUE();
+}
+
+static void counter_rcc_enable(TIM_TypeDef * tim)
+{
+  if( tim == TIM2 )
+  {
+    rccEnableTIM2(FALSE);
+    rccResetTIM2();
+  }
+  else
+  {
+    rccEnableTIM5(FALSE);
+    rccResetTIM5();
+  }
+}
+
+static void counter_rcc_disable(TIM_TypeDef * tim)
+{
+  if( tim == TIM2 )
+  {
+    rccDisableTIM2(FALSE);
+  }
+  else
+  {
+    rccDisableTIM5(FALSE);
+  }
+}
+
+/*! \brief claim the timer and route the pin to it
+ */
+static void counter_start(const counter_input_t * input)
+{
+  counter_active = input;
+  counter_rcc_enable(input->tim);
+  palSetPadMode(input->port, input->pin, PAL_MODE_ALTERNATE(input->af));
+}
+
+/*! \brief stop the timer and give the pin back to gpio
+ */
+static void counter_stop(void)
+{
+  if( counter_active == NULL )
+  {
+    return;
+  }
+
+  nvicDisableVector(counter_active->irq);
+  counter_active->tim->CR1 = 0;
+  counter_active->tim->DIER = 0;
+  counter_rcc_disable(counter_active->tim);
+  palSetPadMode(counter_active->port, counter_active->pin, PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_FLOATING);
+
+  counter_active = NULL;
+}
+
+/*! \brief free running timer, IC1 on TI1 rising edges
+ *  \param[in] psc_bits  TIM_CCMR1_IC1PSC_x bits
+ */
+static void counter_setup_capture(TIM_TypeDef * tim, uint32_t psc_bits)
+{
+  tim->CR1 = 0;
+  tim->SMCR = 0;
+  tim->PSC = 0;
+  tim->ARR = 0xffffffff;
+  tim->CCMR1 = TIM_CCMR1_CC1S_0 | psc_bits;
+  tim->CCER = TIM_CCER_CC1E;
+  tim->EGR = TIM_EGR_UG;
+  tim->SR = 0;
+  tim->CR1 = TIM_CR1_CEN;
+}
+
+/*! \brief rough frequency from the time taken by COUNTER_PROBE_EDGES edges
+ *  \returns 0 if they do not arrive within COUNTER_PROBE_MS
+ */
+static uint32_t counter_probe(TIM_TypeDef * tim)
+{
+  rtcnt_t start = chSysGetRealtimeCounterX();
+  rtcnt_t window = (STM32_HCLK / 1000) * COUNTER_PROBE_MS;
+  uint32_t captures[2];
+  uint32_t count = 0;
+
+  counter_setup_capture(tim, TIM_CCMR1_IC1PSC_0 | TIM_CCMR1_IC1PSC_1);
+
+  while( count < 2 && (chSysGetRealtimeCounterX() - start) < window )
+  {
+    if( tim->SR & TIM_SR_CC1IF )
+    {
+      captures[count++] = tim->CCR1;
+    }
+  }
+
+  tim->CR1 = 0;
+
+  if( count < 2 || captures[1] == captures[0] )
+  {
+    return 0;
+  }
+
+  // an overcapture only means the input is faster than this estimate
+  return (uint32_t)(((uint64_t)COUNTER_CLOCK * COUNTER_PROBE_EDGES) / (captures[1] - captures[0]));
+}
+
+/*! \brief reciprocal count over the gate time
+ *  \param[in] divider  input capture prescaler, 1, 2, 4 or 8
+ */
+static void counter_reciprocal(const counter_input_t * input, uint32_t divider, uint32_t gate_ms,
+                               uint32_t * edges, uint32_t * ticks)
+{
+  static const uint32_t psc_bits[] = { 0, TIM_CCMR1_IC1PSC_0, TIM_CCMR1_IC1PSC_1, TIM_CCMR1_IC1PSC_0 | TIM_CCMR1_IC1PSC_1 };
+  uint32_t index = (divider >= 8) ? 3 : (divider >= 4) ? 2 : (divider >= 2) ? 1 : 0;
+
+  counter_started = false;
+  counter_edges = 0;
+  counter_first = 0;
+  counter_last = 0;
+
+  counter_setup_capture(input->tim, psc_bits[index]);
+  input->tim->DIER = TIM_DIER_CC1IE;
+  nvicEnableVector(input->irq, FETCH_COUNTER_IRQ_PRIORITY);
+
+  chThdSleepMilliseconds(gate_ms);
+
+  chSysLock();
+  input->tim->DIER = 0;
+  *edges = counter_edges * (1U << index);
+  // no interval was measured without a second capture
+  *ticks = (counter_edges == 0) ? 0 : counter_last - counter_first;
+  chSysUnlock();
+
+  nvicDisableVector(input->irq);
+  input->tim->CR1 = 0;
+}
+
+/*! \brief count ETR edges directly against the cycle counter
+ */
+static void counter_direct(const counter_input_t * input, uint32_t estimate, uint32_t gate_ms,
+                           uint32_t * edges, uint32_t * ticks)
+{
+  TIM_TypeDef * tim = input->tim;
+  uint32_t divider = 1;
+  uint32_t count0, count1;
+  rtcnt_t cycles0, cycles1;
+
+  tim->CR1 = 0;
+  tim->CCMR1 = 0;
+  tim->CCER = 0;
+  tim->PSC = 0;
+  tim->ARR = 0xffffffff;
+  tim->SMCR = TIM_SMCR_ECE;
+  if( estimate > COUNTER_ETR_DIVIDE_ABOVE )
+  {
+    tim->SMCR |= TIM_SMCR_ETPS_0 | TIM_SMCR_ETPS_1;
+    divider = 8;
+  }
+  tim->EGR = TIM_EGR_UG;
+  tim->CR1 = TIM_CR1_CEN;
+
+  chSysLock();
+  count0 = tim->CNT;
+  cycles0 = chSysGetRealtimeCounterX();
+  chSysUnlock();
+
+  chThdSleepMilliseconds(gate_ms);
+
+  chSysLock();
+  count1 = tim->CNT;
+  cycles1 = chSysGetRealtimeCounterX();
+  chSysUnlock();
+
+  tim->CR1 = 0;
+  tim->SMCR = 0;
+
+  *edges = (count1 - count0) * divider;
+  *ticks = cycles1 - cycles0;
+}
+
+/*! \brief parse port/pin into a counter input
+ */
+static const counter_input_t * parse_counter_input(char * port_str, char * pin_str)
+{
+  ioportid_t port = string_to_port(port_str);
+  uint32_t pin = string_to_pin(pin_str);
+
+  for( uint32_t i = 0; i < NELEMS(counter_inputs); i++ )
+  {
+    if( counter_inputs[i].port == port && counter_inputs[i].pin == pin )
+    {
+      return &counter_inputs[i];
+    }
+  }
+  return NULL;
+}
+
+static bool fetch_counter_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  util_message_info(chp, "Fetch Counter Help:");
+  fetch_display_help(chp, fetch_counter_commands);
+	return true;
+}
+
+static bool fetch_counter_frequency_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  const counter_input_t * input;
+  char * endptr;
+  uint32_t estimate;
+  uint32_t divider;
+  uint32_t edges = 0, ticks = 0;
+  uint32_t clock;
+  uint32_t frequency;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  input = parse_counter_input(data_list[0], data_list[1]);
+
+  if( input == NULL )
+  {
+    util_message_error(chp, "invalid port/pin, not a counter input");
+    return false;
+  }
+
+  if( input->tim == TIM5 && fetch_encoder_running() )
+  {
+    util_message_error(chp, "TIM5 in use by the encoder");
+    return false;
+  }
+
+  if( data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing gate time");
+    return false;
+  }
+
+  int32_t gate_ms = strtol(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || gate_ms <= 0 || gate_ms > FETCH_COUNTER_MAX_GATE_MS )
+  {
+    util_message_error(chp, "invalid gate time. Range: 1-%u", FETCH_COUNTER_MAX_GATE_MS);
+    return false;
+  }
+
+  counter_start(input);
+
+  estimate = counter_probe(input->tim);
+
+  // smallest capture prescaler that keeps the interrupt rate down
+  for( divider = 1; divider <= 8 && (estimate / divider) > FETCH_COUNTER_MAX_IRQ_RATE; divider *= 2 );
+
+  if( divider <= 8 )
+  {
+    counter_reciprocal(input, divider, gate_ms, &edges, &ticks);
+    clock = COUNTER_CLOCK;
+  }
+  else if( input->has_etr )
+  {
+    counter_direct(input, estimate, gate_ms, &edges, &ticks);
+    clock = STM32_HCLK;
+  }
+  else
+  {
+    counter_stop();
+    util_message_error(chp, "input above %u Hz, use the ETR input", FETCH_COUNTER_MAX_IRQ_RATE * 8);
+    return false;
+  }
+
+  counter_stop();
+
+  frequency = (ticks == 0) ? 0 : (uint32_t)(((uint64_t)edges * clock + ticks / 2) / ticks);
+
+  util_message_uint32(chp, "edges", &edges, 1);
+  util_message_uint32(chp, "ticks", &ticks, 1);
+  util_message_uint32(chp, "clock", &clock, 1);
+  util_message_uint32(chp, "frequency_hz", &frequency, 1);
+
+  return true;
+}
+
+static bool fetch_counter_pulse_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  const counter_input_t * input;
+  TIM_TypeDef * tim;
+  char * endptr;
+  systime_t start;
+  uint32_t captures = 0;
+  uint32_t period = 0, high = 0;
+  uint32_t clock = COUNTER_CLOCK;
+  uint32_t period_ns, width_ns, duty_ppm;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  input = parse_counter_input(data_list[0], data_list[1]);
+
+  if( input == NULL )
+  {
+    util_message_error(chp, "invalid port/pin, not a counter input");
+    return false;
+  }
+
+  if( input->tim == TIM5 && fetch_encoder_running() )
+  {
+    util_message_error(chp, "TIM5 in use by the encoder");
+    return false;
+  }
+
+  if( data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing timeout");
+    return false;
+  }
+
+  int32_t timeout = strtol(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || timeout <= 0 )
+  {
+    util_message_error(chp, "invalid timeout");
+    return false;
+  }
+
+  counter_start(input);
+  tim = input->tim;
+
+  // PWM input: TI1FP1 rising -> IC1 and counter reset, TI1FP2 falling -> IC2
+  tim->PSC = 0;
+  tim->ARR = 0xffffffff;
+  tim->CCMR1 = TIM_CCMR1_CC1S_0 | TIM_CCMR1_CC2S_1;
+  tim->CCER = TIM_CCER_CC1E | TIM_CCER_CC2E | TIM_CCER_CC2P;
+  tim->SMCR = TIM_SMCR_TS_2 | TIM_SMCR_TS_0 | TIM_SMCR_SMS_2;
+  tim->EGR = TIM_EGR_UG;
+  tim->SR = 0;
+  tim->CR1 = TIM_CR1_CEN;
+
+  // the first capture only marks the start of a complete period
+  start = chVTGetSystemTime();
+  while( captures < 2 && chVTTimeElapsedSinceX(start) < MS2ST(timeout) )
+  {
+    if( tim->SR & TIM_SR_CC1IF )
+    {
+      chSysLock();
+      period = tim->CCR1;
+      high = tim->CCR2;
+      chSysUnlock();
+      captures++;
+    }
+    else
+    {
+      chThdSleep(1);
+    }
+  }
+
+  counter_stop();
+
+  if( captures < 2 )
+  {
+    util_message_error(chp, "no signal");
+    return false;
+  }
+
+  period_ns = (uint32_t)(((uint64_t)period * 1000000000) / clock);
+  width_ns = (uint32_t)(((uint64_t)high * 1000000000) / clock);
+  duty_ppm = (period == 0) ? 0 : (uint32_t)(((uint64_t)high * 1000000) / period);
+
+  util_message_uint32(chp, "period_ticks", &period, 1);
+  util_message_uint32(chp, "high_ticks", &high, 1);
+  util_message_uint32(chp, "clock", &clock, 1);
+  util_message_uint32(chp, "period_ns", &period_ns, 1);
+  util_message_uint32(chp, "width_ns", &width_ns, 1);
+  util_message_uint32(chp, "duty_ppm", &duty_ppm, 1);
+
+  return true;
+}
+
+static bool fetch_counter_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  return fetch_counter_reset(chp);
+}
+
+void fetch_counter_init(BaseSequentialStream * chp)
+{
+  static bool counter_init_flag = false;
+
+  if( counter_init_flag )
+    return;
+
+  fetch_counter_reset(chp);
+
+  counter_init_flag = true;
+}
+
+/*! \brief dispatch a counter command
+ */
+bool fetch_counter_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  return fetch_dispatch(chp, fetch_counter_commands, cmd_list[FETCH_TOK_SUBCMD_0], cmd_list, data_list);
+}
+
+bool fetch_counter_reset(BaseSequentialStream * chp)
+{
+  counter_stop();
+
+  return true;
+}
+
+/*! @} */
@@ -0,0 +1,862 @@
+/*! \file fetch_ctrl.c
+  *
+  * Closed loop control: ADC input -> PID -> DAC output
+  *
+  * \sa fetch.c
+  * @defgroup fetch_ctrl Fetch Control Loop
+  * @{
+  */
+
+/*!
+ * <hr>
+ *
+ *  The loop runs entirely in interrupt context so the shell thread and
+ *  USB latency never add jitter:
+ *
+ *    GPT (TIM7) tick -> adcStartConversionI() -> ADC end callback
+ *                    -> fixed point PID -> fetch_dac_write_i()
+ *
+ *  Gains are entered in physical units (per second / seconds) and kept as
+ *  entered, the Q16.16 per sample values the ISR uses are derived from them
+ *  whenever the gains or the loop rate change. Measurements,
+ *  setpoint and output limits are in raw ADC and DAC counts.
+ *
+ * <hr>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_messages.h"
+#include "util_ring.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+#include "fetch_adc.h"
+#include "fetch_dac.h"
+
+#include "fetch_ctrl.h"
+
+#ifndef FETCH_CTRL_MAX_CHANNELS
+#define FETCH_CTRL_MAX_CHANNELS       8
+#endif
+
+#ifndef FETCH_CTRL_MIN_RATE
+#define FETCH_CTRL_MIN_RATE           16
+#endif
+
+#ifndef FETCH_CTRL_MAX_RATE
+#define FETCH_CTRL_MAX_RATE           20000
+#endif
+
+#ifndef FETCH_CTRL_TELEMETRY_DEPTH
+#define FETCH_CTRL_TELEMETRY_DEPTH    512     //!< must be a power of two
+#endif
+
+#ifndef FETCH_CTRL_TELEMETRY_BATCH
+#define FETCH_CTRL_TELEMETRY_BATCH    128
+#endif
+
+#define CTRL_GPT_FREQUENCY            1000000
+#define CTRL_ADC_SAMPLE               ADC_SAMPLE_56
+#define CTRL_DAC_MAX                  0xfff
+#define CTRL_Q16_ONE                  65536.0f
+#define CTRL_MAX_GAIN                 32767.0f
+
+enum {
+  CTRL_CONFIG_DEV = 0,
+  CTRL_CONFIG_DAC_CH,
+  CTRL_CONFIG_RATE,
+  CTRL_CONFIG_CHANNELS
+};
+
+/*! \brief loop tuning, shared between the shell thread and the ISR
+ */
+typedef struct ctrl_params
+{
+  int32_t kp;         //!< Q16.16
+  int32_t ki;         //!< Q16.16 per sample
+  int32_t kd;         //!< Q16.16 samples
+  int32_t setpoint;   //!< adc counts
+  int32_t out_min;    //!< dac counts
+  int32_t out_max;    //!< dac counts
+} ctrl_params_t;
+
+/*! \brief one telemetry record
+ */
+typedef struct ctrl_sample
+{
+  uint32_t sequence;
+  uint16_t measured;
+  uint16_t output;
+} ctrl_sample_t;
+
+static const char * ctrl_dev_tok[] = {"ADC1", "ADC2", "ADC3"};
+static const char * ctrl_ch_tok[] = {"CH0","CH1","CH2","CH3","CH4","CH5","CH6","CH7","CH8","CH9","CH10","CH11","CH12","CH13","CH14","CH15","SENSOR","VREFINT","VBAT"};
+
+static void ctrl_gpt_cb(GPTDriver * gptp);
+static void ctrl_adc_end_cb(ADCDriver * adcp, adcsample_t * buffer, size_t n);
+static void ctrl_adc_error_cb(ADCDriver * adcp, adcerror_t err);
+
+static bool fetch_ctrl_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_gains_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_setpoint_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_limits_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_start_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_status_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_telemetry_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_decimate_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_ctrl_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+static const char ctrl_config_help_string[] = "Configure control loop\n" \
+                      "Usage: config(<dev>,<dac channel>,<rate>,<channel>,...)\n" \
+                      "\tdev = ADC1 | ADC2 | ADC3\n" \
+                      "\tdac channel = 0 ... 3 {external} | 4 {internal}\n" \
+                      "\trate = <loop rate in Hz>\n" \
+                      "\tchannel = CH0 ... CH15 {averaged, repeat a channel to oversample}";
+
+static const char ctrl_gains_help_string[] = "Set PID gains, allowed while running\n" \
+                      "Usage: gains(<kp>,<ki>,<kd>)\n" \
+                      "\tkp = dac counts per adc count\n" \
+                      "\tki = kp per second\n" \
+                      "\tkd = kp seconds";
+
+static fetch_command_t fetch_ctrl_commands[] = {
+  /*  function                    command string      help string */
+    { fetch_ctrl_help_cmd,        "help",             "Display control loop help" },
+    { fetch_ctrl_config_cmd,      "config",           ctrl_config_help_string },
+    { fetch_ctrl_gains_cmd,       "gains",            ctrl_gains_help_string },
+    { fetch_ctrl_setpoint_cmd,    "setpoint",         "Set target, allowed while running\nUsage: setpoint(<adc counts>)" },
+    { fetch_ctrl_limits_cmd,      "limits",           "Set output clamp, allowed while running\nUsage: limits(<min>,<max>)" },
+    { fetch_ctrl_start_cmd,       "start",            "Start control loop" },
+    { fetch_ctrl_stop_cmd,        "stop",             "Stop control loop, output holds last value" },
+    { fetch_ctrl_status_cmd,      "status",           "Current control loop status" },
+    { fetch_ctrl_telemetry_cmd,   "telemetry",        "Return buffered loop samples" },
+    { fetch_ctrl_decimate_cmd,    "decimate",         "Record every nth loop sample\nUsage: decimate(<n>)\n\tn = 0 {off} | 1 ..." },
+    { fetch_ctrl_reset_cmd,       "reset",            "Stop and reset control loop" },
+    { NULL, NULL, NULL }
+  };
+
+static ADCDriver * ctrl_adc = NULL;
+
+static uint16_t ctrl_dac_channel = 0;
+
+static uint32_t ctrl_rate = 0;
+
+static bool ctrl_running = false;
+
+static adcsample_t ctrl_samples[FETCH_CTRL_MAX_CHANNELS];
+
+static volatile ctrl_params_t ctrl_params;
+
+static float ctrl_gains[3] = {0.0f, 0.0f, 0.0f};  //!< kp, ki, kd as entered
+
+static volatile int64_t ctrl_integrator = 0;   //!< Q16.16
+static volatile int32_t ctrl_prev_measured = 0;
+static volatile uint16_t ctrl_last_measured = 0;
+static volatile uint16_t ctrl_last_output = 0;
+
+static volatile uint32_t ctrl_iterations = 0;
+static volatile uint32_t ctrl_overruns = 0;
+static volatile uint32_t ctrl_dac_drops = 0;
+static volatile uint32_t ctrl_adc_errors = 0;
+
+static volatile uint32_t ctrl_decimation = 1;
+
+static ctrl_sample_t ctrl_telemetry_buffer[FETCH_CTRL_TELEMETRY_DEPTH];
+static util_ring_t ctrl_telemetry;
+
+/*! \brief GPT configuration, loop period set by gptStartContinuous()
+ */
+static const GPTConfig ctrl_gpt_cfg = {
+  .frequency = CTRL_GPT_FREQUENCY,
+  .callback  = ctrl_gpt_cb,
+  .cr2       = 0,
+  .dier      = 0
+};
+
+/*! \brief ADC conversion group configuration
+ */
+static ADCConversionGroup ctrl_conv_grp = {
+	.circular        = false,
+	.num_channels    = 0,
+	.end_cb          = ctrl_adc_end_cb,
+	.error_cb        = ctrl_adc_error_cb,
+	/* HW dependent part.*/
+	.cr1             = 0,
+	.cr2             = ADC_CR2_SWSTART,
+	.smpr1           = 0,
+	.smpr2           = 0,
+	.sqr1            = 0,
+	.sqr2            = 0,
+	.sqr3            = 0
+};
+
+static int32_t clamp_int32(int64_t value, int32_t lo, int32_t hi)
+{
+  if( value < lo )
+  {
+    return lo;
+  }
+  else if( value > hi )
+  {
+    return hi;
+  }
+  return (int32_t)value;
+}
+
+/*! \brief one PID iteration, called from the ADC ISR
+ *
+ *  Derivative acts on the measurement so setpoint steps do not kick the
+ *  output, and the integrator is clamped to the output range (anti-windup).
+ */
+static uint16_t ctrl_pid_step(int32_t measured)
+{
+  int32_t error = ctrl_params.setpoint - measured;
+  int64_t out_lo = (int64_t)ctrl_params.out_min << 16;
+  int64_t out_hi = (int64_t)ctrl_params.out_max << 16;
+  int64_t integrator;
+  int64_t acc;
+
+  integrator = ctrl_integrator + (int64_t)ctrl_params.ki * error;
+
+  if( integrator < out_lo )
+  {
+    integrator = out_lo;
+  }
+  else if( integrator > out_hi )
+  {
+    integrator = out_hi;
+  }
+  ctrl_integrator = integrator;
+
+  acc  = (int64_t)ctrl_params.kp * error;
+  acc += integrator;
+  if( ctrl_iterations > 0 )
+  {
+    acc += (int64_t)ctrl_params.kd * (ctrl_prev_measured - measured);
+  }
+  ctrl_prev_measured = measured;
+
+  return (uint16_t)clamp_int32(acc >> 16, ctrl_params.out_min, ctrl_params.out_max);
+}
+
+/*! \brief loop tick, start the next conversion
+ */
+static void ctrl_gpt_cb(GPTDriver * gptp)
+{
+  (void)gptp;
+
+  chSysLockFromISR();
+  if( ctrl_adc->state == ADC_READY )
+  {
+    adcStartConversionI(ctrl_adc, &ctrl_conv_grp, ctrl_samples, 1);
+  }
+  else
+  {
+    // previous iteration has not finished
+    ctrl_overruns++;
+  }
+  chSysUnlockFromISR();
+}
+
+/*! \brief conversion done, run the loop and update the output
+ */
+static void ctrl_adc_end_cb(ADCDriver * adcp, adcsample_t * buffer, size_t n)
+{
+  uint32_t sum = 0;
+  uint16_t output;
+  ctrl_sample_t sample;
+
+  (void)n;
+
+  for( uint32_t i = 0; i < adcp->grpp->num_channels; i++ )
+  {
+    sum += buffer[i];
+  }
+  ctrl_last_measured = sum / adcp->grpp->num_channels;
+
+  output = ctrl_pid_step(ctrl_last_measured);
+  ctrl_last_output = output;
+
+  chSysLockFromISR();
+  if( !fetch_dac_write_i(ctrl_dac_channel, output) )
+  {
+    ctrl_dac_drops++;
+  }
+  chSysUnlockFromISR();
+
+  if( ctrl_decimation != 0 && (ctrl_iterations % ctrl_decimation) == 0 )
+  {
+    sample.sequence = ctrl_iterations;
+    sample.measured = ctrl_last_measured;
+    sample.output = output;
+    util_ring_put(&ctrl_telemetry, &sample);
+  }
+
+  ctrl_iterations++;
+}
+
+static void ctrl_adc_error_cb(ADCDriver * adcp, adcerror_t err)
+{
+  (void)adcp;
+  (void)err;
+
+  ctrl_adc_errors++;
+}
+
+/*! \brief parse a gain in physical units
+ */
+static bool parse_gain(char * str, float * gain)
+{
+  char * endptr;
+
+  if( str == NULL )
+  {
+    return false;
+  }
+
+  *gain = strtof(str, &endptr);
+
+  return (*endptr == '\0');
+}
+
+/*! \brief convert kp, ki, kd as entered to Q16.16 per sample values
+ *  \returns false if one does not fit at this loop rate
+ */
+static bool ctrl_scale_gains(const float gains[3], uint32_t rate, int32_t scaled[3])
+{
+  float value[3] = { gains[0], gains[1] / rate, gains[2] * rate };
+
+  for( uint32_t i = 0; i < 3; i++ )
+  {
+    // written so a NaN fails too
+    if( !(value[i] <= CTRL_MAX_GAIN && value[i] >= -CTRL_MAX_GAIN) )
+    {
+      return false;
+    }
+    scaled[i] = (int32_t)(value[i] * CTRL_Q16_ONE);
+  }
+
+  return true;
+}
+
+static void ctrl_load_gains(const int32_t scaled[3])
+{
+  chSysLock();
+  ctrl_params.kp = scaled[0];
+  ctrl_params.ki = scaled[1];
+  ctrl_params.kd = scaled[2];
+  chSysUnlock();
+}
+
+static bool fetch_ctrl_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  util_message_info(chp, "Fetch Control Loop Help:");
+  fetch_display_help(chp, fetch_ctrl_commands);
+	return true;
+}
+
+static bool fetch_ctrl_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+  ADCDriver * adc_drv;
+  int tok_num;
+  uint32_t num_channels = 0;
+  uint32_t sqr2 = 0;
+  uint32_t sqr3 = 0;
+  int32_t scaled[3];
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, CTRL_CONFIG_CHANNELS + FETCH_CTRL_MAX_CHANNELS) )
+  {
+    return false;
+  }
+
+  if( ctrl_running )
+  {
+    util_message_error(chp, "control loop running");
+    util_message_info(chp, "use ctrl.stop");
+    return false;
+  }
+
+  switch( token_match( data_list[CTRL_CONFIG_DEV], FETCH_MAX_DATA_STRLEN,
+                       ctrl_dev_tok, NELEMS(ctrl_dev_tok)) )
+  {
+#if STM32_ADC_USE_ADC1
+    case 0:
+      adc_drv = &ADCD1;
+      break;
+#endif
+#if STM32_ADC_USE_ADC2
+    case 1:
+      adc_drv = &ADCD2;
+      break;
+#endif
+#if STM32_ADC_USE_ADC3
+    case 2:
+      adc_drv = &ADCD3;
+      break;
+#endif
+    default:
+      util_message_error(chp, "invalid adc device");
+      return false;
+  }
+
+  if( data_list[CTRL_CONFIG_DAC_CH] == NULL )
+  {
+    util_message_error(chp, "missing dac channel");
+    return false;
+  }
+
+  int32_t dac_channel = strtol(data_list[CTRL_CONFIG_DAC_CH], &endptr, 0);
+
+  if( *endptr != '\0' || dac_channel < 0 || dac_channel > 4 )
+  {
+    util_message_error(chp, "invalid dac channel");
+    return false;
+  }
+
+  if( data_list[CTRL_CONFIG_RATE] == NULL )
+  {
+    util_message_error(chp, "missing loop rate");
+    return false;
+  }
+
+  int32_t rate = strtol(data_list[CTRL_CONFIG_RATE], &endptr, 0);
+
+  if( *endptr != '\0' || rate < FETCH_CTRL_MIN_RATE || rate > FETCH_CTRL_MAX_RATE )
+  {
+    util_message_error(chp, "invalid loop rate. Range: %u-%u", FETCH_CTRL_MIN_RATE, FETCH_CTRL_MAX_RATE);
+    return false;
+  }
+
+  if( data_list[CTRL_CONFIG_CHANNELS] == NULL )
+  {
+    util_message_error(chp, "missing adc channels");
+    return false;
+  }
+
+  for( int i = 0; i < FETCH_CTRL_MAX_CHANNELS && data_list[CTRL_CONFIG_CHANNELS + i] != NULL; i++ )
+  {
+    tok_num = token_match( data_list[CTRL_CONFIG_CHANNELS + i], FETCH_MAX_DATA_STRLEN,
+                           ctrl_ch_tok, NELEMS(ctrl_ch_tok) );
+    if( tok_num == TOKEN_NOT_FOUND )
+    {
+      util_message_error(chp, "invalid adc channel");
+      return false;
+    }
+
+    switch( num_channels )
+    {
+      case 0:
+        sqr3 |= ADC_SQR3_SQ1_N(tok_num);
+        break;
+      case 1:
+        sqr3 |= ADC_SQR3_SQ2_N(tok_num);
+        break;
+      case 2:
+        sqr3 |= ADC_SQR3_SQ3_N(tok_num);
+        break;
+      case 3:
+        sqr3 |= ADC_SQR3_SQ4_N(tok_num);
+        break;
+      case 4:
+        sqr3 |= ADC_SQR3_SQ5_N(tok_num);
+        break;
+      case 5:
+        sqr3 |= ADC_SQR3_SQ6_N(tok_num);
+        break;
+      case 6:
+        sqr2 |= ADC_SQR2_SQ7_N(tok_num);
+        break;
+      case 7:
+        sqr2 |= ADC_SQR2_SQ8_N(tok_num);
+        break;
+    }
+    num_channels++;
+  }
+
+  if( data_list[CTRL_CONFIG_CHANNELS + num_channels] != NULL )
+  {
+    util_message_error(chp, "too many channels");
+    return false;
+  }
+
+  if( !ctrl_scale_gains(ctrl_gains, rate, scaled) )
+  {
+    util_message_error(chp, "gains out of range at this loop rate");
+    return false;
+  }
+
+  // everything checked, nothing was changed before this point
+  ctrl_conv_grp.num_channels = num_channels;
+  ctrl_conv_grp.sqr1 = ADC_SQR1_NUM_CH(num_channels);
+  ctrl_conv_grp.sqr2 = sqr2;
+  ctrl_conv_grp.sqr3 = sqr3;
+
+  ctrl_conv_grp.smpr1 = ADC_SMPR1_SMP_AN10(   CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR1_SMP_AN11(   CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR1_SMP_AN12(   CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR1_SMP_AN13(   CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR1_SMP_AN14(   CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR1_SMP_AN15(   CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR1_SMP_SENSOR( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR1_SMP_VREF(   CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR1_SMP_VBAT(   CTRL_ADC_SAMPLE );
+
+  ctrl_conv_grp.smpr2 = ADC_SMPR2_SMP_AN0( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN1( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN2( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN3( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN4( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN5( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN6( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN7( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN8( CTRL_ADC_SAMPLE ) |
+                        ADC_SMPR2_SMP_AN9( CTRL_ADC_SAMPLE );
+
+  ctrl_adc = adc_drv;
+  ctrl_dac_channel = dac_channel;
+  ctrl_rate = rate;
+  ctrl_load_gains(scaled);
+
+  return true;
+}
+
+static bool fetch_ctrl_gains_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  float gains[3];
+  int32_t scaled[3];
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  if( !parse_gain(data_list[0], &gains[0]) ||
+      !parse_gain(data_list[1], &gains[1]) ||
+      !parse_gain(data_list[2], &gains[2]) ||
+      !ctrl_scale_gains(gains, (ctrl_rate == 0) ? FETCH_CTRL_MIN_RATE : ctrl_rate, scaled) )
+  {
+    util_message_error(chp, "invalid gain");
+    return false;
+  }
+
+  memcpy(ctrl_gains, gains, sizeof(ctrl_gains));
+
+  // before config the rate is unknown, config scales them
+  if( ctrl_rate != 0 )
+  {
+    ctrl_load_gains(scaled);
+  }
+
+  return true;
+}
+
+static bool fetch_ctrl_setpoint_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing setpoint");
+    return false;
+  }
+
+  int32_t setpoint = strtol(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || setpoint < 0 || setpoint > 0xfff )
+  {
+    util_message_error(chp, "invalid setpoint");
+    return false;
+  }
+
+  ctrl_params.setpoint = setpoint;
+
+  return true;
+}
+
+static bool fetch_ctrl_limits_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 2) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL || data_list[1] == NULL )
+  {
+    util_message_error(chp, "missing limits");
+    return false;
+  }
+
+  int32_t out_min = strtol(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || out_min < 0 || out_min > CTRL_DAC_MAX )
+  {
+    util_message_error(chp, "invalid minimum");
+    return false;
+  }
+
+  int32_t out_max = strtol(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || out_max < out_min || out_max > CTRL_DAC_MAX )
+  {
+    util_message_error(chp, "invalid maximum");
+    return false;
+  }
+
+  chSysLock();
+  ctrl_params.out_min = out_min;
+  ctrl_params.out_max = out_max;
+  chSysUnlock();
+
+  return true;
+}
+
+static bool fetch_ctrl_start_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  if( ctrl_adc == NULL )
+  {
+    util_message_error(chp, "control loop not configured");
+    return false;
+  }
+
+  if( ctrl_running )
+  {
+    util_message_error(chp, "control loop running");
+    return false;
+  }
+
+  if( !fetch_adc_claim(ctrl_adc) )
+  {
+    util_message_error(chp, "ADC not ready");
+    return false;
+  }
+
+  if( !fetch_dac_claim(ctrl_dac_channel) )
+  {
+    fetch_adc_release(ctrl_adc);
+    util_message_error(chp, "DAC channel busy");
+    util_message_info(chp, "use dac.stop");
+    return false;
+  }
+
+  ctrl_integrator = 0;
+  ctrl_prev_measured = 0;
+  ctrl_iterations = 0;
+  ctrl_overruns = 0;
+  ctrl_dac_drops = 0;
+  ctrl_adc_errors = 0;
+  util_ring_reset(&ctrl_telemetry);
+
+  ctrl_running = true;
+
+  gptStart(&GPTD7, &ctrl_gpt_cfg);
+  gptStartContinuous(&GPTD7, CTRL_GPT_FREQUENCY / ctrl_rate);
+
+  return true;
+}
+
+static void ctrl_stop(void)
+{
+  if( !ctrl_running )
+  {
+    return;
+  }
+
+  gptStopTimer(&GPTD7);
+  gptStop(&GPTD7);
+  adcStopConversion(ctrl_adc);
+  fetch_adc_release(ctrl_adc);
+  fetch_dac_release();
+
+  ctrl_running = false;
+}
+
+static bool fetch_ctrl_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  ctrl_stop();
+
+  return true;
+}
+
+static bool fetch_ctrl_status_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  uint32_t value;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  util_message_bool(chp, "running", ctrl_running);
+  util_message_uint32(chp, "rate", &ctrl_rate, 1);
+  value = ctrl_params.setpoint;
+  util_message_uint32(chp, "setpoint", &value, 1);
+  value = ctrl_last_measured;
+  util_message_uint32(chp, "measured", &value, 1);
+  value = ctrl_last_output;
+  util_message_uint32(chp, "output", &value, 1);
+  value = ctrl_iterations;
+  util_message_uint32(chp, "iterations", &value, 1);
+  value = ctrl_overruns;
+  util_message_uint32(chp, "overruns", &value, 1);
+  value = ctrl_dac_drops;
+  util_message_uint32(chp, "dac_drops", &value, 1);
+  value = ctrl_adc_errors;
+  util_message_uint32(chp, "adc_errors", &value, 1);
+
+  return true;
+}
+
+/*! \brief drain up to one batch of telemetry records
+ */
+static bool fetch_ctrl_telemetry_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint32_t sequence[FETCH_CTRL_TELEMETRY_BATCH];
+  static uint16_t measured[FETCH_CTRL_TELEMETRY_BATCH];
+  static uint16_t output[FETCH_CTRL_TELEMETRY_BATCH];
+  ctrl_sample_t sample;
+  uint32_t count = 0;
+  uint32_t value;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  while( count < FETCH_CTRL_TELEMETRY_BATCH && util_ring_get(&ctrl_telemetry, &sample) )
+  {
+    sequence[count] = sample.sequence;
+    measured[count] = sample.measured;
+    output[count] = sample.output;
+    count++;
+  }
+
+  util_message_uint32(chp, "count", &count, 1);
+  value = util_ring_count(&ctrl_telemetry);
+  util_message_uint32(chp, "pending", &value, 1);
+  value = util_ring_take_overflows(&ctrl_telemetry);
+  util_message_uint32(chp, "overflows", &value, 1);
+  util_message_uint32(chp, "sequence", sequence, count);
+  util_message_uint16(chp, "measured", measured, count);
+  util_message_uint16(chp, "output", output, count);
+
+  return true;
+}
+
+static bool fetch_ctrl_decimate_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing decimation");
+    return false;
+  }
+
+  int32_t decimation = strtol(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || decimation < 0 )
+  {
+    util_message_error(chp, "invalid decimation");
+    return false;
+  }
+
+  ctrl_decimation = decimation;
+
+  return true;
+}
+
+static bool fetch_ctrl_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  return fetch_ctrl_reset(chp);
+}
+
+void fetch_ctrl_init(BaseSequentialStream * chp)
+{
+  static bool ctrl_init_flag = false;
+
+  if( ctrl_init_flag )
+    return;
+
+  util_ring_init(&ctrl_telemetry, ctrl_telemetry_buffer, sizeof(ctrl_sample_t), FETCH_CTRL_TELEMETRY_DEPTH);
+
+  fetch_ctrl_reset(chp);
+
+  ctrl_init_flag = true;
+}
+
+/*! \brief dispatch a control loop command
+ */
+bool fetch_ctrl_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  return fetch_dispatch(chp, fetch_ctrl_commands, cmd_list[FETCH_TOK_SUBCMD_0], cmd_list, data_list);
+}
+
+bool fetch_ctrl_reset(BaseSequentialStream * chp)
+{
+  ctrl_stop();
+
+  ctrl_adc = NULL;
+  ctrl_rate = 0;
+  ctrl_decimation = 1;
+
+  ctrl_gains[0] = 0.0f;
+  ctrl_gains[1] = 0.0f;
+  ctrl_gains[2] = 0.0f;
+
+  ctrl_params.kp = 0;
+  ctrl_params.ki = 0;
+  ctrl_params.kd = 0;
+  ctrl_params.setpoint = 0;
+  ctrl_params.out_min = 0;
+  ctrl_params.out_max = CTRL_DAC_MAX;
+
+  util_ring_reset(&ctrl_telemetry);
+
+  return true;
+}
+
+/*! @} */
@@ -37,6 +37,15 @@
 //#include "dac.h"
 #include "fetch_dac.h"
 
+#ifndef FETCH_DAC_DDS_MAX_POINTS
+#define FETCH_DAC_DDS_MAX_POINTS    256
+#endif
+
+#define DAC_DDS_MIN_POINTS          8         //!< even, below this the sine is too coarse
+#define DAC_DDS_MAX_RATE            1000000   //!< DAC output settling limits the update rate
+#define DAC_DDS_MAX_DIVIDER         65536     //!< TIM6 is a 16 bit timer
+#define DAC_MAX                     0xfff
+
 /* Reference STF4 Reference
  *   Once the DAC channelx is enabled, the corresponding GPIO pin (PA4 or PA5) is
  *   automatically connected to the analog converter output (DAC_OUTx). In order to avoid
@@ -48,25 +57,54 @@ DACConfig dac1_cfg;
 static bool fetch_dac_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_dac_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_dac_write_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_dac_dds_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_dac_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_dac_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 
+static const char dac_dds_help_string[] = "Generate a sine wave on the internal DAC (channel 4)\n" \
+                      "Usage: dds(<frequency>,<amplitude>,<offset>)\n" \
+                      "\tfrequency = <Hz> {actual frequency is returned}\n" \
+                      "\tamplitude = <peak dac counts>\n" \
+                      "\toffset = <dac counts>";
+
 static fetch_command_t fetch_dac_commands[] = {
     { fetch_dac_help_cmd,   "help",   "DAC command help" },
     { fetch_dac_write_cmd,  "write",  "Write values to DAC\nUsage: write(<channel>, <value>)" },
+    { fetch_dac_dds_cmd,    "dds",    dac_dds_help_string },
+    { fetch_dac_stop_cmd,   "stop",   "Stop sine output" },
     { fetch_dac_reset_cmd,  "reset",  "Reset all DAC outputs to 0v" },
     { NULL, NULL, NULL }
   };
 
-static bool external_dac_write(uint16_t channel, uint16_t value)
-{
-  uint8_t tx_data[2];
+static dacsample_t dds_table[FETCH_DAC_DDS_MAX_POINTS];
 
-  // External DAC -> DAC124S085
+static bool dds_running = false;
 
-  if( channel > 3 || value > 0xfff)
-  {
-    return false;
-  }
+static bool dac_claimed = false;
+
+static uint16_t dac_claimed_channel = 0;
+
+/*! \brief DAC conversion group, one table entry per TIM6 TRGO
+ */
+static const DACConversionGroup dds_conv_grp = {
+  .num_channels = 1,
+  .end_cb       = NULL,
+  .error_cb     = NULL,
+  .trigger      = DAC_TRG(0)
+};
+
+/*! \brief TIM6 runs at the timer clock, update event drives TRGO
+ */
+static const GPTConfig dds_gpt_cfg = {
+  .frequency = STM32_TIMCLK1,
+  .callback  = NULL,
+  .cr2       = TIM_CR2_MMS_1,
+  .dier      = 0
+};
+
+static void external_dac_word(uint16_t channel, uint16_t value, uint8_t tx_data[2])
+{
+  // External DAC -> DAC124S085
 
   // set channel bits (15..16)
   value |= (channel << 14);
@@ -82,6 +120,39 @@ static bool external_dac_write(uint16_t channel, uint16_t value)
   // make sure the byte order is correct (MSBF 16bit)
   tx_data[0] = value >> 8;
   tx_data[1] = value & 0xff;
+}
+
+/*! \brief release the external DAC !SYNC line when a transfer completes
+ *
+ *  Needed for writes started from interrupt context, harmless for the
+ *  blocking writes which unselect again afterwards.
+ */
+static void external_dac_end_cb(SPIDriver * spip)
+{
+  chSysLockFromISR();
+  spiUnselectI(spip);
+  chSysUnlockFromISR();
+}
+
+/*! \brief true if a channel shares its output path with a claimed one
+ *
+ *  The external channels all share SPI4, so claiming one claims all four.
+ */
+static bool dac_channel_claimed(uint16_t channel)
+{
+  return dac_claimed && ((channel < 4) == (dac_claimed_channel < 4));
+}
+
+static bool external_dac_write(uint16_t channel, uint16_t value)
+{
+  uint8_t tx_data[2];
+
+  if( channel > 3 || value > 0xfff || dac_channel_claimed(channel) )
+  {
+    return false;
+  }
+
+  external_dac_word(channel, value, tx_data);
 
   spiSelect(&SPID4);
   spiSend(&SPID4, 2, tx_data);
@@ -90,6 +161,187 @@ static bool external_dac_write(uint16_t channel, uint16_t value)
   return true;
 }
 
+/*! \brief write a DAC channel from interrupt context
+ *
+ *  Must be called from a locked ISR context. Writes to the external DAC are
+ *  started without waiting; if the previous transfer is still on the bus
+ *  the value is dropped and false is returned.
+ */
+bool fetch_dac_write_i(uint16_t channel, uint16_t value)
+{
+  static uint8_t isr_tx_data[2];
+
+  if( value > 0xfff )
+  {
+    return false;
+  }
+
+  switch(channel)
+  {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+      if( SPID4.state != SPI_READY )
+      {
+        return false;
+      }
+      external_dac_word(channel, value, isr_tx_data);
+      spiSelectI(&SPID4);
+      spiStartSendI(&SPID4, 2, isr_tx_data);
+      return true;
+    case 4:
+      if( DACD1.state != DAC_READY )
+      {
+        return false;
+      }
+      dacPutChannelX(&DACD1, 0, value);
+      return true;
+    default:
+      return false;
+  }
+}
+
+/*! \brief true while a channel, or one sharing its output path, is claimed
+ */
+bool fetch_dac_claimed(uint16_t channel)
+{
+  return dac_channel_claimed(channel);
+}
+
+/*! \brief hand a DAC channel to fetch_dac_write_i()
+ *
+ *  The blocking writes from the shell would race the SPI4 transfers started
+ *  from interrupt context, so they are refused until fetch_dac_release().
+ *  \returns false if already claimed or the DDS is using the channel
+ */
+bool fetch_dac_claim(uint16_t channel)
+{
+  if( dac_claimed || channel > 4 || (channel == 4 && dds_running) )
+  {
+    return false;
+  }
+
+  dac_claimed_channel = channel;
+  dac_claimed = true;
+
+  return true;
+}
+
+/*! \brief return the claimed channel to the shell
+ *
+ *  Call once no more writes can be started from interrupt context, a last
+ *  transfer still on the bus is waited for.
+ */
+void fetch_dac_release(void)
+{
+  if( !dac_claimed )
+  {
+    return;
+  }
+
+  while( SPID4.state != SPI_READY )
+  {
+    chThdSleepMilliseconds(1);
+  }
+
+  dac_claimed = false;
+}
+
+/*! \brief start a sine wave on the internal DAC
+ *
+ *  The table is replayed by circular DMA, one entry per TIM6 update, so the
+ *  output frequency is TIMCLK1 / (divider * points). Both are chosen to get
+ *  as many points per period as the DAC update rate allows.
+ *
+ *  \param[in]  frequency  requested frequency in Hz
+ *  \param[in]  amplitude  peak amplitude in dac counts
+ *  \param[in]  offset     centre value in dac counts
+ *  \param[out] actual     generated frequency in Hz
+ *  \returns false if the frequency can not be generated
+ */
+bool fetch_dac_dds_start(float frequency, uint16_t amplitude, uint16_t offset, float * actual)
+{
+  uint32_t points;
+  uint32_t divider;
+
+  if( frequency <= 0.0f || amplitude > DAC_MAX || offset > DAC_MAX || dac_channel_claimed(4) )
+  {
+    return false;
+  }
+
+  points = (uint32_t)(DAC_DDS_MAX_RATE / frequency);
+  if( points > FETCH_DAC_DDS_MAX_POINTS )
+  {
+    points = FETCH_DAC_DDS_MAX_POINTS;
+  }
+  // the DAC driver wants an even depth for its half buffer handling
+  points &= ~1U;
+
+  if( points < DAC_DDS_MIN_POINTS )
+  {
+    return false;
+  }
+
+  divider = (uint32_t)((STM32_TIMCLK1 / (frequency * points)) + 0.5f);
+
+  if( divider < (STM32_TIMCLK1 / DAC_DDS_MAX_RATE) )
+  {
+    divider = STM32_TIMCLK1 / DAC_DDS_MAX_RATE;
+  }
+  else if( divider > DAC_DDS_MAX_DIVIDER )
+  {
+    return false;
+  }
+
+  fetch_dac_dds_stop();
+
+  for( uint32_t i = 0; i < points; i++ )
+  {
+    int32_t value = offset + (int32_t)lroundf(amplitude * sinf((2.0f * (float)M_PI * i) / points));
+
+    if( value < 0 )
+    {
+      value = 0;
+    }
+    else if( value > DAC_MAX )
+    {
+      value = DAC_MAX;
+    }
+    dds_table[i] = value;
+  }
+
+  dacStartConversion(&DACD1, &dds_conv_grp, dds_table, points);
+
+  gptStart(&GPTD6, &dds_gpt_cfg);
+  gptStartContinuous(&GPTD6, divider);
+
+  dds_running = true;
+
+  if( actual != NULL )
+  {
+    *actual = (float)STM32_TIMCLK1 / (float)(divider * points);
+  }
+
+  return true;
+}
+
+/*! \brief stop the sine wave, the output holds its last value
+ */
+void fetch_dac_dds_stop(void)
+{
+  if( !dds_running )
+  {
+    return;
+  }
+
+  gptStopTimer(&GPTD6);
+  gptStop(&GPTD6);
+  dacStopConversion(&DACD1);
+
+  dds_running = false;
+}
+
 static bool fetch_dac_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
 {
   if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
@@ -125,6 +377,13 @@ static bool fetch_dac_write_cmd(BaseSequentialStream * chp, char * cmd_list[], c
     return false;
   }
 
+  if( channel >= 0 && channel <= 4 && dac_channel_claimed(channel) )
+  {
+    util_message_error(chp, "DAC in use by the control loop");
+    util_message_info(chp, "use ctrl.stop");
+    return false;
+  }
+
   switch(channel)
   {
     case 0:
@@ -133,6 +392,12 @@ static bool fetch_dac_write_cmd(BaseSequentialStream * chp, char * cmd_list[], c
     case 3:
       return external_dac_write(channel, value);
     case 4:
+      if( dds_running )
+      {
+        util_message_error(chp, "dds running");
+        util_message_info(chp, "use dac.stop");
+        return false;
+      }
       dacPutChannelX(&DACD1, 0, value);
       return true;
     default:
@@ -141,6 +406,75 @@ static bool fetch_dac_write_cmd(BaseSequentialStream * chp, char * cmd_list[], c
   }
 }
 
+static bool fetch_dac_dds_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+  float actual;
+  uint32_t millihertz;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL || data_list[1] == NULL || data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing parameters");
+    return false;
+  }
+
+  float frequency = strtof(data_list[0], &endptr);
+
+  if( *endptr != '\0' || frequency <= 0.0f ) {
+    util_message_error(chp, "invalid frequency");
+    return false;
+  }
+
+  int32_t amplitude = strtol(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || amplitude < 0 || amplitude > DAC_MAX ) {
+    util_message_error(chp, "invalid amplitude");
+    return false;
+  }
+
+  int32_t offset = strtol(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || offset < 0 || offset > DAC_MAX ) {
+    util_message_error(chp, "invalid offset");
+    return false;
+  }
+
+  if( dac_channel_claimed(4) )
+  {
+    util_message_error(chp, "DAC in use by the control loop");
+    util_message_info(chp, "use ctrl.stop");
+    return false;
+  }
+
+  if( !fetch_dac_dds_start(frequency, amplitude, offset, &actual) )
+  {
+    util_message_error(chp, "frequency out of range");
+    return false;
+  }
+
+  millihertz = (uint32_t)(actual * 1000.0f + 0.5f);
+  util_message_uint32(chp, "frequency_mhz", &millihertz, 1);
+
+  return true;
+}
+
+static bool fetch_dac_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  fetch_dac_dds_stop();
+
+  return true;
+}
+
 static bool fetch_dac_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
 {
   if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
@@ -164,7 +498,7 @@ void fetch_dac_init(BaseSequentialStream * chp)
 
   dacStart(&DACD1, &dac1_cfg);
   
-  spi4_cfg.end_cb = NULL;
+  spi4_cfg.end_cb = external_dac_end_cb;
   spi4_cfg.ssport = GPIOE;
   spi4_cfg.sspad = GPIOE_SPI4_NSS;
   spi4_cfg.cr1 = SPI_CR1_CPHA;
@@ -186,6 +520,7 @@ bool fetch_dac_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * da
 
 bool fetch_dac_reset(BaseSequentialStream * chp)
 {
+  fetch_dac_dds_stop();
   dacPutChannelX(&DACD1, 0, 0);
   external_dac_write(0,0);
   external_dac_write(1,0);
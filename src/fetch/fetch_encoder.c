@@ -0,0 +1,477 @@
+/*! \file fetch_encoder.c
+  *
+  * Quadrature encoder counting with timer encoder mode
+  *
+  * \sa fetch.c
+  * @defgroup fetch_encoder Fetch Encoder
+  * @{
+  */
+
+/*!
+ * <hr>
+ *
+ *  TIM5 counts both edges of both inputs (x4) on PH10 (A, TIM5_CH1) and
+ *  PH11 (B, TIM5_CH2), which are the only channel 1/2 pair in gpio_pins on
+ *  an encoder capable timer. TIM5 is 32 bit, so the position is a signed
+ *  32 bit count with no software overflow handling.
+ *
+ *  Velocity is the position change over the last complete window, timed
+ *  with the cycle counter. Streaming records position and velocity at a
+ *  fixed period into a ring that encoder.samples drains.
+ *
+ * <hr>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_messages.h"
+#include "util_ring.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+
+#include "fetch_encoder.h"
+
+#ifndef FETCH_ENCODER_STREAM_DEPTH
+#define FETCH_ENCODER_STREAM_DEPTH    256     //!< must be a power of two
+#endif
+
+#ifndef FETCH_ENCODER_STREAM_BATCH
+#define FETCH_ENCODER_STREAM_BATCH    64
+#endif
+
+#define ENCODER_TIM                   TIM5
+#define ENCODER_AF                    2
+#define ENCODER_MAX_WINDOW_MS         10000   //!< cycle counter wraps after ~25s
+#define ENCODER_DEFAULT_WINDOW_MS     100
+#define ENCODER_MAX_FILTER            15
+
+/*! \brief one streamed record
+ */
+typedef struct encoder_sample
+{
+  uint32_t  time_ms;
+  int32_t   position;
+  int32_t   velocity;
+} encoder_sample_t;
+
+static bool fetch_encoder_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_encoder_start_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_encoder_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_encoder_read_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_encoder_zero_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_encoder_window_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_encoder_stream_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_encoder_samples_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_encoder_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+static const char encoder_start_help_string[] = "Count a quadrature encoder on h,10 (A) and h,11 (B)\n" \
+                      "Usage: start([<filter>[,<pull>]])\n" \
+                      "\tfilter = 0-15 {input filter, see RM0090 ICxF, default 0}\n" \
+                      "\tpull = FLOATING | PULLUP {default FLOATING}";
+
+static const char encoder_stream_help_string[] = "Record position and velocity periodically, 0 stops\n" \
+                      "Usage: stream(<period>)\n" \
+                      "\tperiod = <milliseconds>\n" \
+                      "\tsee samples to read the records";
+
+static fetch_command_t fetch_encoder_commands[] = {
+  /*  function                      command string      help string */
+    { fetch_encoder_help_cmd,       "help",             "Display encoder help" },
+    { fetch_encoder_start_cmd,      "start",            encoder_start_help_string },
+    { fetch_encoder_stop_cmd,       "stop",             "Stop counting and release the pins" },
+    { fetch_encoder_read_cmd,       "read",             "Read position and velocity {counts/s}" },
+    { fetch_encoder_zero_cmd,       "zero",             "Set position to 0" },
+    { fetch_encoder_window_cmd,     "window",           "Set velocity window\nUsage: window(<milliseconds>)" },
+    { fetch_encoder_stream_cmd,     "stream",           encoder_stream_help_string },
+    { fetch_encoder_samples_cmd,    "samples",          "Return buffered stream records" },
+    { fetch_encoder_reset_cmd,      "reset",            "Reset encoder" },
+    { NULL, NULL, NULL }
+  };
+
+static const char * encoder_pull_tok[] = {"FLOATING", "PULLUP"};
+
+static bool encoder_running = false;
+static uint32_t encoder_window_ms = ENCODER_DEFAULT_WINDOW_MS;
+static uint32_t encoder_stream_ms = 0;
+
+static virtual_timer_t encoder_velocity_vt;
+static virtual_timer_t encoder_stream_vt;
+
+// velocity state, written by the velocity timer callback only
+static int32_t encoder_last_position;
+static rtcnt_t encoder_last_cycles;
+static volatile int32_t encoder_velocity = 0;
+
+static encoder_sample_t encoder_stream_buffer[FETCH_ENCODER_STREAM_DEPTH];
+static util_ring_t encoder_stream;
+
+static void encoder_velocity_cb(void * arg)
+{
+  int32_t position = (int32_t)ENCODER_TIM->CNT;
+  rtcnt_t now = chSysGetRealtimeCounterX();
+  rtcnt_t cycles = now - encoder_last_cycles;
+
+  (void)arg;
+
+  if( cycles != 0 )
+  {
+    encoder_velocity = (int32_t)(((int64_t)(position - encoder_last_position) * STM32_HCLK) / (int64_t)cycles);
+  }
+  encoder_last_position = position;
+  encoder_last_cycles = now;
+
+  chSysLockFromISR();
+  chVTSetI(&encoder_velocity_vt, MS2ST(encoder_window_ms), encoder_velocity_cb, NULL);
+  chSysUnlockFromISR();
+}
+
+static void encoder_stream_cb(void * arg)
+{
+  encoder_sample_t sample;
+
+  (void)arg;
+
+  sample.time_ms = ST2MS(chVTGetSystemTimeX());
+  sample.position = (int32_t)ENCODER_TIM->CNT;
+  sample.velocity = encoder_velocity;
+  util_ring_put(&encoder_stream, &sample);
+
+  chSysLockFromISR();
+  chVTSetI(&encoder_stream_vt, MS2ST(encoder_stream_ms), encoder_stream_cb, NULL);
+  chSysUnlockFromISR();
+}
+
+/*! \brief restart the velocity window from the current position
+ */
+static void encoder_velocity_restart(void)
+{
+  chSysLock();
+  encoder_last_position = (int32_t)ENCODER_TIM->CNT;
+  encoder_last_cycles = chSysGetRealtimeCounterX();
+  encoder_velocity = 0;
+  chVTSetI(&encoder_velocity_vt, MS2ST(encoder_window_ms), encoder_velocity_cb, NULL);
+  chSysUnlock();
+}
+
+static void encoder_stop(void)
+{
+  if( !encoder_running )
+  {
+    return;
+  }
+
+  chVTReset(&encoder_stream_vt);
+  chVTReset(&encoder_velocity_vt);
+  encoder_stream_ms = 0;
+
+  ENCODER_TIM->CR1 = 0;
+  rccDisableTIM5(FALSE);
+
+  palSetPadMode(GPIOH, GPIOH_PIN10, PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_FLOATING);
+  palSetPadMode(GPIOH, GPIOH_PIN11, PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_FLOATING);
+
+  encoder_running = false;
+}
+
+/*! \brief true while the encoder owns TIM5 and its pins
+ */
+bool fetch_encoder_running(void)
+{
+  return encoder_running;
+}
+
+static bool fetch_encoder_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  util_message_info(chp, "Fetch Encoder Help:");
+  fetch_display_help(chp, fetch_encoder_commands);
+	return true;
+}
+
+static bool fetch_encoder_start_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+  int32_t filter = 0;
+  iomode_t pull = PAL_STM32_PUPDR_FLOATING;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 2) )
+  {
+    return false;
+  }
+
+  if( data_list[0] != NULL )
+  {
+    filter = strtol(data_list[0], &endptr, 0);
+
+    if( *endptr != '\0' || filter < 0 || filter > ENCODER_MAX_FILTER )
+    {
+      util_message_error(chp, "invalid filter. Range: 0-%u", ENCODER_MAX_FILTER);
+      return false;
+    }
+  }
+
+  if( data_list[1] != NULL )
+  {
+    switch( token_match(data_list[1], FETCH_MAX_DATA_STRLEN, encoder_pull_tok, NELEMS(encoder_pull_tok)) )
+    {
+      case 0:
+        pull = PAL_STM32_PUPDR_FLOATING;
+        break;
+      case 1:
+        pull = PAL_STM32_PUPDR_PULLUP;
+        break;
+      default:
+        util_message_error(chp, "invalid pull");
+        return false;
+    }
+  }
+
+  encoder_stop();
+
+  rccEnableTIM5(FALSE);
+  rccResetTIM5();
+
+  // encoder mode 3, TI1 and TI2 mapped straight to IC1/IC2, both filtered
+  ENCODER_TIM->PSC = 0;
+  ENCODER_TIM->ARR = 0xffffffff;
+  ENCODER_TIM->CCMR1 = TIM_CCMR1_CC1S_0 | TIM_CCMR1_CC2S_0 |
+                       (filter << 4) | (filter << 12);
+  ENCODER_TIM->CCER = 0;
+  ENCODER_TIM->SMCR = TIM_SMCR_SMS_1 | TIM_SMCR_SMS_0;
+  ENCODER_TIM->EGR = TIM_EGR_UG;
+  ENCODER_TIM->CNT = 0;
+  ENCODER_TIM->CR1 = TIM_CR1_CEN;
+
+  palSetPadMode(GPIOH, GPIOH_PIN10, PAL_MODE_ALTERNATE(ENCODER_AF) | pull);
+  palSetPadMode(GPIOH, GPIOH_PIN11, PAL_MODE_ALTERNATE(ENCODER_AF) | pull);
+
+  encoder_running = true;
+  encoder_velocity_restart();
+
+  return true;
+}
+
+static bool fetch_encoder_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  encoder_stop();
+
+  return true;
+}
+
+static bool fetch_encoder_read_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  int32_t position;
+  int32_t velocity;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  if( !encoder_running )
+  {
+    util_message_error(chp, "encoder not started");
+    return false;
+  }
+
+  position = (int32_t)ENCODER_TIM->CNT;
+  velocity = encoder_velocity;
+
+  util_message_int32(chp, "position", &position, 1);
+  util_message_int32(chp, "velocity", &velocity, 1);
+  util_message_uint32(chp, "window_ms", &encoder_window_ms, 1);
+
+  return true;
+}
+
+static bool fetch_encoder_zero_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  if( !encoder_running )
+  {
+    util_message_error(chp, "encoder not started");
+    return false;
+  }
+
+  ENCODER_TIM->CNT = 0;
+  encoder_velocity_restart();
+
+  return true;
+}
+
+static bool fetch_encoder_window_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing window");
+    return false;
+  }
+
+  int32_t window = strtol(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || window <= 0 || window > ENCODER_MAX_WINDOW_MS )
+  {
+    util_message_error(chp, "invalid window. Range: 1-%u", ENCODER_MAX_WINDOW_MS);
+    return false;
+  }
+
+  encoder_window_ms = window;
+
+  if( encoder_running )
+  {
+    encoder_velocity_restart();
+  }
+
+  return true;
+}
+
+static bool fetch_encoder_stream_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing period");
+    return false;
+  }
+
+  int32_t period = strtol(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || period < 0 )
+  {
+    util_message_error(chp, "invalid period");
+    return false;
+  }
+
+  chVTReset(&encoder_stream_vt);
+  encoder_stream_ms = 0;
+  util_ring_reset(&encoder_stream);
+
+  if( period == 0 )
+  {
+    return true;
+  }
+
+  if( !encoder_running )
+  {
+    util_message_error(chp, "encoder not started");
+    return false;
+  }
+
+  encoder_stream_ms = period;
+  chVTSet(&encoder_stream_vt, MS2ST(encoder_stream_ms), encoder_stream_cb, NULL);
+
+  return true;
+}
+
+/*! \brief drain up to one batch of stream records
+ */
+static bool fetch_encoder_samples_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint32_t time_ms[FETCH_ENCODER_STREAM_BATCH];
+  static int32_t position[FETCH_ENCODER_STREAM_BATCH];
+  static int32_t velocity[FETCH_ENCODER_STREAM_BATCH];
+  encoder_sample_t sample;
+  uint32_t count = 0;
+  uint32_t value;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  while( count < FETCH_ENCODER_STREAM_BATCH && util_ring_get(&encoder_stream, &sample) )
+  {
+    time_ms[count] = sample.time_ms;
+    position[count] = sample.position;
+    velocity[count] = sample.velocity;
+    count++;
+  }
+
+  util_message_uint32(chp, "count", &count, 1);
+  value = util_ring_count(&encoder_stream);
+  util_message_uint32(chp, "pending", &value, 1);
+  value = util_ring_take_overflows(&encoder_stream);
+  util_message_uint32(chp, "overflows", &value, 1);
+  util_message_uint32(chp, "time_ms", time_ms, count);
+  util_message_int32(chp, "position", position, count);
+  util_message_int32(chp, "velocity", velocity, count);
+
+  return true;
+}
+
+static bool fetch_encoder_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  return fetch_encoder_reset(chp);
+}
+
+void fetch_encoder_init(BaseSequentialStream * chp)
+{
+  static bool encoder_init_flag = false;
+
+  if( encoder_init_flag )
+    return;
+
+  chVTObjectInit(&encoder_velocity_vt);
+  chVTObjectInit(&encoder_stream_vt);
+  util_ring_init(&encoder_stream, encoder_stream_buffer, sizeof(encoder_sample_t), FETCH_ENCODER_STREAM_DEPTH);
+
+  encoder_init_flag = true;
+}
+
+/*! \brief dispatch an encoder command
+ */
+bool fetch_encoder_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  return fetch_dispatch(chp, fetch_encoder_commands, cmd_list[FETCH_TOK_SUBCMD_0], cmd_list, data_list);
+}
+
+bool fetch_encoder_reset(BaseSequentialStream * chp)
+{
+  encoder_stop();
+  util_ring_reset(&encoder_stream);
+  encoder_window_ms = ENCODER_DEFAULT_WINDOW_MS;
+
+  return true;
+}
+
+/*! @} */
@@ -0,0 +1,627 @@
+/*! \file fetch_flash.c
+  *
+  * JEDEC SPI NOR flash programming on top of fetch_spi
+  *
+  * \sa fetch.c
+  * @defgroup fetch_flash Fetch Flash
+  * @{
+  */
+
+/*!
+ * <hr>
+ *
+ *  The chip is any spi device or profile with a chip select, in 8 bit
+ *  frames. Commands use 3 byte addresses, so up to 16MB is reachable.
+ *
+ *  flash.program returns as soon as the page program is issued. Every
+ *  later command polls the status register until the chip is done, so the
+ *  next page travels over USB while the last one is being written.
+ *
+ *  flash.verify feeds the readback to the CRC unit and returns only the
+ *  CRC: CRC-32/MPEG-2 (poly 0x04c11db7, init 0xffffffff, no reflection,
+ *  no final xor) over the bytes in address order.
+ *
+ * <hr>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_messages.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+
+#include "fetch_spi.h"
+#include "fetch_flash.h"
+
+#ifndef FETCH_FLASH_CHUNK
+#define FETCH_FLASH_CHUNK               1024    //!< bytes per rx line and per CRC block, a multiple of 4
+#endif
+
+#define FLASH_MAX_PROGRAM_BYTES         512     //!< a full line of hex blob data
+#define FLASH_PAGE_SIZE                 256
+#define FLASH_MAX_ADDRESS               0x1000000
+
+#define FLASH_CMD_WRITE_ENABLE          0x06
+#define FLASH_CMD_READ_STATUS           0x05
+#define FLASH_CMD_READ                  0x03
+#define FLASH_CMD_PAGE_PROGRAM          0x02
+#define FLASH_CMD_ERASE_4K              0x20
+#define FLASH_CMD_ERASE_32K             0x52
+#define FLASH_CMD_ERASE_64K             0xd8
+#define FLASH_CMD_ERASE_CHIP            0xc7
+#define FLASH_CMD_JEDEC_ID              0x9f
+
+#define FLASH_STATUS_WIP                0x01
+#define FLASH_STATUS_WEL                0x02
+
+#define FLASH_PROGRAM_TIMEOUT_MS        20
+#define FLASH_ERASE_TIMEOUT_MS          4000    //!< 64K block on slow parts
+#define FLASH_CHIP_ERASE_TIMEOUT_MS     400000
+
+static bool fetch_flash_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_flash_id_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_flash_status_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_flash_read_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_flash_erase_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_flash_program_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_flash_verify_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+static const char flash_erase_help_string[] = "Erase a sector, block or the whole chip\n" \
+                      "Usage: erase(<dev>,<address>,<size>)\n" \
+                      "\tsize = 4K | 32K | 64K | CHIP {address aligned to size, ignored for CHIP}";
+
+static const char flash_program_help_string[] = "Program bytes, returns before the chip is done\n" \
+                      "Usage: program(<dev>,<address>,[<base>],<byte 0>,[...,<byte n>])\n" \
+                      "\tbytes may also be hex blobs, x:DEADBEEF\n" \
+                      "\tpage boundaries are handled, the next command waits for the chip";
+
+static const char flash_verify_help_string[] = "CRC of a range without returning the data\n" \
+                      "Usage: verify(<dev>,<address>,<count>,[<crc>])\n" \
+                      "\tcrc = CRC-32/MPEG-2 of the range, match is returned when given";
+
+static fetch_command_t fetch_flash_commands[] = {
+  /*  function                      command string      help string */
+    { fetch_flash_help_cmd,         "help",             "Display flash help" },
+    { fetch_flash_id_cmd,           "id",               "Read JEDEC id and size\nUsage: id(<dev>)" },
+    { fetch_flash_status_cmd,       "status",           "Read status register\nUsage: status(<dev>)" },
+    { fetch_flash_read_cmd,         "read",             "Read bytes, returned as several rx lines\nUsage: read(<dev>,<address>,<count>)" },
+    { fetch_flash_erase_cmd,        "erase",            flash_erase_help_string },
+    { fetch_flash_program_cmd,      "program",          flash_program_help_string },
+    { fetch_flash_verify_cmd,       "verify",           flash_verify_help_string },
+    { NULL, NULL, NULL }
+  };
+
+enum {
+  FLASH_ERASE_4K = 0,
+  FLASH_ERASE_32K,
+  FLASH_ERASE_64K,
+  FLASH_ERASE_CHIP
+};
+
+//! same order as the FLASH_ERASE_ sizes
+static const char * flash_erase_tok[] = {"4K", "32K", "64K", "CHIP"};
+static const uint8_t flash_erase_cmd[] = {FLASH_CMD_ERASE_4K, FLASH_CMD_ERASE_32K, FLASH_CMD_ERASE_64K, FLASH_CMD_ERASE_CHIP};
+static const uint32_t flash_erase_size[] = {0x1000, 0x8000, 0x10000, 0};
+
+static uint8_t flash_buffer[FETCH_FLASH_CHUNK];
+
+/*! \brief select the chip and send a command with an optional address
+ */
+static void flash_command(SPIDriver * spi_drv, uint8_t cmd, bool with_address, uint32_t address)
+{
+  uint8_t header[4] = { cmd, (address >> 16) & 0xff, (address >> 8) & 0xff, address & 0xff };
+
+  spiSelect(spi_drv);
+  spiSend(spi_drv, with_address ? 4 : 1, header);
+}
+
+static uint8_t flash_read_status(SPIDriver * spi_drv)
+{
+  uint8_t status;
+
+  flash_command(spi_drv, FLASH_CMD_READ_STATUS, false, 0);
+  spiReceive(spi_drv, 1, &status);
+  spiUnselect(spi_drv);
+
+  return status;
+}
+
+/*! \brief poll until the chip has finished writing
+ *
+ *  The status is read back to back for the first tick, program times are
+ *  well below it, longer waits sleep between reads.
+ */
+static bool flash_wait_ready(SPIDriver * spi_drv, uint32_t timeout_ms)
+{
+  systime_t start = chVTGetSystemTime();
+
+  while( flash_read_status(spi_drv) & FLASH_STATUS_WIP )
+  {
+    systime_t elapsed = chVTTimeElapsedSinceX(start);
+
+    if( elapsed > MS2ST(timeout_ms) )
+    {
+      return false;
+    }
+    if( elapsed > 0 )
+    {
+      chThdSleep(1);
+    }
+  }
+
+  return true;
+}
+
+static bool flash_write_enable(SPIDriver * spi_drv)
+{
+  flash_command(spi_drv, FLASH_CMD_WRITE_ENABLE, false, 0);
+  spiUnselect(spi_drv);
+
+  return (flash_read_status(spi_drv) & FLASH_STATUS_WEL) != 0;
+}
+
+/*! \brief the device for a flash command, ready for a new operation
+ *
+ *  \param[in] wait   poll until a program or erase still in progress is done
+ *  \returns NULL after reporting the error
+ */
+static SPIDriver * flash_device(BaseSequentialStream * chp, char * str, bool wait)
+{
+  SPIDriver * spi_drv;
+
+  if( (spi_drv = fetch_spi_device(chp, str)) == NULL )
+  {
+    return NULL;
+  }
+
+  if( spi_drv->config->ssport == NULL )
+  {
+    util_message_error(chp, "no chip select configured");
+    return NULL;
+  }
+
+  if( wait && !flash_wait_ready(spi_drv, FLASH_ERASE_TIMEOUT_MS) )
+  {
+    util_message_error(chp, "flash busy");
+    return NULL;
+  }
+
+  return spi_drv;
+}
+
+/*! \brief parse an address and a byte count that fit the 3 byte address space
+ */
+static bool flash_parse_range(BaseSequentialStream * chp, char * address_str, char * count_str, uint32_t * address, uint32_t * count)
+{
+  char * endptr;
+
+  if( address_str == NULL )
+  {
+    util_message_error(chp, "missing address");
+    return false;
+  }
+
+  *address = strtoul(address_str, &endptr, 0);
+
+  if( *endptr != '\0' || *address >= FLASH_MAX_ADDRESS )
+  {
+    util_message_error(chp, "invalid address");
+    return false;
+  }
+
+  if( count_str == NULL )
+  {
+    return true;
+  }
+
+  *count = strtoul(count_str, &endptr, 0);
+
+  if( *endptr != '\0' || *count == 0 || *count > FLASH_MAX_ADDRESS - *address )
+  {
+    util_message_error(chp, "invalid count");
+    return false;
+  }
+
+  return true;
+}
+
+static bool fetch_flash_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  util_message_info(chp, "Fetch Flash Help:");
+  util_message_info(chp, "dev = <spi dev> | <spi profile> {with chip select}");
+  fetch_display_help(chp, fetch_flash_commands);
+
+  return true;
+}
+
+static bool fetch_flash_id_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  uint8_t id[3];
+  uint32_t size = 0;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  // no status wait, this also has to work on something that is not a flash
+  if( (spi_drv = flash_device(chp, data_list[0], false)) == NULL )
+  {
+    return false;
+  }
+
+  flash_command(spi_drv, FLASH_CMD_JEDEC_ID, false, 0);
+  spiReceive(spi_drv, sizeof(id), id);
+  spiUnselect(spi_drv);
+
+  // the capacity byte is log2 of the size on most parts
+  if( id[2] >= 10 && id[2] <= 31 )
+  {
+    size = 1U << id[2];
+  }
+
+  util_message_hex_uint8(chp, "jedec_id", id, sizeof(id));
+  util_message_uint32(chp, "size", &size, 1);
+
+  return true;
+}
+
+static bool fetch_flash_status_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  uint8_t status;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  if( (spi_drv = flash_device(chp, data_list[0], false)) == NULL )
+  {
+    return false;
+  }
+
+  status = flash_read_status(spi_drv);
+
+  util_message_hex_uint8(chp, "status", &status, 1);
+  util_message_bool(chp, "busy", (status & FLASH_STATUS_WIP) != 0);
+
+  return true;
+}
+
+/*! \brief one read command for the whole range, chip select held between chunks
+ */
+static bool fetch_flash_read_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  uint32_t address, count, remaining;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  if( !flash_parse_range(chp, data_list[1], data_list[2], &address, &count) )
+  {
+    return false;
+  }
+
+  if( data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing count");
+    return false;
+  }
+
+  if( (spi_drv = flash_device(chp, data_list[0], true)) == NULL )
+  {
+    return false;
+  }
+
+  flash_command(spi_drv, FLASH_CMD_READ, true, address);
+
+  for( remaining = count; remaining > 0; )
+  {
+    uint32_t n = (remaining < FETCH_FLASH_CHUNK) ? remaining : FETCH_FLASH_CHUNK;
+
+    spiReceive(spi_drv, n, flash_buffer);
+    util_message_hex_uint8(chp, "rx", flash_buffer, n);
+    remaining -= n;
+  }
+
+  spiUnselect(spi_drv);
+
+  util_message_uint32(chp, "count", &count, 1);
+
+  return true;
+}
+
+static bool fetch_flash_erase_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  uint32_t address;
+  uint32_t timeout_ms;
+  uint32_t time_ms;
+  int32_t size;
+  systime_t start;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  if( !flash_parse_range(chp, data_list[1], NULL, &address, NULL) )
+  {
+    return false;
+  }
+
+  if( data_list[2] == NULL ||
+      (size = token_match(data_list[2], FETCH_MAX_DATA_STRLEN, flash_erase_tok, NELEMS(flash_erase_tok))) == TOKEN_NOT_FOUND )
+  {
+    util_message_error(chp, "invalid size");
+    return false;
+  }
+
+  if( size != FLASH_ERASE_CHIP && (address % flash_erase_size[size]) != 0 )
+  {
+    util_message_error(chp, "address not aligned to size");
+    return false;
+  }
+
+  if( (spi_drv = flash_device(chp, data_list[0], true)) == NULL )
+  {
+    return false;
+  }
+
+  if( !flash_write_enable(spi_drv) )
+  {
+    util_message_error(chp, "write enable failed, chip protected?");
+    return false;
+  }
+
+  start = chVTGetSystemTime();
+
+  flash_command(spi_drv, flash_erase_cmd[size], size != FLASH_ERASE_CHIP, address);
+  spiUnselect(spi_drv);
+
+  timeout_ms = (size == FLASH_ERASE_CHIP) ? FLASH_CHIP_ERASE_TIMEOUT_MS : FLASH_ERASE_TIMEOUT_MS;
+
+  if( !flash_wait_ready(spi_drv, timeout_ms) )
+  {
+    util_message_error(chp, "erase timed out");
+    return false;
+  }
+
+  time_ms = ST2MS(chVTTimeElapsedSinceX(start));
+  util_message_uint32(chp, "time_ms", &time_ms, 1);
+
+  return true;
+}
+
+/*! \brief page program without waiting for the last page
+ *
+ *  Pages before the last one are waited for here, the last one is left
+ *  to the next command.
+ */
+static bool fetch_flash_program_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint8_t data[FLASH_MAX_PROGRAM_BYTES];
+  SPIDriver * spi_drv;
+  uint32_t address;
+  uint32_t byte_count = 0;
+  uint32_t offset;
+  int number_base = 16;
+  uint32_t data_start = 2;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, FLASH_MAX_PROGRAM_BYTES + 3) )
+  {
+    return false;
+  }
+
+  if( !flash_parse_range(chp, data_list[1], NULL, &address, NULL) )
+  {
+    return false;
+  }
+
+  if( !fetch_is_hex_blob(data_list[2]) )
+  {
+    if( data_list[2] == NULL )
+    {
+      util_message_error(chp, "missing data");
+      return false;
+    }
+
+    number_base = strtol(data_list[2], &endptr, 0);
+
+    if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+    {
+      util_message_error(chp, "invalid number base");
+      return false;
+    }
+    data_start = 3;
+  }
+
+  if( !fetch_parse_bytes(chp, &data_list[data_start], number_base, data, FLASH_MAX_PROGRAM_BYTES, &byte_count) )
+  {
+    return false;
+  }
+
+  if( byte_count == 0 || byte_count > FLASH_MAX_ADDRESS - address )
+  {
+    util_message_error(chp, "invalid byte count");
+    return false;
+  }
+
+  if( (spi_drv = flash_device(chp, data_list[0], true)) == NULL )
+  {
+    return false;
+  }
+
+  for( offset = 0; offset < byte_count; )
+  {
+    uint32_t page_room = FLASH_PAGE_SIZE - ((address + offset) % FLASH_PAGE_SIZE);
+    uint32_t n = (byte_count - offset < page_room) ? byte_count - offset : page_room;
+
+    if( offset > 0 && !flash_wait_ready(spi_drv, FLASH_PROGRAM_TIMEOUT_MS) )
+    {
+      util_message_error(chp, "program timed out");
+      return false;
+    }
+
+    if( !flash_write_enable(spi_drv) )
+    {
+      util_message_error(chp, "write enable failed, chip protected?");
+      return false;
+    }
+
+    flash_command(spi_drv, FLASH_CMD_PAGE_PROGRAM, true, address + offset);
+    spiSend(spi_drv, n, &data[offset]);
+    spiUnselect(spi_drv);
+
+    offset += n;
+  }
+
+  util_message_uint32(chp, "count", &byte_count, 1);
+
+  return true;
+}
+
+/*! \brief add bytes to the CRC unit, len a multiple of 4
+ */
+static void flash_crc_words(const uint8_t * buf, uint32_t len)
+{
+  for( uint32_t i = 0; i < len; i += 4 )
+  {
+    CRC->DR = ((uint32_t)buf[i] << 24) | ((uint32_t)buf[i + 1] << 16) | ((uint32_t)buf[i + 2] << 8) | buf[i + 3];
+  }
+}
+
+/*! \brief the same CRC in software for the last 1-3 bytes
+ */
+static uint32_t flash_crc_bytes(uint32_t crc, const uint8_t * buf, uint32_t len)
+{
+  for( uint32_t i = 0; i < len; i++ )
+  {
+    crc ^= (uint32_t)buf[i] << 24;
+    for( uint32_t bit = 0; bit < 8; bit++ )
+    {
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+    }
+  }
+
+  return crc;
+}
+
+static bool fetch_flash_verify_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  uint32_t address, count, remaining;
+  uint32_t expected = 0;
+  uint32_t crc = 0;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 4) )
+  {
+    return false;
+  }
+
+  if( !flash_parse_range(chp, data_list[1], data_list[2], &address, &count) )
+  {
+    return false;
+  }
+
+  if( data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing count");
+    return false;
+  }
+
+  if( data_list[3] != NULL )
+  {
+    expected = strtoul(data_list[3], &endptr, 0);
+
+    if( *endptr != '\0' )
+    {
+      util_message_error(chp, "invalid crc");
+      return false;
+    }
+  }
+
+  if( (spi_drv = flash_device(chp, data_list[0], true)) == NULL )
+  {
+    return false;
+  }
+
+  rccEnableAHB1(RCC_AHB1ENR_CRCEN, FALSE);
+  CRC->CR = CRC_CR_RESET;
+
+  flash_command(spi_drv, FLASH_CMD_READ, true, address);
+
+  // chunks are a multiple of 4 bytes, only the last one can have a tail
+  for( remaining = count; remaining > 0; )
+  {
+    uint32_t n = (remaining < FETCH_FLASH_CHUNK) ? remaining : FETCH_FLASH_CHUNK;
+
+    spiReceive(spi_drv, n, flash_buffer);
+    flash_crc_words(flash_buffer, n & ~3U);
+    remaining -= n;
+
+    if( remaining == 0 )
+    {
+      crc = flash_crc_bytes(CRC->DR, &flash_buffer[n & ~3U], n & 3U);
+    }
+  }
+
+  spiUnselect(spi_drv);
+  rccDisableAHB1(RCC_AHB1ENR_CRCEN, FALSE);
+
+  util_message_uint32(chp, "count", &count, 1);
+  util_message_hex_uint32(chp, "crc", &crc, 1);
+  if( data_list[3] != NULL )
+  {
+    util_message_bool(chp, "match", crc == expected);
+  }
+
+  return true;
+}
+
+void fetch_flash_init(BaseSequentialStream * chp)
+{
+  static bool flash_init_flag = false;
+
+  if( flash_init_flag )
+    return;
+
+  flash_init_flag = true;
+}
+
+/*! \brief dispatch a flash command
+ */
+bool fetch_flash_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  return fetch_dispatch(chp, fetch_flash_commands, cmd_list[FETCH_TOK_SUBCMD_0], cmd_list, data_list);
+}
+
+/*! \brief nothing of its own, the buses are reset by fetch_spi_reset
+ */
+bool fetch_flash_reset(BaseSequentialStream * chp)
+{
+  return true;
+}
+
+/*! @} */
@@ -15,11 +15,47 @@
 #include "util_strings.h"
 #include "util_general.h"
 #include "util_io.h"
+#include "util_ring.h"
+#include "util_timestamp.h"
 
 #include "fetch_defs.h"
 #include "fetch_gpio.h"
+#include "fetch_encoder.h"
 #include "fetch.h"
 
+#define GPIO_EXT_LINES            16        //!< EXTI lines shared by the GPIO ports
+
+#ifndef FETCH_GPIO_DMA_BUFFER_SIZE
+#define FETCH_GPIO_DMA_BUFFER_SIZE  (1024 * 16)   //!< bytes
+#endif
+
+// only DMA2 can reach the GPIO ports on AHB1
+#ifndef FETCH_GPIO_DMA_STREAM
+#define FETCH_GPIO_DMA_STREAM       STM32_DMA_STREAM_ID(2, 7)
+#endif
+
+#ifndef FETCH_GPIO_DMA_MAX_RATE
+#define FETCH_GPIO_DMA_MAX_RATE     4000000
+#endif
+
+#define GPIO_DMA_CHANNEL            7         //!< TIM8_CH4 request on DMA2 stream 7
+#define GPIO_DMA_PRIORITY           3
+#define GPIO_CAPTURE_SAMPLES        (FETCH_GPIO_DMA_BUFFER_SIZE / sizeof(uint16_t))
+#define GPIO_CAPTURE_MAX_DEPTH      (GPIO_CAPTURE_SAMPLES / 2)
+#define GPIO_CAPTURE_SLEEP_MS       4         //!< slack needed before polling may sleep
+#define GPIO_TRIGGER_MAX_MS         60000
+#define GPIO_PATTERN_MAX_WORDS      (FETCH_GPIO_DMA_BUFFER_SIZE / sizeof(uint32_t))
+
+#define GPIO_PULSE_MAX_MS           10000
+#define GPIO_PULSE_MAX_COUNT        256       //!< TIM1 repetition counter
+
+#ifndef FETCH_GPIO_WATCH_DEPTH
+#define FETCH_GPIO_WATCH_DEPTH      512       //!< must be a power of two
+#endif
+
+#ifndef FETCH_GPIO_WATCH_BATCH
+#define FETCH_GPIO_WATCH_BATCH      128
+#endif
 
 static port_pin_t gpio_pins[] = {
     {GPIOA, GPIOA_PIN15}, // TIM2_CH1
@@ -95,11 +131,57 @@ typedef enum {
   WAIT_EVENT_FALLING
 } wait_event_t;
 
+/*! \brief a timer channel output usable by gpio.pulse
+ */
+typedef struct gpio_pulse_pin
+{
+  ioportid_t      port;
+  uint32_t        pin;
+  uint32_t        af;
+  TIM_TypeDef   * tim;
+  uint32_t        channel;        //!< 0-3
+  bool            complementary;  //!< CHxN output
+  uint32_t        clock;
+  uint32_t        max_count;      //!< ARR limit
+} gpio_pulse_pin_t;
+
+static const gpio_pulse_pin_t gpio_pulse_pins[] = {
+  { GPIOA, GPIOA_PIN15, 1, TIM2, 0, false, STM32_TIMCLK1, 0xffffffff },
+  { GPIOB, GPIOB_PIN8,  2, TIM4, 2, false, STM32_TIMCLK1, 0xffff },
+  { GPIOB, GPIOB_PIN9,  2, TIM4, 3, false, STM32_TIMCLK1, 0xffff },
+  { GPIOB, GPIOB_PIN14, 1, TIM1, 1, true,  STM32_TIMCLK2, 0xffff },
+  { GPIOB, GPIOB_PIN15, 1, TIM1, 2, true,  STM32_TIMCLK2, 0xffff },
+  { GPIOC, GPIOC_PIN6,  2, TIM3, 0, false, STM32_TIMCLK1, 0xffff },
+  { GPIOD, GPIOD_PIN12, 2, TIM4, 0, false, STM32_TIMCLK1, 0xffff },
+  { GPIOE, GPIOE_PIN5,  3, TIM9, 0, false, STM32_TIMCLK2, 0xffff },
+  { GPIOE, GPIOE_PIN6,  3, TIM9, 1, false, STM32_TIMCLK2, 0xffff },
+  { GPIOE, GPIOE_PIN8,  1, TIM1, 0, true,  STM32_TIMCLK2, 0xffff },
+  { GPIOE, GPIOE_PIN9,  1, TIM1, 0, false, STM32_TIMCLK2, 0xffff },
+  { GPIOE, GPIOE_PIN10, 1, TIM1, 1, true,  STM32_TIMCLK2, 0xffff },
+  { GPIOH, GPIOH_PIN10, 2, TIM5, 0, false, STM32_TIMCLK1, 0xffffffff },
+  { GPIOH, GPIOH_PIN11, 2, TIM5, 1, false, STM32_TIMCLK1, 0xffffffff },
+  { GPIOH, GPIOH_PIN12, 2, TIM5, 2, false, STM32_TIMCLK1, 0xffffffff },
+  { GPIOI, GPIOI_PIN0,  2, TIM5, 3, false, STM32_TIMCLK1, 0xffffffff },
+};
+
+/*! \brief one watched edge
+ */
+typedef struct gpio_watch_event
+{
+  uint32_t  time_us;    //!< since the watch started
+  uint8_t   port;       //!< 0 = a, 1 = b, ...
+  uint8_t   pin;
+  uint8_t   level;      //!< pin level read in the interrupt
+} gpio_watch_event_t;
+
 // list all command function prototypes here 
 static bool fetch_gpio_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_read_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_read_port_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_read_all_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_read_pins_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_write_port_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_config_port_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_write_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_set_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_clear_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
@@ -107,27 +189,96 @@ static bool fetch_gpio_config_cmd(BaseSequentialStream * chp, char * cmd_list[],
 static bool fetch_gpio_info_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_reset_all_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_wait_cmd(BaseSequentialStream * chp, char *cmd_list[], char * data_list[]);
+static bool fetch_gpio_watch_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_events_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_pulse_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_capture_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_trigger_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_patwrite_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_patstart_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_patstop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_gpio_patstatus_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_gpio_heartbeat_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 
 static const char gpio_config_help_string[] = "Configure pin as GPIO\n" \
                                               "Usage: config(<port>,<pin>,<mode>)\n" \
                                               "\tmode = INPUT_FLOATING, INPUT_PULLUP, INPUT_PULLDOWN,\n" \
                                               "\t       OUTPUT_PUSHPULL, OUTPUT_OPENDRAIN";
+static const char gpio_config_port_help_string[] = "Configure several pins of a port in one step\n" \
+                                                   "Usage: configport(<port>,<mask>,<mode>)\n" \
+                                                   "\tmode = INPUT_FLOATING, INPUT_PULLUP, INPUT_PULLDOWN,\n" \
+                                                   "\t       OUTPUT_PUSHPULL, OUTPUT_OPENDRAIN";
 static const char gpio_wait_help_string[] = "Wait for the given event on a gpio pin\n" \
                                             "Usage: wait(<port>,<pin>,<event>,<timeout>)\n" \
                                             "\tevent = HIGH, LOW, RISING, FALLING\n" \
-                                            "\ttimeout = <milliseconds>\n";
+                                            "\ttimeout = <milliseconds>\n" \
+                                            "Returns edge time, microseconds since the wait started\n" \
+                                            "and interrupt to thread wake up latency in nanoseconds\n";
+static const char gpio_pulse_help_string[] = "Emit exact pulses with a timer in one-pulse mode\n" \
+                                             "Usage: pulse(<port>,<pin>,<width>[,<delay>,<count>])\n" \
+                                             "\twidth = <microseconds> {fractions allowed}\n" \
+                                             "\tdelay = <microseconds> low time before each pulse {default 0}\n" \
+                                             "\tcount = <pulses> 1-256 {more than 1 needs a TIM1 pin}\n" \
+                                             "\tpins: a,15 b,8 b,9 b,14 b,15 c,6 d,12 e,5 e,6 e,8 e,9 e,10\n" \
+                                             "\t      h,10 h,11 h,12 i,0\n" \
+                                             "Returns when done, the pin is left as a low output\n" \
+                                             "\twidth and delay as set, <_us> whole microseconds plus <_ns> below one\n";
+static const char gpio_watch_help_string[] = "Record every edge on a set of pins, no arguments stops\n" \
+                                             "Usage: watch(<port>,<pin>[,<port>,<pin>...])\n" \
+                                             "\tpins must use different pin numbers (one interrupt line each)\n" \
+                                             "\tsee events to read the records\n";
+static const char gpio_events_help_string[] = "Return buffered watch edges\n" \
+                                              "\ttime_us = <microseconds since watch started>\n" \
+                                              "\tport = 0 {a}, 1 {b}, ...\n" \
+                                              "\tlevel = pin level after the edge\n" \
+                                              "\toverflows = edges lost since the last call\n";
+
+static const char gpio_capture_help_string[] = "Sample a whole port at a fixed rate (logic analyzer)\n" \
+                                               "Usage: capture(<port>,<rate>,<depth>[,<mask>[,<format>]])\n" \
+                                               "\trate = <samples per second>\n" \
+                                               "\tdepth = <samples>\n" \
+                                               "\tmask = <pins of interest> {default 0xffff}\n" \
+                                               "\tformat = RAW | RLE {default RAW}\n" \
+                                               "\tsee trigger to wait for a pattern\n";
+static const char gpio_trigger_help_string[] = "Set the capture trigger, no arguments disables it\n" \
+                                               "Usage: trigger(<mask>,<value>,<pretrigger>,<timeout>)\n" \
+                                               "\tfires on the first sample where (port & mask) becomes value\n" \
+                                               "\tpretrigger = <samples kept before the trigger>\n" \
+                                               "\ttimeout = 1 ... 60000 {milliseconds}\n";
+static const char gpio_patwrite_help_string[] = "Load words into the pattern table\n" \
+                                                "Usage: patwrite(<index>,<word>,...)\n" \
+                                                "\tword = <BSRR value> {bits 0-15 set, bits 16-31 clear pins}\n" \
+                                                "\tnote: a capture overwrites the pattern table\n";
+static const char gpio_patstart_help_string[] = "Write the pattern table to a port's BSRR at a fixed rate\n" \
+                                                "Usage: patstart(<port>,<rate>,<count>,<mode>)\n" \
+                                                "\trate = <words per second>\n" \
+                                                "\tcount = <words from index 0>\n" \
+                                                "\tmode = ONCE | LOOP\n" \
+                                                "\tpins must already be configured as outputs\n" \
+                                                "\trefused if a word sets or clears a pin not available as gpio\n";
 
 static fetch_command_t fetch_gpio_commands[] = {
     { fetch_gpio_help_cmd,        "help",       "Display GPIO help"},
     { fetch_gpio_read_cmd,        "read",       "Read pin state\nUsage: read(<port>,<pin>)" },
     { fetch_gpio_read_port_cmd,   "readport",   "Read state of all pins on port\nUsage: readport(<port>)" },
     { fetch_gpio_read_all_cmd,    "readall",    "Read state of all pins on all ports" },
+    { fetch_gpio_read_pins_cmd,   "readpins",   "Read several pins sampled together\nUsage: readpins(<port>,<pin>,...)" },
     { fetch_gpio_write_cmd,       "write",      "Write state to pin\nUsage: write(<port>,<pin>,<state>)" },
+    { fetch_gpio_write_port_cmd,  "writeport",  "Write masked pins of a port at once\nUsage: writeport(<port>,<mask>,<value>)" },
     { fetch_gpio_set_cmd,         "set",        "Set pin to 1\nUsage: set(<port>,<pin>)" },
     { fetch_gpio_clear_cmd,       "clear",      "Clear pin to 0\nUsage: clear(<port>,<pin>)" },
     { fetch_gpio_wait_cmd,        "wait",       gpio_wait_help_string },
+    { fetch_gpio_pulse_cmd,       "pulse",      gpio_pulse_help_string },
+    { fetch_gpio_watch_cmd,       "watch",      gpio_watch_help_string },
+    { fetch_gpio_events_cmd,      "events",     gpio_events_help_string },
+    { fetch_gpio_capture_cmd,     "capture",    gpio_capture_help_string },
+    { fetch_gpio_trigger_cmd,     "trigger",    gpio_trigger_help_string },
+    { fetch_gpio_patwrite_cmd,    "patwrite",   gpio_patwrite_help_string },
+    { fetch_gpio_patstart_cmd,    "patstart",   gpio_patstart_help_string },
+    { fetch_gpio_patstop_cmd,     "patstop",    "Stop pattern output" },
+    { fetch_gpio_patstatus_cmd,   "patstatus",  "Pattern output status" },
     { fetch_gpio_config_cmd,      "config",     gpio_config_help_string },
+    { fetch_gpio_config_port_cmd, "configport", gpio_config_port_help_string },
     { fetch_gpio_info_cmd,        "info",       "Get pin info\nUsage: info(<port>,<pin>)" },
     { fetch_gpio_reset_all_cmd,   "resetall",   "Reset all GPIO pins to defaults" },
     { NULL, NULL, NULL } // null terminate list
@@ -137,6 +288,179 @@ static const char * pin_state_tok[] = {"true","false","1","0","high","low","set"
 static const char * pin_mode_tok[] = {"INPUT_FLOATING","INPUT_PULLUP","INPUT_PULLDOWN",
                                       "OUTPUT_PUSHPULL","OUTPUT_OPENDRAIN"};
 static const char * wait_event_tok[] = {"HIGH","1","LOW","0","RISING","FALLING"};
+static const char * capture_format_tok[] = {"RAW","RLE"};
+static const char * pattern_mode_tok[] = {"ONCE","LOOP"};
+
+/*! \brief capture trigger settings
+ */
+typedef struct gpio_trigger
+{
+  bool      enabled;
+  uint16_t  mask;
+  uint16_t  value;
+  uint32_t  pretrigger;
+  uint32_t  timeout_ms;
+} gpio_trigger_t;
+
+static gpio_trigger_t gpio_trigger = { false, 0, 0, 0, 0 };
+
+//! signalled at every half of the capture buffer
+static binary_semaphore_t gpio_capture_sem;
+
+//! shared by the DMA based port functions, only one can run at a time
+static uint32_t gpio_dma_buffer[FETCH_GPIO_DMA_BUFFER_SIZE / sizeof(uint32_t)];
+
+static const stm32_dma_stream_t * gpio_dma = NULL;
+
+static uint32_t gpio_pattern_length = 0;    //!< valid words in the table
+static bool gpio_pattern_running = false;
+static bool gpio_pattern_loop = false;
+static uint32_t gpio_pattern_count = 0;
+static uint32_t gpio_pattern_rate = 0;
+
+/*! \brief EXT driver configuration, channels are set up at run time
+ *  \sa fetch_gpio_ext_claim()
+ */
+static EXTConfig gpio_ext_cfg;
+
+static bool gpio_ext_claimed[GPIO_EXT_LINES];
+
+static binary_semaphore_t gpio_wait_sem;
+static volatile bool gpio_wait_fired = false;
+static volatile rtcnt_t gpio_wait_edge_cycles = 0;
+static volatile systime_t gpio_wait_edge_time = 0;
+
+static const ioportid_t gpio_watch_ports[] = { GPIOA, GPIOB, GPIOC, GPIOD, GPIOE, GPIOF, GPIOG, GPIOH, GPIOI };
+
+static gpio_watch_event_t gpio_watch_buffer[FETCH_GPIO_WATCH_DEPTH];
+static util_ring_t gpio_watch_ring;
+static uint8_t gpio_watch_port[GPIO_EXT_LINES];   //!< index into gpio_watch_ports
+static uint16_t gpio_watch_lines = 0;
+
+// time base, only touched by the watch interrupt once the watch is running
+static util_timestamp_t gpio_watch_time;
+
+static bool port_to_ext_mode( ioportid_t port, uint32_t * mode )
+{
+  if( port == GPIOA )      { *mode = EXT_MODE_GPIOA; }
+  else if( port == GPIOB ) { *mode = EXT_MODE_GPIOB; }
+  else if( port == GPIOC ) { *mode = EXT_MODE_GPIOC; }
+  else if( port == GPIOD ) { *mode = EXT_MODE_GPIOD; }
+  else if( port == GPIOE ) { *mode = EXT_MODE_GPIOE; }
+  else if( port == GPIOF ) { *mode = EXT_MODE_GPIOF; }
+  else if( port == GPIOG ) { *mode = EXT_MODE_GPIOG; }
+  else if( port == GPIOH ) { *mode = EXT_MODE_GPIOH; }
+  else if( port == GPIOI ) { *mode = EXT_MODE_GPIOI; }
+  else
+  {
+    return false;
+  }
+  return true;
+}
+
+/*! \brief route the EXTI line of a pin to a callback and enable it
+ *
+ *  EXTI line n is shared by pin n of every port, so only one user can own a
+ *  line at a time. The callback runs in interrupt context with the pin number
+ *  as channel.
+ *
+ *  \param[in] edges  EXT_CH_MODE_RISING_EDGE, EXT_CH_MODE_FALLING_EDGE or EXT_CH_MODE_BOTH_EDGES
+ *  \returns false if the line is already claimed
+ */
+bool fetch_gpio_ext_claim( ioportid_t port, uint32_t pin, uint32_t edges, extcallback_t cb )
+{
+  EXTChannelConfig ch_cfg;
+  uint32_t port_mode;
+
+  if( pin >= GPIO_EXT_LINES || !port_to_ext_mode(port, &port_mode) )
+  {
+    return false;
+  }
+
+  ch_cfg.mode = (edges & EXT_CH_MODE_EDGES_MASK) | EXT_CH_MODE_AUTOSTART | port_mode;
+  ch_cfg.cb = cb;
+
+  chSysLock();
+  if( gpio_ext_claimed[pin] )
+  {
+    chSysUnlock();
+    return false;
+  }
+  gpio_ext_claimed[pin] = true;
+
+  // drop any edge latched before the line was ours
+  EXTI->PR = (1U << pin);
+  extSetChannelModeI(&EXTD1, pin, &ch_cfg);
+  chSysUnlock();
+
+  return true;
+}
+
+/*! \brief disable an EXTI line claimed with fetch_gpio_ext_claim()
+ */
+void fetch_gpio_ext_release( uint32_t pin )
+{
+  if( pin >= GPIO_EXT_LINES )
+  {
+    return;
+  }
+
+  chSysLock();
+  if( gpio_ext_claimed[pin] )
+  {
+    extChannelDisableI(&EXTD1, pin);
+    gpio_ext_claimed[pin] = false;
+  }
+  chSysUnlock();
+}
+
+/*! \brief first matching edge, timestamp it and wake the waiting thread
+ */
+static void gpio_wait_ext_cb(EXTDriver * extp, expchannel_t channel)
+{
+  rtcnt_t now = chSysGetRealtimeCounterX();
+
+  chSysLockFromISR();
+  if( !gpio_wait_fired )
+  {
+    gpio_wait_fired = true;
+    gpio_wait_edge_cycles = now;
+    gpio_wait_edge_time = chVTGetSystemTimeX();
+    extChannelDisableI(extp, channel);
+    chBSemSignalI(&gpio_wait_sem);
+  }
+  chSysUnlockFromISR();
+}
+
+/*! \brief timestamp an edge and queue it for gpio.events
+ */
+static void gpio_watch_ext_cb(EXTDriver * extp, expchannel_t channel)
+{
+  gpio_watch_event_t event;
+
+  (void)extp;
+
+  event.time_us = util_timestamp_update(&gpio_watch_time);
+  event.port = gpio_watch_port[channel];
+  event.pin = channel;
+  event.level = palReadPad(gpio_watch_ports[event.port], channel);
+
+  util_ring_put(&gpio_watch_ring, &event);
+}
+
+/*! \brief release every watched line
+ */
+static void gpio_watch_stop(void)
+{
+  for( uint32_t pin = 0; pin < GPIO_EXT_LINES; pin++ )
+  {
+    if( gpio_watch_lines & (1U << pin) )
+    {
+      fetch_gpio_ext_release(pin);
+    }
+  }
+  gpio_watch_lines = 0;
+}
 
 static bool valid_gpio_port_pin( ioportid_t port, uint32_t pin )
 {
@@ -150,6 +474,81 @@ static bool valid_gpio_port_pin( ioportid_t port, uint32_t pin )
   return false;
 }
 
+/*! \brief convert a pin_mode_tok string to a PAL mode
+ */
+static bool string_to_pin_mode( char * str, iomode_t * mode )
+{
+  switch( token_match( str, FETCH_MAX_DATA_STRLEN, pin_mode_tok, NELEMS(pin_mode_tok)) )
+  {
+    case 0: // input floating
+      *mode = PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_FLOATING;
+      break;
+    case 1: // input pullup
+      *mode = PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_PULLUP;
+      break;
+    case 2: // input pulldown
+      *mode = PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_PULLDOWN;
+      break;
+    case 3: // output pushpull
+      *mode = PAL_STM32_MODE_OUTPUT | PAL_STM32_OTYPE_PUSHPULL;
+      break;
+    case 4: // output opendrian
+      *mode = PAL_STM32_MODE_OUTPUT | PAL_STM32_OTYPE_OPENDRAIN;
+      break;
+    default:
+      return false;
+  }
+  return true;
+}
+
+/*! \brief true if every pin in mask is available as gpio
+ */
+static bool valid_gpio_port_mask( ioportid_t port, uint16_t mask )
+{
+  for( uint32_t pin = 0; pin < 16; pin++ )
+  {
+    if( (mask & (1U << pin)) && !valid_gpio_port_pin(port, pin) )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*! \brief set the mode of several pins at once
+ *
+ *  palSetGroupMode() walks the pins one at a time; here the new register
+ *  values are computed first so every pin switches with the single MODER
+ *  write.
+ */
+static void gpio_set_port_mode( ioportid_t port, uint16_t mask, iomode_t mode )
+{
+  uint32_t moder   = (mode & PAL_STM32_MODE_MASK) >> 0;
+  uint32_t otyper  = (mode & PAL_STM32_OTYPE_MASK) >> 2;
+  uint32_t ospeedr = (mode & PAL_STM32_OSPEED_MASK) >> 3;
+  uint32_t pupdr   = (mode & PAL_STM32_PUPDR_MASK) >> 5;
+  uint32_t mask2 = 0;
+  uint32_t moder_bits = 0, ospeedr_bits = 0, pupdr_bits = 0;
+
+  for( uint32_t pin = 0; pin < 16; pin++ )
+  {
+    if( mask & (1U << pin) )
+    {
+      mask2        |= 3U << (pin * 2);
+      moder_bits   |= moder << (pin * 2);
+      ospeedr_bits |= ospeedr << (pin * 2);
+      pupdr_bits   |= pupdr << (pin * 2);
+    }
+  }
+
+  chSysLock();
+  port->OTYPER  = (port->OTYPER & ~(uint32_t)mask) | (otyper ? mask : 0);
+  port->OSPEEDR = (port->OSPEEDR & ~mask2) | ospeedr_bits;
+  port->PUPDR   = (port->PUPDR & ~mask2) | pupdr_bits;
+  port->MODER   = (port->MODER & ~mask2) | moder_bits;
+  chSysUnlock();
+}
+
 static bool fetch_gpio_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
 {
   util_message_info(chp, "Fetch GPIO Help:");
@@ -268,6 +667,105 @@ static bool fetch_gpio_write_cmd(BaseSequentialStream * chp, char * cmd_list[],
   return true;
 }
 
+/*! \brief read port/pin pairs from one snapshot of all ports
+ */
+static bool fetch_gpio_read_pins_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static const ioportid_t ports[] = {GPIOA, GPIOB, GPIOC, GPIOD, GPIOE, GPIOF, GPIOG, GPIOH, GPIOI};
+  static uint8_t states[FETCH_MAX_DATA_ITEMS / 2];
+  uint32_t snapshot[NELEMS(ports)];
+  uint32_t count = 0;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, FETCH_MAX_DATA_ITEMS) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing port/pin");
+    return false;
+  }
+
+  chSysLock();
+  for( uint32_t i = 0; i < NELEMS(ports); i++ )
+  {
+    snapshot[i] = palReadPort(ports[i]);
+  }
+  chSysUnlock();
+
+  for( count = 0; data_list[count * 2] != NULL; count++ )
+  {
+    ioportid_t port = string_to_port(data_list[count * 2]);
+    uint32_t pin = string_to_pin(data_list[count * 2 + 1]);
+    uint32_t index;
+
+    if( port == NULL || pin == INVALID_PIN )
+    {
+      util_message_error(chp, "invalid port/pin");
+      return false;
+    }
+
+    for( index = 0; ports[index] != port; index++ );
+
+    states[count] = (snapshot[index] >> pin) & 1;
+  }
+
+  util_message_uint8(chp, "state", states, count);
+  return true;
+}
+
+static bool fetch_gpio_write_port_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  ioportid_t port = string_to_port(data_list[0]);
+  char * endptr;
+  uint32_t mask, value;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  if( port == NULL )
+  {
+    util_message_error(chp, "invalid port");
+    return false;
+  }
+
+  if( data_list[1] == NULL || data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing mask or value");
+    return false;
+  }
+
+  mask = strtoul(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || mask > 0xffff )
+  {
+    util_message_error(chp, "invalid mask");
+    return false;
+  }
+
+  if( !valid_gpio_port_mask(port, mask) )
+  {
+    util_message_error(chp, "port/pin not available as gpio");
+    return false;
+  }
+
+  value = strtoul(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || value > 0xffff )
+  {
+    util_message_error(chp, "invalid value");
+    return false;
+  }
+
+  // one BSRR write, all masked pins change together and no other pin is touched
+  port->BSRR.W = ((~value & mask) << 16) | (value & mask);
+
+  return true;
+}
+
 static bool fetch_gpio_set_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
 {
   ioportid_t port = string_to_port(data_list[0]);
@@ -317,8 +815,13 @@ static bool fetch_gpio_wait_cmd(BaseSequentialStream * chp, char *cmd_list[], ch
   char * endptr;
   int32_t timeout;
   wait_event_t event;
-  systime_t start_time;
-  bool state_next, state_prev;
+  uint32_t edges;
+  systime_t start_time, edge_time;
+  rtcnt_t start_cycles, wake_cycles, edge_cycles;
+  uint32_t elapsed_us, latency_ns, value;
+  uint64_t latency;
+  bool level;
+  msg_t msg;
 
   if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 4) )
   {
@@ -336,15 +839,20 @@ static bool fetch_gpio_wait_cmd(BaseSequentialStream * chp, char *cmd_list[], ch
     case 0: // HIGH
     case 1: // 1
       event = WAIT_EVENT_HIGH;
+      edges = EXT_CH_MODE_RISING_EDGE;
       break;
     case 2: // LOW
     case 3: // 0
       event = WAIT_EVENT_LOW;
+      edges = EXT_CH_MODE_FALLING_EDGE;
       break;
     case 4: // RISING
       event = WAIT_EVENT_RISING;
+      edges = EXT_CH_MODE_RISING_EDGE;
+      break;
     case 5: // FALLING
       event = WAIT_EVENT_FALLING;
+      edges = EXT_CH_MODE_FALLING_EDGE;
       break;
     default:
       util_message_error(chp, "invalid wait event");
@@ -359,117 +867,1152 @@ static bool fetch_gpio_wait_cmd(BaseSequentialStream * chp, char *cmd_list[], ch
     return false;
   }
 
+  gpio_wait_fired = false;
+  chBSemReset(&gpio_wait_sem, true);
+
   start_time = chVTGetSystemTime();
-  state_next = palReadPad(port,pin);
+  start_cycles = chSysGetRealtimeCounterX();
+
+  if( !fetch_gpio_ext_claim(port, pin, edges, gpio_wait_ext_cb) )
+  {
+    util_message_error(chp, "interrupt line %u in use", pin);
+    return false;
+  }
 
-  while( chVTTimeElapsedSinceX(start_time) < MS2ST(timeout) )
+  // a level may already be present, the edge interrupt is armed first so
+  // a transition between the check and the wait is not lost
+  if( event == WAIT_EVENT_HIGH || event == WAIT_EVENT_LOW )
   {
-    state_prev = state_next;
-    state_next = palReadPad(port,pin);
-    switch( event )
+    level = palReadPad(port, pin);
+    if( (event == WAIT_EVENT_HIGH) == level )
     {
-      case WAIT_EVENT_HIGH:
-        if( state_prev || state_next )
-        {
-          util_message_bool(chp, "event", true);
-          return true;
-        }
-        break;
-      case WAIT_EVENT_LOW:
-        if( !state_prev || !state_next )
-        {
-          util_message_bool(chp, "event", true);
-          return true;
-        }
-        break;
-      case WAIT_EVENT_RISING:
-        if( !state_prev && state_next )
-        {
-          util_message_bool(chp, "event", true);
-          return true;
-        }
-        break;
-      case WAIT_EVENT_FALLING:
-        if( state_prev && !state_next )
-        {
-          util_message_bool(chp, "event", true);
-          return true;
-        }
-        break;
+      fetch_gpio_ext_release(pin);
+      elapsed_us = 0;
+      latency_ns = 0;
+      util_message_bool(chp, "event", true);
+      util_message_uint32(chp, "time", (uint32_t *)&start_time, 1);
+      util_message_uint32(chp, "elapsed_us", &elapsed_us, 1);
+      util_message_uint32(chp, "latency_ns", &latency_ns, 1);
+      return true;
     }
   }
-  util_message_bool(chp, "event", false);
-  return true;
-}
 
-static bool fetch_gpio_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
-{
-  ioportid_t port = string_to_port(data_list[0]);
-  uint32_t pin = string_to_pin(data_list[1]);
-  iomode_t mode = PAL_STM32_PUPDR_FLOATING | PAL_STM32_MODE_INPUT;
+  // the thread sleeps until the edge interrupt or the timeout
+  msg = chBSemWaitTimeout(&gpio_wait_sem, MS2ST(timeout));
+  wake_cycles = chSysGetRealtimeCounterX();
 
-  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
-  {
-    return false;
-  }
+  fetch_gpio_ext_release(pin);
 
-  if( port == NULL || pin == INVALID_PIN )
+  if( msg == MSG_TIMEOUT )
   {
-    util_message_error(chp, "invalid port/pin");
-    return false;
+    util_message_bool(chp, "event", false);
+    return true;
   }
 
-  if( !valid_gpio_port_pin(port, pin) )
+  // the ISR is done with them once the semaphore is signalled
+  edge_time = gpio_wait_edge_time;
+  edge_cycles = gpio_wait_edge_cycles;
+
+  if( (edge_time - start_time) < MS2ST(UTIL_TIMESTAMP_SPAN_MS) )
   {
-    util_message_error(chp, "port/pin not available as gpio");
-    return false;
+    elapsed_us = (edge_cycles - start_cycles) / UTIL_TIMESTAMP_CYCLES_PER_US;
   }
-
-  switch( token_match( data_list[2], FETCH_MAX_DATA_STRLEN, pin_mode_tok, NELEMS(pin_mode_tok)) )
+  else
   {
-    case 0: // input floating
-      mode = PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_FLOATING;
-      break;
-    case 1: // input pullup
-      mode = PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_PULLUP;
-      break;
-    case 2: // input pulldown
-      mode = PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_PULLDOWN;
-      break;
-    case 3: // output pushpull
-      mode = PAL_STM32_MODE_OUTPUT | PAL_STM32_OTYPE_PUSHPULL;
-      break;
-    case 4: // output opendrian
-      mode = PAL_STM32_MODE_OUTPUT | PAL_STM32_OTYPE_OPENDRAIN;
-      break;
-    default:
-      util_message_error(chp, "invalid pin mode");
-      return false;
+    elapsed_us = (uint32_t)(((uint64_t)(edge_time - start_time) * 1000000) / CH_CFG_ST_FREQUENCY);
   }
-
-  palSetPadMode(port, pin, mode);
-
+  // scaled in 64 bits, 32 overflow for wake ups later than 25ms, and saturated above 4s
+  latency = ((uint64_t)(wake_cycles - edge_cycles) * 1000) / UTIL_TIMESTAMP_CYCLES_PER_US;
+  latency_ns = (latency > UINT32_MAX) ? UINT32_MAX : (uint32_t)latency;
+
+  util_message_bool(chp, "event", true);
+  value = edge_time;
+  util_message_uint32(chp, "time", &value, 1);
+  util_message_uint32(chp, "elapsed_us", &elapsed_us, 1);
+  util_message_uint32(chp, "latency_ns", &latency_ns, 1);
   return true;
 }
 
-static bool fetch_gpio_info_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+static bool fetch_gpio_watch_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
 {
-  ioportid_t port = string_to_port(data_list[0]);
-  uint32_t pin = string_to_pin(data_list[1]);
-  uint32_t alt_func;
+  uint8_t port_index[GPIO_EXT_LINES];
+  uint16_t lines = 0;
+  uint32_t count;
 
-  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 2) )
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, GPIO_EXT_LINES * 2) )
   {
     return false;
   }
 
-  if( port == NULL || pin == INVALID_PIN )
+  for( count = 0; count < GPIO_EXT_LINES && data_list[count * 2] != NULL; count++ )
   {
-    util_message_error(chp, "invalid port/pin");
-    return false;
+    ioportid_t port = string_to_port(data_list[count * 2]);
+    uint32_t pin = string_to_pin(data_list[count * 2 + 1]);
+    uint32_t index;
+
+    for( index = 0; index < NELEMS(gpio_watch_ports) && gpio_watch_ports[index] != port; index++ );
+
+    if( port == NULL || pin == INVALID_PIN || index == NELEMS(gpio_watch_ports) )
+    {
+      util_message_error(chp, "invalid port/pin %u", count);
+      return false;
+    }
+
+    if( lines & (1U << pin) )
+    {
+      util_message_error(chp, "pin number %u listed twice", pin);
+      return false;
+    }
+
+    lines |= 1U << pin;
+    port_index[pin] = index;
   }
 
-  switch((port->MODER >> (pin*2)) & 3)
+  gpio_watch_stop();
+  util_ring_reset(&gpio_watch_ring);
+
+  if( lines == 0 )
+  {
+    return true;
+  }
+
+  util_timestamp_init(&gpio_watch_time);
+
+  for( uint32_t pin = 0; pin < GPIO_EXT_LINES; pin++ )
+  {
+    if( !(lines & (1U << pin)) )
+    {
+      continue;
+    }
+
+    gpio_watch_port[pin] = port_index[pin];
+
+    if( !fetch_gpio_ext_claim(gpio_watch_ports[port_index[pin]], pin, EXT_CH_MODE_BOTH_EDGES, gpio_watch_ext_cb) )
+    {
+      gpio_watch_stop();
+      util_message_error(chp, "interrupt line %u in use", pin);
+      return false;
+    }
+    gpio_watch_lines |= 1U << pin;
+  }
+
+  return true;
+}
+
+/*! \brief drain up to one batch of watch records
+ */
+static bool fetch_gpio_events_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint32_t time_us[FETCH_GPIO_WATCH_BATCH];
+  static uint8_t port[FETCH_GPIO_WATCH_BATCH];
+  static uint8_t pin[FETCH_GPIO_WATCH_BATCH];
+  static uint8_t level[FETCH_GPIO_WATCH_BATCH];
+  gpio_watch_event_t event;
+  uint32_t count = 0;
+  uint32_t value;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  while( count < FETCH_GPIO_WATCH_BATCH && util_ring_get(&gpio_watch_ring, &event) )
+  {
+    time_us[count] = event.time_us;
+    port[count] = event.port;
+    pin[count] = event.pin;
+    level[count] = event.level;
+    count++;
+  }
+
+  util_message_uint32(chp, "count", &count, 1);
+  value = util_ring_count(&gpio_watch_ring);
+  util_message_uint32(chp, "pending", &value, 1);
+  value = util_ring_take_overflows(&gpio_watch_ring);
+  util_message_uint32(chp, "overflows", &value, 1);
+  util_message_uint32(chp, "time_us", time_us, count);
+  util_message_uint8(chp, "port", port, count);
+  util_message_uint8(chp, "pin", pin, count);
+  util_message_uint8(chp, "level", level, count);
+
+  return true;
+}
+
+/*! \brief program TIM8 to issue a CH4 DMA request at the given rate
+ *
+ *  The timer is left stopped, see gpio_dma_timer_start().
+ *  \param[out] actual  rate after rounding to the timer clock
+ */
+static bool gpio_dma_timer_config( uint32_t rate, uint32_t * actual )
+{
+  uint32_t total;
+  uint32_t psc;
+  uint32_t arr;
+
+  if( rate == 0 || rate > FETCH_GPIO_DMA_MAX_RATE )
+  {
+    return false;
+  }
+
+  total = STM32_TIMCLK2 / rate;
+  psc = (total - 1) / 65536;
+  arr = (total / (psc + 1)) - 1;
+
+  rccEnableTIM8(FALSE);
+  rccResetTIM8();
+
+  TIM8->PSC = psc;
+  TIM8->ARR = arr;
+  TIM8->CCR4 = 0;           // compare event, and DMA request, once per period
+  TIM8->DIER = TIM_DIER_CC4DE;
+  TIM8->EGR = TIM_EGR_UG;
+
+  *actual = STM32_TIMCLK2 / ((psc + 1) * (arr + 1));
+  return true;
+}
+
+static void gpio_dma_timer_start( void )
+{
+  TIM8->CR1 = TIM_CR1_CEN;
+}
+
+/*! \brief stop the timer and release the DMA stream
+ */
+static void gpio_dma_stop( void )
+{
+  TIM8->CR1 = 0;
+  TIM8->DIER = 0;
+  rccDisableTIM8(FALSE);
+
+  if( gpio_dma != NULL )
+  {
+    dmaStreamDisable(gpio_dma);
+    dmaStreamRelease(gpio_dma);
+    gpio_dma = NULL;
+  }
+
+  gpio_pattern_running = false;
+}
+
+/*! \brief release the DMA once a single shot pattern has been sent
+ */
+static void gpio_pattern_update( void )
+{
+  if( gpio_pattern_running && !gpio_pattern_loop &&
+      (gpio_dma->stream->CR & STM32_DMA_CR_EN) == 0 )
+  {
+    gpio_dma_stop();
+  }
+}
+
+/*! \brief number of samples the DMA has written since it was started
+ *
+ *  Wraps of the circular buffer are counted here, so this must be polled
+ *  at least once per buffer length.
+ */
+static uint32_t capture_position( uint32_t * wraps, uint32_t * last_offset )
+{
+  uint32_t offset = (GPIO_CAPTURE_SAMPLES - dmaStreamGetTransactionSize(gpio_dma)) % GPIO_CAPTURE_SAMPLES;
+
+  if( offset < *last_offset )
+  {
+    (*wraps)++;
+  }
+  *last_offset = offset;
+
+  return (*wraps * GPIO_CAPTURE_SAMPLES) + offset;
+}
+
+/*! \brief half or all of the capture buffer written, wake the trigger search
+ */
+static void capture_dma_cb( void * p, uint32_t flags )
+{
+  (void)p;
+  (void)flags;
+
+  chSysLockFromISR();
+  chBSemSignalI(&gpio_capture_sem);
+  chSysUnlockFromISR();
+}
+
+static void reverse_uint16( uint16_t * data, uint32_t count )
+{
+  uint16_t tmp;
+
+  for( uint32_t i = 0; i < count / 2; i++ )
+  {
+    tmp = data[i];
+    data[i] = data[count - 1 - i];
+    data[count - 1 - i] = tmp;
+  }
+}
+
+/*! \brief rotate the circular capture buffer so index first becomes 0
+ */
+static void rotate_capture( uint16_t * data, uint32_t count, uint32_t first )
+{
+  if( first == 0 )
+  {
+    return;
+  }
+  reverse_uint16(data, first);
+  reverse_uint16(&data[first], count - first);
+  reverse_uint16(data, count);
+}
+
+static bool fetch_gpio_capture_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  ioportid_t port = string_to_port(data_list[0]);
+  uint16_t * samples = (uint16_t *)gpio_dma_buffer;
+  char * endptr;
+  uint32_t rate, depth, mask = 0xffff;
+  bool rle = false;
+  uint32_t pre, post;
+  uint32_t wraps = 0, last_offset = 0, written = 0;
+  uint32_t scan, trigger = 0, stop_at = 0;
+  bool triggered, matched, prev_matched = false, have_prev = false;
+  bool can_sleep;
+  systime_t start_time, timeout, elapsed;
+  uint32_t value;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 5) )
+  {
+    return false;
+  }
+
+  if( port == NULL )
+  {
+    util_message_error(chp, "invalid port");
+    return false;
+  }
+
+  if( data_list[1] == NULL || data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing rate or depth");
+    return false;
+  }
+
+  rate = strtoul(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || rate == 0 || rate > FETCH_GPIO_DMA_MAX_RATE )
+  {
+    util_message_error(chp, "invalid rate. Max: %u", FETCH_GPIO_DMA_MAX_RATE);
+    return false;
+  }
+
+  depth = strtoul(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || depth == 0 || depth > GPIO_CAPTURE_MAX_DEPTH )
+  {
+    util_message_error(chp, "invalid depth. Max: %u", GPIO_CAPTURE_MAX_DEPTH);
+    return false;
+  }
+
+  if( data_list[3] != NULL )
+  {
+    mask = strtoul(data_list[3], &endptr, 0);
+
+    if( *endptr != '\0' || mask == 0 || mask > 0xffff )
+    {
+      util_message_error(chp, "invalid mask");
+      return false;
+    }
+
+    if( data_list[4] != NULL )
+    {
+      switch( token_match( data_list[4], FETCH_MAX_DATA_STRLEN, capture_format_tok, NELEMS(capture_format_tok)) )
+      {
+        case 0:
+          rle = false;
+          break;
+        case 1:
+          rle = true;
+          break;
+        default:
+          util_message_error(chp, "invalid format");
+          return false;
+      }
+    }
+  }
+
+  pre = gpio_trigger.enabled ? gpio_trigger.pretrigger : 0;
+
+  if( pre >= depth )
+  {
+    util_message_error(chp, "pretrigger must be less than depth");
+    return false;
+  }
+  post = depth - pre;
+
+  gpio_pattern_update();
+
+  if( gpio_dma != NULL )
+  {
+    util_message_error(chp, "port dma busy");
+    return false;
+  }
+
+  if( !gpio_dma_timer_config(rate, &rate) )
+  {
+    util_message_error(chp, "invalid rate");
+    return false;
+  }
+
+  // the capture shares the pattern table memory
+  gpio_pattern_length = 0;
+
+  gpio_dma = STM32_DMA_STREAM(FETCH_GPIO_DMA_STREAM);
+
+  if( dmaStreamAllocate(gpio_dma, GPIO_DMA_PRIORITY, capture_dma_cb, NULL) )
+  {
+    gpio_dma = NULL;
+    gpio_dma_stop();
+    util_message_error(chp, "dma stream in use");
+    return false;
+  }
+
+  // sleeping between polls is only safe if the buffer slack covers it
+  can_sleep = (((uint64_t)(GPIO_CAPTURE_SAMPLES - depth) * 1000) / rate) >= GPIO_CAPTURE_SLEEP_MS;
+
+  chBSemReset(&gpio_capture_sem, true);
+
+  dmaStreamSetPeripheral(gpio_dma, &port->IDR);
+  dmaStreamSetMemory0(gpio_dma, samples);
+  dmaStreamSetTransactionSize(gpio_dma, GPIO_CAPTURE_SAMPLES);
+  dmaStreamSetMode(gpio_dma, STM32_DMA_CR_CHSEL(GPIO_DMA_CHANNEL) | STM32_DMA_CR_PL(GPIO_DMA_PRIORITY) |
+                             STM32_DMA_CR_DIR_P2M | STM32_DMA_CR_PSIZE_HWORD | STM32_DMA_CR_MSIZE_HWORD |
+                             STM32_DMA_CR_MINC | STM32_DMA_CR_CIRC |
+                             (can_sleep ? 0 : (STM32_DMA_CR_HTIE | STM32_DMA_CR_TCIE)));
+  dmaStreamEnable(gpio_dma);
+
+  if( gpio_trigger.enabled )
+  {
+    triggered = false;
+    timeout = MS2ST(gpio_trigger.timeout_ms);
+  }
+  else
+  {
+    triggered = true;
+    stop_at = depth;
+    timeout = MS2ST(((uint64_t)depth * 1000) / rate + 100);
+  }
+
+  // the sample before the first candidate is needed to see a transition
+  scan = (pre > 0) ? pre - 1 : 0;
+
+  start_time = chVTGetSystemTime();
+  gpio_dma_timer_start();
+
+  while( true )
+  {
+    written = capture_position(&wraps, &last_offset);
+
+    if( !triggered )
+    {
+      if( (written - scan) > GPIO_CAPTURE_SAMPLES )
+      {
+        break;
+      }
+
+      while( scan < written )
+      {
+        matched = (samples[scan % GPIO_CAPTURE_SAMPLES] & gpio_trigger.mask) == gpio_trigger.value;
+        if( have_prev && matched && !prev_matched )
+        {
+          triggered = true;
+          trigger = scan;
+          stop_at = trigger + post;
+          // from here only the post trigger samples are left to wait for
+          start_time = chVTGetSystemTime();
+          timeout = MS2ST(((uint64_t)post * 1000) / rate + 100);
+          break;
+        }
+        prev_matched = matched;
+        have_prev = true;
+        scan++;
+      }
+    }
+
+    if( triggered && written >= stop_at )
+    {
+      break;
+    }
+
+    elapsed = chVTTimeElapsedSinceX(start_time);
+
+    if( elapsed > timeout )
+    {
+      break;
+    }
+
+    if( can_sleep )
+    {
+      chThdSleep(1);
+    }
+    else if( !triggered )
+    {
+      // too fast to sleep a tick, the search wakes at each half buffer instead
+      chBSemWaitTimeout(&gpio_capture_sem, timeout - elapsed + 1);
+    }
+    // once triggered without slack, the post trigger samples take under
+    // GPIO_CAPTURE_SLEEP_MS, short enough to poll for
+  }
+
+  TIM8->CR1 = 0;
+  written = capture_position(&wraps, &last_offset);
+  gpio_dma_stop();
+
+  if( !triggered )
+  {
+    if( (written - scan) > GPIO_CAPTURE_SAMPLES )
+    {
+      util_message_error(chp, "trigger search overrun, lower the rate");
+      return false;
+    }
+    util_message_bool(chp, "triggered", false);
+    return true;
+  }
+
+  if( written < stop_at )
+  {
+    util_message_error(chp, "capture timeout");
+    return false;
+  }
+
+  if( (written - (trigger - pre)) > GPIO_CAPTURE_SAMPLES )
+  {
+    util_message_error(chp, "capture overrun, lower the rate");
+    return false;
+  }
+
+  rotate_capture(samples, GPIO_CAPTURE_SAMPLES, (trigger - pre) % GPIO_CAPTURE_SAMPLES);
+
+  for( uint32_t i = 0; i < depth; i++ )
+  {
+    samples[i] &= mask;
+  }
+
+  util_message_bool(chp, "triggered", true);
+  util_message_uint32(chp, "rate", &rate, 1);
+  util_message_uint32(chp, "count", &depth, 1);
+  util_message_uint32(chp, "trigger", &pre, 1);
+
+  if( !rle )
+  {
+    util_message_hex_uint16(chp, "samples", samples, depth);
+    return true;
+  }
+
+  // run length encode in place, lengths go in the free second half
+  uint16_t * lengths = &samples[GPIO_CAPTURE_MAX_DEPTH];
+  uint32_t runs = 0;
+
+  for( uint32_t i = 0; i < depth; i++ )
+  {
+    if( runs > 0 && samples[runs - 1] == samples[i] )
+    {
+      lengths[runs - 1]++;
+    }
+    else
+    {
+      samples[runs] = samples[i];
+      lengths[runs] = 1;
+      runs++;
+    }
+  }
+
+  value = runs;
+  util_message_uint32(chp, "runs", &value, 1);
+  util_message_hex_uint16(chp, "values", samples, runs);
+  util_message_uint16(chp, "lengths", lengths, runs);
+
+  return true;
+}
+
+static bool fetch_gpio_trigger_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+  uint32_t mask, value, pretrigger, timeout;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 4) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    gpio_trigger.enabled = false;
+    return true;
+  }
+
+  if( data_list[1] == NULL || data_list[2] == NULL || data_list[3] == NULL )
+  {
+    util_message_error(chp, "missing trigger parameters");
+    return false;
+  }
+
+  mask = strtoul(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || mask == 0 || mask > 0xffff )
+  {
+    util_message_error(chp, "invalid mask");
+    return false;
+  }
+
+  value = strtoul(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || (value & ~mask) != 0 )
+  {
+    util_message_error(chp, "invalid value");
+    return false;
+  }
+
+  pretrigger = strtoul(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || pretrigger >= GPIO_CAPTURE_MAX_DEPTH )
+  {
+    util_message_error(chp, "invalid pretrigger");
+    return false;
+  }
+
+  timeout = strtoul(data_list[3], &endptr, 0);
+
+  if( *endptr != '\0' || timeout == 0 || timeout > GPIO_TRIGGER_MAX_MS )
+  {
+    util_message_error(chp, "invalid timeout. Range: 1-%u", GPIO_TRIGGER_MAX_MS);
+    return false;
+  }
+
+  gpio_trigger.mask = mask;
+  gpio_trigger.value = value;
+  gpio_trigger.pretrigger = pretrigger;
+  gpio_trigger.timeout_ms = timeout;
+  gpio_trigger.enabled = true;
+
+  return true;
+}
+
+static bool fetch_gpio_patwrite_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+  uint32_t index;
+  uint32_t count;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, FETCH_MAX_DATA_ITEMS) )
+  {
+    return false;
+  }
+
+  if( data_list[0] == NULL || data_list[1] == NULL )
+  {
+    util_message_error(chp, "missing index or data");
+    return false;
+  }
+
+  gpio_pattern_update();
+
+  if( gpio_pattern_running )
+  {
+    util_message_error(chp, "pattern running");
+    util_message_info(chp, "use gpio.patstop");
+    return false;
+  }
+
+  index = strtoul(data_list[0], &endptr, 0);
+
+  if( *endptr != '\0' || index > gpio_pattern_length )
+  {
+    util_message_error(chp, "invalid index, table has %u words", gpio_pattern_length);
+    return false;
+  }
+
+  for( count = 0; data_list[count + 1] != NULL; count++ );
+
+  if( (index + count) > GPIO_PATTERN_MAX_WORDS )
+  {
+    util_message_error(chp, "pattern too long. Max: %u", GPIO_PATTERN_MAX_WORDS);
+    return false;
+  }
+
+  for( uint32_t i = 0; i < count; i++ )
+  {
+    uint32_t word = strtoul(data_list[i + 1], &endptr, 0);
+
+    if( *endptr != '\0' )
+    {
+      util_message_error(chp, "invalid word");
+      return false;
+    }
+    gpio_dma_buffer[index + i] = word;
+  }
+
+  gpio_pattern_length = index + count;
+
+  return true;
+}
+
+static bool fetch_gpio_patstart_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  ioportid_t port = string_to_port(data_list[0]);
+  char * endptr;
+  uint32_t rate, count;
+  bool loop;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 4) )
+  {
+    return false;
+  }
+
+  if( port == NULL )
+  {
+    util_message_error(chp, "invalid port");
+    return false;
+  }
+
+  if( data_list[1] == NULL || data_list[2] == NULL || data_list[3] == NULL )
+  {
+    util_message_error(chp, "missing parameters");
+    return false;
+  }
+
+  rate = strtoul(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || rate == 0 || rate > FETCH_GPIO_DMA_MAX_RATE )
+  {
+    util_message_error(chp, "invalid rate. Max: %u", FETCH_GPIO_DMA_MAX_RATE);
+    return false;
+  }
+
+  count = strtoul(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || count == 0 || count > gpio_pattern_length )
+  {
+    util_message_error(chp, "invalid count, table has %u words", gpio_pattern_length);
+    return false;
+  }
+
+  switch( token_match( data_list[3], FETCH_MAX_DATA_STRLEN, pattern_mode_tok, NELEMS(pattern_mode_tok)) )
+  {
+    case 0:
+      loop = false;
+      break;
+    case 1:
+      loop = true;
+      break;
+    default:
+      util_message_error(chp, "invalid mode");
+      return false;
+  }
+
+  gpio_pattern_update();
+
+  if( gpio_dma != NULL )
+  {
+    util_message_error(chp, "port dma busy");
+    return false;
+  }
+
+  // the table is loaded without a port, check its pins against this one
+  for( uint32_t i = 0; i < count; i++ )
+  {
+    uint32_t word = gpio_dma_buffer[i];
+
+    if( !valid_gpio_port_mask(port, (word | (word >> 16)) & 0xffff) )
+    {
+      util_message_error(chp, "word %u writes a port/pin not available as gpio", i);
+      return false;
+    }
+  }
+
+  if( !gpio_dma_timer_config(rate, &rate) )
+  {
+    util_message_error(chp, "invalid rate");
+    return false;
+  }
+
+  gpio_dma = STM32_DMA_STREAM(FETCH_GPIO_DMA_STREAM);
+
+  if( dmaStreamAllocate(gpio_dma, GPIO_DMA_PRIORITY, NULL, NULL) )
+  {
+    gpio_dma = NULL;
+    gpio_dma_stop();
+    util_message_error(chp, "dma stream in use");
+    return false;
+  }
+
+  dmaStreamSetPeripheral(gpio_dma, &port->BSRR.W);
+  dmaStreamSetMemory0(gpio_dma, gpio_dma_buffer);
+  dmaStreamSetTransactionSize(gpio_dma, count);
+  dmaStreamSetMode(gpio_dma, STM32_DMA_CR_CHSEL(GPIO_DMA_CHANNEL) | STM32_DMA_CR_PL(GPIO_DMA_PRIORITY) |
+                             STM32_DMA_CR_DIR_M2P | STM32_DMA_CR_PSIZE_WORD | STM32_DMA_CR_MSIZE_WORD |
+                             STM32_DMA_CR_MINC | (loop ? STM32_DMA_CR_CIRC : 0));
+  dmaStreamEnable(gpio_dma);
+
+  gpio_pattern_running = true;
+  gpio_pattern_loop = loop;
+  gpio_pattern_count = count;
+  gpio_pattern_rate = rate;
+
+  gpio_dma_timer_start();
+
+  util_message_uint32(chp, "rate", &rate, 1);
+
+  return true;
+}
+
+static bool fetch_gpio_patstop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  if( gpio_pattern_running )
+  {
+    gpio_dma_stop();
+  }
+
+  return true;
+}
+
+static bool fetch_gpio_patstatus_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  uint32_t remaining = 0;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  if( gpio_pattern_running )
+  {
+    remaining = dmaStreamGetTransactionSize(gpio_dma);
+  }
+  gpio_pattern_update();
+
+  util_message_bool(chp, "running", gpio_pattern_running);
+  util_message_bool(chp, "loop", gpio_pattern_loop);
+  util_message_uint32(chp, "length", &gpio_pattern_length, 1);
+  util_message_uint32(chp, "count", &gpio_pattern_count, 1);
+  util_message_uint32(chp, "rate", &gpio_pattern_rate, 1);
+  util_message_uint32(chp, "remaining", &remaining, 1);
+
+  return true;
+}
+
+/*! \brief true if another module has the timer running
+ */
+static bool gpio_pulse_timer_busy( TIM_TypeDef * tim )
+{
+  if( tim == TIM1 ) { return PWMD1.state == PWM_READY; }
+  if( tim == TIM3 ) { return PWMD3.state == PWM_READY; }
+  if( tim == TIM4 ) { return PWMD4.state == PWM_READY; }
+  if( tim == TIM9 ) { return PWMD9.state == PWM_READY; }
+  if( tim == TIM5 ) { return fetch_encoder_running(); }
+  return false;
+}
+
+static void gpio_pulse_timer_clock( TIM_TypeDef * tim, bool enable )
+{
+  if( enable )
+  {
+    if( tim == TIM1 )      { rccEnableTIM1(FALSE); rccResetTIM1(); }
+    else if( tim == TIM2 ) { rccEnableTIM2(FALSE); rccResetTIM2(); }
+    else if( tim == TIM3 ) { rccEnableTIM3(FALSE); rccResetTIM3(); }
+    else if( tim == TIM4 ) { rccEnableTIM4(FALSE); rccResetTIM4(); }
+    else if( tim == TIM5 ) { rccEnableTIM5(FALSE); rccResetTIM5(); }
+    else if( tim == TIM9 ) { rccEnableTIM9(FALSE); rccResetTIM9(); }
+  }
+  else
+  {
+    if( tim == TIM1 )      { rccDisableTIM1(FALSE); }
+    else if( tim == TIM2 ) { rccDisableTIM2(FALSE); }
+    else if( tim == TIM3 ) { rccDisableTIM3(FALSE); }
+    else if( tim == TIM4 ) { rccDisableTIM4(FALSE); }
+    else if( tim == TIM5 ) { rccDisableTIM5(FALSE); }
+    else if( tim == TIM9 ) { rccDisableTIM9(FALSE); }
+  }
+}
+
+/*! \brief one or more pulses from a timer channel in one-pulse mode
+ *
+ *  PWM mode 2 holds the output low while CNT < CCR and high from CCR to
+ *  ARR, then the update event stops the counter at 0 with the output low
+ *  again. On TIM1 the repetition counter lets the timer run count periods
+ *  before it stops.
+ */
+static bool fetch_gpio_pulse_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  const gpio_pulse_pin_t * out = NULL;
+  ioportid_t port = string_to_port(data_list[0]);
+  uint32_t pin = string_to_pin(data_list[1]);
+  char * endptr;
+  float width_us;
+  float delay_us = 0.0f;
+  int32_t count = 1;
+  uint32_t prescaler;
+  uint32_t width_ticks, delay_ticks;
+  uint64_t width_ns, delay_ns;
+  uint32_t value;
+  uint32_t total_ms;
+  systime_t start;
+  TIM_TypeDef * tim;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 5) )
+  {
+    return false;
+  }
+
+  for( uint32_t i = 0; i < NELEMS(gpio_pulse_pins); i++ )
+  {
+    if( gpio_pulse_pins[i].port == port && gpio_pulse_pins[i].pin == pin )
+    {
+      out = &gpio_pulse_pins[i];
+    }
+  }
+
+  if( out == NULL )
+  {
+    util_message_error(chp, "invalid port/pin, not a timer output");
+    return false;
+  }
+
+  if( data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing width");
+    return false;
+  }
+
+  width_us = strtof(data_list[2], &endptr);
+
+  if( *endptr != '\0' || width_us <= 0.0f )
+  {
+    util_message_error(chp, "invalid width");
+    return false;
+  }
+
+  if( data_list[3] != NULL )
+  {
+    delay_us = strtof(data_list[3], &endptr);
+
+    if( *endptr != '\0' || delay_us < 0.0f )
+    {
+      util_message_error(chp, "invalid delay");
+      return false;
+    }
+  }
+
+  if( data_list[4] != NULL )
+  {
+    count = strtol(data_list[4], &endptr, 0);
+
+    if( *endptr != '\0' || count < 1 || count > GPIO_PULSE_MAX_COUNT )
+    {
+      util_message_error(chp, "invalid count. Range: 1-%u", GPIO_PULSE_MAX_COUNT);
+      return false;
+    }
+
+    if( count > 1 && out->tim != TIM1 )
+    {
+      util_message_error(chp, "count above 1 needs a TIM1 pin");
+      return false;
+    }
+  }
+
+  total_ms = (uint32_t)(((delay_us + width_us) * (float)count) / 1000.0f);
+
+  if( total_ms > GPIO_PULSE_MAX_MS )
+  {
+    util_message_error(chp, "pulses longer than %u ms", GPIO_PULSE_MAX_MS);
+    return false;
+  }
+
+  if( gpio_pulse_timer_busy(out->tim) )
+  {
+    util_message_error(chp, "timer in use");
+    return false;
+  }
+
+  // the smallest prescaler that fits delay + width, with at least one tick of delay
+  float ticks = ((delay_us + width_us) * (float)out->clock) / 1000000.0f;
+  prescaler = (uint32_t)(ticks / (float)out->max_count) + 1;
+  delay_ticks = (uint32_t)((delay_us * (float)out->clock) / (1000000.0f * (float)prescaler) + 0.5f);
+  width_ticks = (uint32_t)((width_us * (float)out->clock) / (1000000.0f * (float)prescaler) + 0.5f);
+  if( delay_ticks == 0 )
+  {
+    delay_ticks = 1;
+  }
+  if( width_ticks == 0 )
+  {
+    width_ticks = 1;
+  }
+  if( (uint64_t)delay_ticks + width_ticks - 1 > out->max_count )
+  {
+    width_ticks = out->max_count - delay_ticks + 1;
+  }
+
+  tim = out->tim;
+  gpio_pulse_timer_clock(tim, true);
+
+  tim->CR1 = 0;
+  tim->PSC = prescaler - 1;
+  (&tim->CCR1)[out->channel] = delay_ticks;
+  tim->ARR = delay_ticks + width_ticks - 1;
+  if( out->channel < 2 )
+  {
+    tim->CCMR1 = 0x70U << (out->channel * 8);         // PWM mode 2
+  }
+  else
+  {
+    tim->CCMR2 = 0x70U << ((out->channel - 2) * 8);
+  }
+  tim->CCER = 1U << (out->channel * 4 + (out->complementary ? 2 : 0));
+  if( tim == TIM1 )
+  {
+    tim->RCR = count - 1;
+    tim->BDTR = TIM_BDTR_MOE;
+  }
+  tim->EGR = TIM_EGR_UG;
+  tim->SR = 0;
+
+  // the output is low with the counter stopped at 0, take over the pin
+  palClearPad(port, pin);
+  palSetPadMode(port, pin, PAL_MODE_ALTERNATE(out->af) | PAL_STM32_OSPEED_HIGHEST);
+
+  tim->CR1 = TIM_CR1_OPM | TIM_CR1_CEN;
+
+  if( total_ms > 0 )
+  {
+    chThdSleepMilliseconds(total_ms);
+  }
+  start = chVTGetSystemTime();
+  while( (tim->CR1 & TIM_CR1_CEN) && chVTTimeElapsedSinceX(start) < MS2ST(100) )
+  {
+    chThdSleep(1);
+  }
+
+  palSetPadMode(port, pin, PAL_STM32_MODE_OUTPUT | PAL_STM32_OTYPE_PUSHPULL);
+  tim->CR1 = 0;
+  gpio_pulse_timer_clock(tim, false);
+
+  // up to 10s, too long for nanoseconds in 32 bits
+  width_ns = ((uint64_t)width_ticks * prescaler * 1000000000) / out->clock;
+  delay_ns = ((uint64_t)delay_ticks * prescaler * 1000000000) / out->clock;
+
+  value = width_ns / 1000;
+  util_message_uint32(chp, "width_us", &value, 1);
+  value = width_ns % 1000;
+  util_message_uint32(chp, "width_ns", &value, 1);
+  value = delay_ns / 1000;
+  util_message_uint32(chp, "delay_us", &value, 1);
+  value = delay_ns % 1000;
+  util_message_uint32(chp, "delay_ns", &value, 1);
+  util_message_uint32(chp, "count", (uint32_t *)&count, 1);
+
+  return true;
+}
+
+static bool fetch_gpio_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  ioportid_t port = string_to_port(data_list[0]);
+  uint32_t pin = string_to_pin(data_list[1]);
+  iomode_t mode = PAL_STM32_PUPDR_FLOATING | PAL_STM32_MODE_INPUT;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  if( port == NULL || pin == INVALID_PIN )
+  {
+    util_message_error(chp, "invalid port/pin");
+    return false;
+  }
+
+  if( !valid_gpio_port_pin(port, pin) )
+  {
+    util_message_error(chp, "port/pin not available as gpio");
+    return false;
+  }
+
+  if( !string_to_pin_mode(data_list[2], &mode) )
+  {
+    util_message_error(chp, "invalid pin mode");
+    return false;
+  }
+
+  palSetPadMode(port, pin, mode);
+
+  return true;
+}
+
+static bool fetch_gpio_config_port_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  ioportid_t port = string_to_port(data_list[0]);
+  char * endptr;
+  uint32_t mask;
+  iomode_t mode;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  if( port == NULL )
+  {
+    util_message_error(chp, "invalid port");
+    return false;
+  }
+
+  if( data_list[1] == NULL )
+  {
+    util_message_error(chp, "missing mask");
+    return false;
+  }
+
+  mask = strtoul(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || mask == 0 || mask > 0xffff )
+  {
+    util_message_error(chp, "invalid mask");
+    return false;
+  }
+
+  if( !valid_gpio_port_mask(port, mask) )
+  {
+    util_message_error(chp, "port/pin not available as gpio");
+    return false;
+  }
+
+  if( !string_to_pin_mode(data_list[2], &mode) )
+  {
+    util_message_error(chp, "invalid pin mode");
+    return false;
+  }
+
+  gpio_set_port_mode(port, mask, mode);
+
+  return true;
+}
+
+static bool fetch_gpio_info_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  ioportid_t port = string_to_port(data_list[0]);
+  uint32_t pin = string_to_pin(data_list[1]);
+  uint32_t alt_func;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 2) )
+  {
+    return false;
+  }
+
+  if( port == NULL || pin == INVALID_PIN )
+  {
+    util_message_error(chp, "invalid port/pin");
+    return false;
+  }
+
+  switch((port->MODER >> (pin*2)) & 3)
   {
     case 0:
       util_message_string(chp, "mode", "INPUT");
@@ -537,8 +2080,11 @@ void fetch_gpio_init(BaseSequentialStream * chp)
   if( gpio_init_flag )
     return;
 
-  // Init stuff goes here
-  // ...
+  chBSemObjectInit(&gpio_wait_sem, true);
+  chBSemObjectInit(&gpio_capture_sem, true);
+  util_ring_init(&gpio_watch_ring, gpio_watch_buffer, sizeof(gpio_watch_event_t), FETCH_GPIO_WATCH_DEPTH);
+
+  extStart(&EXTD1, &gpio_ext_cfg);
 
   gpio_init_flag = true;
 }
@@ -552,6 +2098,21 @@ bool fetch_gpio_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * d
 
 bool fetch_gpio_reset(BaseSequentialStream * chp)
 {
+  if( gpio_pattern_running )
+  {
+    gpio_dma_stop();
+  }
+  gpio_pattern_length = 0;
+  gpio_trigger.enabled = false;
+
+  gpio_watch_stop();
+  util_ring_reset(&gpio_watch_ring);
+
+  for(uint32_t i = 0; i < GPIO_EXT_LINES; i++ )
+  {
+    fetch_gpio_ext_release(i);
+  }
+
   // reset all gpio pins
   for(uint32_t i = 0; i < NELEMS(gpio_pins); i++ )
   {
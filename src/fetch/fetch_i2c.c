@@ -21,30 +21,80 @@
 #include "fetch_i2c.h"
 
 #ifndef MAX_I2C_BYTES
-#define MAX_I2C_BYTES   256
+#define MAX_I2C_BYTES   512     //!< a full line of hex blob data
 #endif
 
-#ifndef I2C_TIMEOUT
-#define I2C_TIMEOUT MS2ST(100)
+#define I2C_DEFAULT_SPEED           100000
+#define I2C_MIN_SPEED               10000
+#define I2C_MAX_SPEED               400000    //!< fast mode
+#define I2C_STD_MAX_SPEED           100000
+#define I2C_CCR_MAX                 0xfff
+#define I2C_STD_MIN_CCR             4
+#define I2C_AF                      4
+#define I2C_TIMEOUT_MARGIN_MS       100       //!< on top of twice the time on the wire
+#define I2C_BITS_PER_BYTE           9         //!< with the ACK
+#define I2C_REGS_CHUNK              MAX_I2C_BYTES   //!< bytes per rx line of readregs
+#define I2C_REGS_MAX_COUNT          65536
+#define I2C_WRITE_CYCLE_MS          20        //!< EEPROM write cycles are 5-10ms
+#define I2C_RECOVERY_PULSES         9         //!< enough for a slave stuck in any bit of a byte
+#define I2C_RECOVERY_HALF_PERIOD_US 5         //!< 100kHz
+
+/*! \brief one bus, its pins and its current configuration
+ */
+typedef struct i2c_bus
+{
+  I2CDriver   * drv;
+  ioportid_t    port;
+  uint32_t      scl;
+  uint32_t      sda;
+  I2CConfig     cfg;
+} i2c_bus_t;
+
+static i2c_bus_t i2c_buses[] = {
+#if STM32_I2C_USE_I2C1
+  { &I2CD1, GPIOB, GPIOB_I2C1_SCL_MBUS, GPIOB_I2C1_SDA_MBUS, {OPMODE_I2C, I2C_DEFAULT_SPEED, STD_DUTY_CYCLE} },
 #endif
+#if STM32_I2C_USE_I2C2
+  { &I2CD2, GPIOF, GPIOF_I2C2_SCL, GPIOF_I2C2_SDA, {OPMODE_I2C, I2C_DEFAULT_SPEED, STD_DUTY_CYCLE} },
+#endif
+};
 
-static I2CConfig   i2c_cfg = {OPMODE_I2C, 100000, STD_DUTY_CYCLE};
 static bool i2c_init_flag = true;
 
 // list all command function prototypes here 
 static bool fetch_i2c_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_i2c_transmit_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_i2c_receive_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_i2c_transceive_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_i2c_readregs_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_i2c_writeregs_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_i2c_recover_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_i2c_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_i2c_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 
 static fetch_command_t fetch_i2c_commands[] = {
     { fetch_i2c_transmit_cmd,  "transmit",  "TX data to slave\n" \
-                                            "Usage: transmit(<dev>,<addr>,<base>,<byte 0>,[...,<byte n>])" },
+                                            "Usage: transmit(<dev>,<addr>,[<base>],<byte 0>,[...,<byte n>])\n" \
+                                            "\tbytes may also be hex blobs, x:DEADBEEF" },
     { fetch_i2c_receive_cmd,   "receive",   "RX data from slave\n" \
                                             "Usage: receive(<dev>,<addr>,<count>)" },
+    { fetch_i2c_transceive_cmd, "transceive", "TX then RX after a repeated start, in one transaction\n" \
+                                            "Usage: transceive(<dev>,<addr>,[<base>],<byte 0>,[...,<byte n>],<rx count>)\n" \
+                                            "\tbytes may also be hex blobs, x:DEADBEEF" },
+    { fetch_i2c_readregs_cmd,  "readregs",  "Read a register range, returned as several rx lines\n" \
+                                            "Usage: readregs(<dev>,<addr>,<reg>,<count>,[<reg width>])\n" \
+                                            "\tcount = 1 ... 65536\n" \
+                                            "\treg width = 1 | 2 {register address bytes, default 1}" },
+    { fetch_i2c_writeregs_cmd, "writeregs", "Write a register range, split at page boundaries with ACK polling\n" \
+                                            "Usage: writeregs(<dev>,<addr>,<reg>,<reg width>,<page>,[<base>],<byte 0>,[...,<byte n>])\n" \
+                                            "\tpage = 0 {one write} | <EEPROM page size, power of two>\n" \
+                                            "\tbytes may also be hex blobs, x:DEADBEEF" },
     { fetch_i2c_config_cmd,    "config",    "Configure I2C driver\n" \
-                                            "Usage: config(<dev>)" },
+                                            "Usage: config(<dev>,[<speed>])\n" \
+                                            "\tspeed = 10000 ... 400000 {Hz, default 100000, above 100000 is fast mode}\n" \
+                                            "\tthe nearest speed the I2C clock divides exactly is set and returned" },
+    { fetch_i2c_recover_cmd,   "recover",   "Free a bus held by a slave, done automatically after a timeout\n" \
+                                            "Usage: recover(<dev>)" },
     { fetch_i2c_reset_cmd,     "reset",     "Reset I2C driver\n" \
                                             "Usage: reset(<dev>)" },
     { fetch_i2c_help_cmd,      "help",      "I2C command help" },
@@ -82,12 +132,172 @@ static I2CDriver * parse_i2c_dev( char * str, int32_t * dev )
   }
 }
 
+static i2c_bus_t * i2c_find_bus( I2CDriver * i2c_drv )
+{
+  for( uint32_t i = 0; i < NELEMS(i2c_buses); i++ )
+  {
+    if( i2c_buses[i].drv == i2c_drv )
+    {
+      return &i2c_buses[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*! \brief timeout for a transaction at the configured speed
+ *
+ *  A full 512 byte line takes about 460ms at 10kHz, so a fixed timeout
+ *  either fails slow buses or waits far too long on fast ones.
+ *  \param[in] byte_count  bytes sent and received, the address bytes are added
+ */
+static systime_t i2c_timeout( I2CDriver * i2c_drv, uint32_t byte_count )
+{
+  uint32_t speed = i2c_find_bus(i2c_drv)->cfg.clock_speed;
+  uint32_t bits = (byte_count + 2) * I2C_BITS_PER_BYTE;
+
+  return MS2ST(I2C_TIMEOUT_MARGIN_MS + (2 * bits * 1000 + speed - 1) / speed);
+}
+
+static void i2c_recovery_delay(void)
+{
+  chSysPolledDelayX(US2RTC(STM32_HCLK, I2C_RECOVERY_HALF_PERIOD_US));
+}
+
+/*! \brief clock out a slave that holds SDA low, then restart the driver
+ *
+ *  The pins are taken from the peripheral as open drain outputs. SCL is
+ *  pulsed until the slave lets go of SDA, then a stop condition puts every
+ *  slave back to idle.
+ *
+ *  \param[out] pulses  SCL pulses it took, may be NULL
+ *  \returns false if SDA is still held low
+ */
+static bool i2c_bus_recover( i2c_bus_t * bus, uint32_t * pulses )
+{
+  uint32_t count = 0;
+  bool released;
+
+  i2cStop(bus->drv);
+
+  palSetPad(bus->port, bus->scl);
+  palSetPad(bus->port, bus->sda);
+  palSetPadMode(bus->port, bus->scl, PAL_MODE_OUTPUT_OPENDRAIN);
+  palSetPadMode(bus->port, bus->sda, PAL_MODE_OUTPUT_OPENDRAIN);
+  i2c_recovery_delay();
+
+  while( palReadPad(bus->port, bus->sda) == PAL_LOW && count < I2C_RECOVERY_PULSES )
+  {
+    palClearPad(bus->port, bus->scl);
+    i2c_recovery_delay();
+    palSetPad(bus->port, bus->scl);
+    i2c_recovery_delay();
+    count++;
+  }
+
+  released = (palReadPad(bus->port, bus->sda) == PAL_HIGH);
+
+  // stop condition, SDA rising while SCL is high
+  palClearPad(bus->port, bus->sda);
+  i2c_recovery_delay();
+  palSetPad(bus->port, bus->sda);
+  i2c_recovery_delay();
+
+  palSetPadMode(bus->port, bus->scl, PAL_MODE_ALTERNATE(I2C_AF) | PAL_STM32_OTYPE_OPENDRAIN);
+  palSetPadMode(bus->port, bus->sda, PAL_MODE_ALTERNATE(I2C_AF) | PAL_STM32_OTYPE_OPENDRAIN);
+
+  i2cStart(bus->drv, &bus->cfg);
+
+  if( pulses != NULL )
+  {
+    *pulses = count;
+  }
+
+  return released;
+}
+
+/*! \brief report a failed transfer, a hung bus is recovered
+ *  \returns true for MSG_OK
+ */
+static bool i2c_check_result(BaseSequentialStream * chp, I2CDriver * i2c_drv, msg_t result)
+{
+  i2c_bus_t * bus = i2c_find_bus(i2c_drv);
+
+  switch( result )
+  {
+    case MSG_TIMEOUT:
+      // the driver is locked after a timeout, it has to be restarted anyway
+      if( i2c_bus_recover(bus, NULL) )
+      {
+        util_message_error(chp, "i2c timeout, bus recovered");
+      }
+      else
+      {
+        util_message_error(chp, "i2c timeout, SDA held low");
+      }
+      return false;
+    case MSG_RESET:
+      if( i2cGetErrors(i2c_drv) & (I2C_BUS_ERROR | I2C_ARBITRATION_LOST) )
+      {
+        i2c_bus_recover(bus, NULL);
+        util_message_error(chp, "i2c bus error, bus recovered");
+      }
+      else
+      {
+        util_message_error(chp, "i2c error");
+      }
+      return false;
+    case MSG_OK:
+    default:
+      return true;
+  }
+}
+
+/*! \brief the fastest speed at or below speed that PCLK1 divides exactly
+ *
+ *  The driver divides PCLK1 by speed * factor (2 standard, 3 fast with 2:1
+ *  duty, 25 fast with 16/9 duty) and asserts on a remainder, so only
+ *  speeds it divides exactly may reach i2cStart.
+ *  \returns 0 if no speed between min_speed and speed fits
+ */
+static uint32_t i2c_exact_speed(uint32_t speed, uint32_t factor, uint32_t min_ccr, uint32_t min_speed)
+{
+  uint32_t ccr = (STM32_PCLK1 + speed * factor - 1) / (speed * factor);
+
+  if( ccr < min_ccr )
+  {
+    ccr = min_ccr;
+  }
+
+  for( ; ccr <= I2C_CCR_MAX; ccr++ )
+  {
+    uint32_t actual = STM32_PCLK1 / (ccr * factor);
+
+    if( actual < min_speed )
+    {
+      break;
+    }
+
+    if( STM32_PCLK1 % (ccr * factor) == 0 )
+    {
+      return actual;
+    }
+  }
+
+  return 0;
+}
+
 static bool fetch_i2c_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
 {
   int32_t i2c_dev;
   I2CDriver * i2c_drv;
+  i2c_bus_t * bus;
+  uint32_t speed = I2C_DEFAULT_SPEED;
+  uint32_t actual = 0;
+  i2cdutycycle_t duty = STD_DUTY_CYCLE;
+  char * endptr;
 
-  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 2) )
   {
     return false;
   }
@@ -98,13 +308,50 @@ static bool fetch_i2c_config_cmd(BaseSequentialStream * chp, char * cmd_list[],
     return false;
   }
 
-  // standard i2c configuration at 100kHz
-  i2c_cfg.op_mode = OPMODE_I2C;
-  i2c_cfg.clock_speed = 100000;
-  i2c_cfg.duty_cycle = STD_DUTY_CYCLE;
+  if( data_list[1] != NULL )
+  {
+    speed = strtoul(data_list[1], &endptr, 0);
+
+    if( *endptr != '\0' || speed < I2C_MIN_SPEED || speed > I2C_MAX_SPEED )
+    {
+      util_message_error(chp, "invalid speed. Range: %u-%u", I2C_MIN_SPEED, I2C_MAX_SPEED);
+      return false;
+    }
+  }
+
+  // fast mode above 100kHz, 2:1 duty first as it divides finer than 16/9
+  if( speed > I2C_STD_MAX_SPEED )
+  {
+    uint32_t duty_2 = i2c_exact_speed(speed, 3, 1, I2C_STD_MAX_SPEED + 1);
+    uint32_t duty_16_9 = i2c_exact_speed(speed, 25, 1, I2C_STD_MAX_SPEED + 1);
+
+    duty = (duty_2 >= duty_16_9) ? FAST_DUTY_CYCLE_2 : FAST_DUTY_CYCLE_16_9;
+    actual = (duty_2 >= duty_16_9) ? duty_2 : duty_16_9;
+  }
+
+  // nothing fast fits, fall back to the fastest standard speed
+  if( actual == 0 )
+  {
+    duty = STD_DUTY_CYCLE;
+    actual = i2c_exact_speed((speed > I2C_STD_MAX_SPEED) ? I2C_STD_MAX_SPEED : speed, 2, I2C_STD_MIN_CCR, I2C_MIN_SPEED);
+  }
+
+  if( actual == 0 )
+  {
+    util_message_error(chp, "speed not reachable from a %uHz clock", STM32_PCLK1);
+    return false;
+  }
+
+  bus = i2c_find_bus(i2c_drv);
+
+  bus->cfg.op_mode = OPMODE_I2C;
+  bus->cfg.clock_speed = actual;
+  bus->cfg.duty_cycle = duty;
 
   // apply configuration
-  i2cStart(i2c_drv, &i2c_cfg);
+  i2cStart(i2c_drv, &bus->cfg);
+
+  util_message_uint32(chp, "speed", &actual, 1);
 
   return true;
 }
@@ -113,9 +360,9 @@ static bool fetch_i2c_transmit_cmd(BaseSequentialStream * chp, char * cmd_list[]
 {
   static uint8_t tx_buffer[MAX_I2C_BYTES];
   uint32_t byte_count = 0;
-  int number_base = 0;
+  int number_base = 16;
+  uint32_t data_start = 2;
   char * endptr;
-  int byte_value;
   i2caddr_t address;
   I2CDriver * i2c_drv;
 
@@ -144,48 +391,25 @@ static bool fetch_i2c_transmit_cmd(BaseSequentialStream * chp, char * cmd_list[]
     return false;
   }
 
-  number_base = strtol(data_list[2], &endptr, 0);
-
-  if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+  // the base may be left out when the data is a hex blob
+  if( !fetch_is_hex_blob(data_list[2]) )
   {
-    util_message_error(chp, "invalid number base");
-    return false;
-  }
+    number_base = strtol(data_list[2], &endptr, 0);
 
-  for( int i = 0; i < MAX_I2C_BYTES && data_list[i+3] != NULL; i++ )
-  {
-    byte_value = strtol(data_list[i+3], &endptr, number_base);
-    
-    if( *endptr != '\0' )
-    {
-      util_message_error(chp, "invalid data byte");
-      return false;
-    }
-    else if( byte_value < 0 || byte_value > 0xff )
+    if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
     {
-      util_message_error(chp, "invalid data byte");
+      util_message_error(chp, "invalid number base");
       return false;
     }
-    else
-    {
-      tx_buffer[i] = byte_value;
-      byte_count++;
-    }
+    data_start = 3;
   }
 
-  switch( i2cMasterTransmitTimeout(i2c_drv, address, tx_buffer, byte_count, NULL, 0, I2C_TIMEOUT) )
+  if( !fetch_parse_bytes(chp, &data_list[data_start], number_base, tx_buffer, MAX_I2C_BYTES, &byte_count) )
   {
-    case MSG_TIMEOUT:
-      util_message_error(chp, "i2c timeout");
-      i2cStart(i2c_drv, &i2c_cfg);
-      return false;
-    case MSG_RESET:
-      util_message_error(chp, "i2c error");
-      return false;
-    case MSG_OK:
-    default:
-      return true;
+    return false;
   }
+
+  return i2c_check_result(chp, i2c_drv, i2cMasterTransmitTimeout(i2c_drv, address, tx_buffer, byte_count, NULL, 0, i2c_timeout(i2c_drv, byte_count)));
 }
 
 static bool fetch_i2c_receive_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
@@ -229,22 +453,391 @@ static bool fetch_i2c_receive_cmd(BaseSequentialStream * chp, char * cmd_list[],
     return false;
   }
 
-  switch( i2cMasterReceiveTimeout(i2c_drv, address, rx_buffer, byte_count, I2C_TIMEOUT) )
+  if( !i2c_check_result(chp, i2c_drv, i2cMasterReceiveTimeout(i2c_drv, address, rx_buffer, byte_count, i2c_timeout(i2c_drv, byte_count))) )
   {
-    case MSG_TIMEOUT:
-      util_message_error(chp, "i2c timeout");
-      i2cStart(i2c_drv, &i2c_cfg);
+    return false;
+  }
+
+  util_message_uint32(chp, "count", &byte_count, 1);
+  util_message_hex_uint8( chp, "rx", rx_buffer, byte_count);
+
+  return true;
+}
+
+/*! \brief write then read with a repeated start, the bus is not released between
+ */
+static bool fetch_i2c_transceive_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint8_t tx_buffer[MAX_I2C_BYTES];
+  static uint8_t rx_buffer[MAX_I2C_BYTES];
+  uint32_t tx_count = 0;
+  uint32_t rx_count;
+  uint32_t last;
+  int number_base = 16;
+  uint32_t data_start = 2;
+  char * endptr;
+  i2caddr_t address;
+  I2CDriver * i2c_drv;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, MAX_I2C_BYTES + 4) )
+  {
+    return false;
+  }
+
+  if( (i2c_drv = parse_i2c_dev(data_list[0], NULL)) == NULL)
+  {
+    util_message_error(chp, "invalid device identifier");
+    return false;
+  }
+
+  if( i2c_drv->state != I2C_READY )
+  {
+    util_message_error(chp, "I2C not ready");
+    return false;
+  }
+
+  address = strtol(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || address > 127 )
+  {
+    util_message_error(chp, "invalid address byte");
+    return false;
+  }
+
+  if( !fetch_is_hex_blob(data_list[2]) )
+  {
+    number_base = strtol(data_list[2], &endptr, 0);
+
+    if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+    {
+      util_message_error(chp, "invalid number base");
       return false;
-    case MSG_RESET:
-      util_message_error(chp, "i2c error");
+    }
+    data_start = 3;
+  }
+
+  // the last argument is the rx count, the tx bytes are the ones before it
+  last = data_start;
+  while( data_list[last] != NULL )
+  {
+    last++;
+  }
+
+  if( last < data_start + 2 )
+  {
+    util_message_error(chp, "missing tx bytes or rx count");
+    return false;
+  }
+
+  last--;
+  rx_count = strtoul(data_list[last], &endptr, 0);
+
+  if( *endptr != '\0' || rx_count == 0 || rx_count > MAX_I2C_BYTES )
+  {
+    util_message_error(chp, "invalid rx count");
+    return false;
+  }
+
+  data_list[last] = NULL;
+
+  if( !fetch_parse_bytes(chp, &data_list[data_start], number_base, tx_buffer, MAX_I2C_BYTES, &tx_count) )
+  {
+    return false;
+  }
+
+  if( !i2c_check_result(chp, i2c_drv, i2cMasterTransmitTimeout(i2c_drv, address, tx_buffer, tx_count, rx_buffer, rx_count, i2c_timeout(i2c_drv, tx_count + rx_count))) )
+  {
+    return false;
+  }
+
+  util_message_uint32(chp, "count", &rx_count, 1);
+  util_message_hex_uint8(chp, "rx", rx_buffer, rx_count);
+
+  return true;
+}
+
+/*! \brief parse the address, register and register width shared by readregs and writeregs
+ */
+static bool i2c_parse_register(BaseSequentialStream * chp, char * addr_str, char * reg_str, char * width_str,
+                               i2caddr_t * address, uint32_t * reg, uint32_t * width)
+{
+  char * endptr;
+
+  if( addr_str == NULL || reg_str == NULL )
+  {
+    util_message_error(chp, "missing address or register");
+    return false;
+  }
+
+  *address = strtol(addr_str, &endptr, 0);
+
+  if( *endptr != '\0' || *address > 127 )
+  {
+    util_message_error(chp, "invalid address byte");
+    return false;
+  }
+
+  *width = 1;
+
+  if( width_str != NULL )
+  {
+    *width = strtoul(width_str, &endptr, 0);
+
+    if( *endptr != '\0' || *width < 1 || *width > 2 )
+    {
+      util_message_error(chp, "invalid register width, 1 | 2");
       return false;
-    case MSG_OK:
-    default:
-      break;
+    }
+  }
+
+  *reg = strtoul(reg_str, &endptr, 0);
+
+  if( *endptr != '\0' || *reg >= (1U << (*width * 8)) )
+  {
+    util_message_error(chp, "invalid register");
+    return false;
+  }
+
+  return true;
+}
+
+/*! \brief register address bytes, most significant first
+ */
+static uint32_t i2c_register_bytes(uint8_t * buf, uint32_t reg, uint32_t width)
+{
+  if( width == 2 )
+  {
+    buf[0] = (reg >> 8) & 0xff;
+    buf[1] = reg & 0xff;
+  }
+  else
+  {
+    buf[0] = reg & 0xff;
+  }
+
+  return width;
+}
+
+/*! \brief read a register range in chunks, each chunk addressed again
+ *
+ *  The chunks are returned as several rx lines, like spi.read.
+ */
+static bool fetch_i2c_readregs_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint8_t rx_buffer[I2C_REGS_CHUNK];
+  uint8_t reg_bytes[2];
+  i2caddr_t address;
+  uint32_t reg, width, count, offset;
+  char * endptr;
+  I2CDriver * i2c_drv;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 5) )
+  {
+    return false;
+  }
+
+  if( (i2c_drv = parse_i2c_dev(data_list[0], NULL)) == NULL)
+  {
+    util_message_error(chp, "invalid device identifier");
+    return false;
+  }
+
+  if( i2c_drv->state != I2C_READY )
+  {
+    util_message_error(chp, "I2C not ready");
+    return false;
+  }
+
+  if( !i2c_parse_register(chp, data_list[1], data_list[2], data_list[4], &address, &reg, &width) )
+  {
+    return false;
+  }
+
+  if( data_list[3] == NULL )
+  {
+    util_message_error(chp, "missing count");
+    return false;
+  }
+
+  count = strtoul(data_list[3], &endptr, 0);
+
+  if( *endptr != '\0' || count == 0 || count > I2C_REGS_MAX_COUNT )
+  {
+    util_message_error(chp, "invalid count. Range: 1-%u", I2C_REGS_MAX_COUNT);
+    return false;
+  }
+
+  for( offset = 0; offset < count; )
+  {
+    uint32_t n = (count - offset < I2C_REGS_CHUNK) ? count - offset : I2C_REGS_CHUNK;
+    uint32_t reg_count = i2c_register_bytes(reg_bytes, reg + offset, width);
+
+    if( !i2c_check_result(chp, i2c_drv, i2cMasterTransmitTimeout(i2c_drv, address, reg_bytes, reg_count, rx_buffer, n, i2c_timeout(i2c_drv, reg_count + n))) )
+    {
+      return false;
+    }
+
+    util_message_hex_uint8(chp, "rx", rx_buffer, n);
+    offset += n;
+  }
+
+  util_message_uint32(chp, "count", &count, 1);
+
+  return true;
+}
+
+/*! \brief write a register range, split at page boundaries
+ *
+ *  After each page the device is ACK polled: a device in its write cycle
+ *  does not acknowledge its address, so the next write is retried until
+ *  it does or the write cycle timeout passes.
+ */
+static bool fetch_i2c_writeregs_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint8_t data[MAX_I2C_BYTES];
+  static uint8_t tx_buffer[MAX_I2C_BYTES + 2];
+  i2caddr_t address;
+  uint32_t reg, width, page, offset;
+  uint32_t byte_count = 0;
+  int number_base = 16;
+  uint32_t data_start = 5;
+  char * endptr;
+  msg_t result = MSG_OK;
+  I2CDriver * i2c_drv;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, MAX_I2C_BYTES + 6) )
+  {
+    return false;
+  }
+
+  if( (i2c_drv = parse_i2c_dev(data_list[0], NULL)) == NULL)
+  {
+    util_message_error(chp, "invalid device identifier");
+    return false;
+  }
+
+  if( i2c_drv->state != I2C_READY )
+  {
+    util_message_error(chp, "I2C not ready");
+    return false;
+  }
+
+  if( !i2c_parse_register(chp, data_list[1], data_list[2], data_list[3], &address, &reg, &width) )
+  {
+    return false;
+  }
+
+  if( data_list[3] == NULL || data_list[4] == NULL )
+  {
+    util_message_error(chp, "missing register width or page size");
+    return false;
+  }
+
+  page = strtoul(data_list[4], &endptr, 0);
+
+  if( *endptr != '\0' || page > MAX_I2C_BYTES || (page & (page - 1)) != 0 )
+  {
+    util_message_error(chp, "invalid page size, 0 or a power of two up to %u", MAX_I2C_BYTES);
+    return false;
+  }
+
+  if( !fetch_is_hex_blob(data_list[5]) )
+  {
+    if( data_list[5] == NULL )
+    {
+      util_message_error(chp, "missing data");
+      return false;
+    }
+
+    number_base = strtol(data_list[5], &endptr, 0);
+
+    if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+    {
+      util_message_error(chp, "invalid number base");
+      return false;
+    }
+    data_start = 6;
+  }
+
+  if( !fetch_parse_bytes(chp, &data_list[data_start], number_base, data, MAX_I2C_BYTES, &byte_count) )
+  {
+    return false;
+  }
+
+  if( byte_count == 0 )
+  {
+    util_message_error(chp, "missing data");
+    return false;
+  }
+
+  for( offset = 0; offset < byte_count; )
+  {
+    // without a page size the whole range is one write
+    uint32_t room = (page == 0) ? byte_count : page - ((reg + offset) % page);
+    uint32_t n = (byte_count - offset < room) ? byte_count - offset : room;
+    uint32_t reg_count = i2c_register_bytes(tx_buffer, reg + offset, width);
+    systime_t start = chVTGetSystemTime();
+
+    memcpy(&tx_buffer[reg_count], &data[offset], n);
+
+    do
+    {
+      result = i2cMasterTransmitTimeout(i2c_drv, address, tx_buffer, reg_count + n, NULL, 0, i2c_timeout(i2c_drv, reg_count + n));
+    } while( result == MSG_RESET && (i2cGetErrors(i2c_drv) & I2C_ACK_FAILURE) &&
+             chVTTimeElapsedSinceX(start) < MS2ST(I2C_WRITE_CYCLE_MS) );
+
+    if( !i2c_check_result(chp, i2c_drv, result) )
+    {
+      return false;
+    }
+
+    offset += n;
+  }
+
+  // wait out the last write cycle, so the next command finds the device ready
+  if( page != 0 )
+  {
+    uint32_t reg_count = i2c_register_bytes(tx_buffer, reg, width);
+    systime_t start = chVTGetSystemTime();
+
+    do
+    {
+      result = i2cMasterTransmitTimeout(i2c_drv, address, tx_buffer, reg_count, NULL, 0, i2c_timeout(i2c_drv, reg_count));
+    } while( result == MSG_RESET && (i2cGetErrors(i2c_drv) & I2C_ACK_FAILURE) &&
+             chVTTimeElapsedSinceX(start) < MS2ST(I2C_WRITE_CYCLE_MS) );
+
+    if( !i2c_check_result(chp, i2c_drv, result) )
+    {
+      return false;
+    }
   }
 
   util_message_uint32(chp, "count", &byte_count, 1);
-  util_message_hex_uint8( chp, "rx", rx_buffer, byte_count);
+
+  return true;
+}
+
+static bool fetch_i2c_recover_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  I2CDriver * i2c_drv;
+  uint32_t pulses;
+  bool released;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  if( (i2c_drv = parse_i2c_dev(data_list[0], NULL)) == NULL)
+  {
+    util_message_error(chp, "invalid device identifier");
+    return false;
+  }
+
+  released = i2c_bus_recover(i2c_find_bus(i2c_drv), &pulses);
+
+  util_message_bool(chp, "released", released);
+  util_message_uint32(chp, "pulses", &pulses, 1);
 
   return true;
 }
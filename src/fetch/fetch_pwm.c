@@ -0,0 +1,596 @@
+/*! \file fetch_pwm.c
+  *
+  * Hardware PWM outputs on timer channel pins
+  *
+  * \sa fetch.c
+  * @defgroup fetch_pwm Fetch PWM
+  * @{
+  */
+
+/*!
+ * <hr>
+ *
+ *  A timer is started with a frequency and a resolution (counts per
+ *  period), then its channel pins are switched to the timer one at a time
+ *  with a width in counts (0 = always low, resolution = always high).
+ *
+ *  TIM1 channels also drive their complementary N pins, with optional dead
+ *  time inserted between the two edges. TIM8 paces the gpio capture and
+ *  pattern DMA, TIM2 and TIM5 belong to the counter, so they are not
+ *  offered here.
+ *
+ *  Compare and auto-reload registers are preloaded, so a new width only
+ *  takes effect at the next period boundary. pwm.duty with several pins
+ *  holds off the update event while writing, so all of them change in the
+ *  same period.
+ *
+ * <hr>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_messages.h"
+#include "util_io.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+
+#include "fetch_pwm.h"
+
+#ifndef FETCH_PWM_MAX_RESOLUTION
+#define FETCH_PWM_MAX_RESOLUTION      65536   //!< 16 bit timers
+#endif
+
+#define PWM_MIN_RESOLUTION            2
+#define PWM_MAX_PRESCALER             65536
+#define PWM_MAX_DEADTIME_TICKS        1008    //!< (32 + 31) * 16, see RM0090 TIMx_BDTR
+
+/*! \brief a timer available for PWM
+ */
+typedef struct pwm_timer
+{
+  const char    * name;
+  PWMDriver     * driver;
+  uint32_t        clock;
+  bool            complementary;
+} pwm_timer_t;
+
+/*! \brief a timer channel output pin
+ */
+typedef struct pwm_pin
+{
+  ioportid_t      port;
+  uint32_t        pin;
+  uint32_t        af;
+  uint32_t        timer;
+  pwmchannel_t    channel;
+} pwm_pin_t;
+
+enum {
+  PWM_TIM1 = 0,
+  PWM_TIM3,
+  PWM_TIM4,
+  PWM_TIM9,
+  PWM_TIMERS
+};
+
+static const pwm_timer_t pwm_timers[PWM_TIMERS] = {
+  { "TIM1", &PWMD1, STM32_TIMCLK2, true  },
+  { "TIM3", &PWMD3, STM32_TIMCLK1, false },
+  { "TIM4", &PWMD4, STM32_TIMCLK1, false },
+  { "TIM9", &PWMD9, STM32_TIMCLK2, false },
+};
+
+static const pwm_pin_t pwm_pins[] = {
+  { GPIOE, GPIOE_PIN9,  1, PWM_TIM1, 0 },  // TIM1_CH1
+  { GPIOE, GPIOE_PIN8,  1, PWM_TIM1, 0 },  // TIM1_CH1N
+  { GPIOE, GPIOE_PIN10, 1, PWM_TIM1, 1 },  // TIM1_CH2N
+  { GPIOB, GPIOB_PIN14, 1, PWM_TIM1, 1 },  // TIM1_CH2N
+  { GPIOB, GPIOB_PIN15, 1, PWM_TIM1, 2 },  // TIM1_CH3N
+  { GPIOC, GPIOC_PIN6,  2, PWM_TIM3, 0 },  // TIM3_CH1
+  { GPIOD, GPIOD_PIN12, 2, PWM_TIM4, 0 },  // TIM4_CH1
+  { GPIOB, GPIOB_PIN8,  2, PWM_TIM4, 2 },  // TIM4_CH3
+  { GPIOB, GPIOB_PIN9,  2, PWM_TIM4, 3 },  // TIM4_CH4
+  { GPIOE, GPIOE_PIN5,  3, PWM_TIM9, 0 },  // TIM9_CH1
+  { GPIOE, GPIOE_PIN6,  3, PWM_TIM9, 1 },  // TIM9_CH2
+};
+
+static const char * pwm_timer_tok[] = { "TIM1", "TIM3", "TIM4", "TIM9" };
+
+static bool fetch_pwm_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_pwm_start_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_pwm_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_pwm_enable_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_pwm_duty_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_pwm_disable_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_pwm_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+static const char pwm_start_help_string[] = "Start a PWM timer\n" \
+                      "Usage: start(<timer>,<frequency>,<resolution>[,<deadtime>])\n" \
+                      "\ttimer = TIM1 | TIM3 | TIM4 | TIM9\n" \
+                      "\tfrequency = <Hz> {actual frequency is returned}\n" \
+                      "\tresolution = <counts per period> 2-65536\n" \
+                      "\tdeadtime = <ns> {TIM1 only, actual dead time is returned}";
+
+static const char pwm_enable_help_string[] = "Switch a pin to its started timer\n" \
+                      "Usage: enable(<port>,<pin>,<width>)\n" \
+                      "\twidth = <counts> 0-resolution\n" \
+                      "\tpins: e,9 e,8(N) e,10(N) b,14(N) b,15(N) {TIM1}\n" \
+                      "\t      c,6 {TIM3} d,12 b,8 b,9 {TIM4} e,5 e,6 {TIM9}";
+
+static const char pwm_duty_help_string[] = "Change widths in the same period\n" \
+                      "Usage: duty(<port>,<pin>,<width>[,<port>,<pin>,<width>...])\n" \
+                      "\tall pins must be on the same timer";
+
+static fetch_command_t fetch_pwm_commands[] = {
+  /*  function                  command string      help string */
+    { fetch_pwm_help_cmd,       "help",             "Display PWM help" },
+    { fetch_pwm_start_cmd,      "start",            pwm_start_help_string },
+    { fetch_pwm_stop_cmd,       "stop",             "Stop a PWM timer and release its pins\nUsage: stop(<timer>)" },
+    { fetch_pwm_enable_cmd,     "enable",           pwm_enable_help_string },
+    { fetch_pwm_duty_cmd,       "duty",             pwm_duty_help_string },
+    { fetch_pwm_disable_cmd,    "disable",          "Return a pin to gpio\nUsage: disable(<port>,<pin>)" },
+    { fetch_pwm_reset_cmd,      "reset",            "Stop all PWM timers" },
+    { NULL, NULL, NULL }
+  };
+
+//! the driver keeps a pointer to its configuration
+static PWMConfig pwm_configs[PWM_TIMERS];
+static bool pwm_pin_enabled[NELEMS(pwm_pins)];
+
+/*! \brief encode a dead time for TIMx_BDTR DTG
+ *  \param[in,out] ticks  requested dead time in timer clocks, rounded up
+ *  \returns DTG field value
+ */
+static uint32_t pwm_deadtime_bits(uint32_t * ticks)
+{
+  uint32_t t = *ticks;
+  uint32_t step;
+
+  if( t <= 127 )
+  {
+    return t;
+  }
+  else if( t <= 254 )
+  {
+    step = (t + 1) / 2;
+    *ticks = step * 2;
+    return 0x80 | (step - 64);
+  }
+  else if( t <= 504 )
+  {
+    step = (t + 7) / 8;
+    *ticks = step * 8;
+    return 0xc0 | (step - 32);
+  }
+
+  step = (t + 15) / 16;
+  *ticks = step * 16;
+  return 0xe0 | (step - 32);
+}
+
+/*! \brief exact divider of the timer clock closest to target
+ *  \note the driver only accepts counter clocks that divide it exactly
+ */
+static uint32_t pwm_best_divider(uint32_t clock, float target)
+{
+  uint32_t best = 0;
+  float best_error = 0.0f;
+
+  for( uint32_t divider = 1; divider <= PWM_MAX_PRESCALER; divider++ )
+  {
+    if( (clock % divider) != 0 )
+    {
+      continue;
+    }
+
+    float error = (divider > target) ? ((float)divider - target) : (target - (float)divider);
+
+    if( best == 0 || error < best_error )
+    {
+      best = divider;
+      best_error = error;
+    }
+  }
+  return best;
+}
+
+static const pwm_pin_t * parse_pwm_pin(char * port_str, char * pin_str, uint32_t * index)
+{
+  ioportid_t port = string_to_port(port_str);
+  uint32_t pin = string_to_pin(pin_str);
+
+  for( uint32_t i = 0; i < NELEMS(pwm_pins); i++ )
+  {
+    if( pwm_pins[i].port == port && pwm_pins[i].pin == pin )
+    {
+      if( index != NULL )
+      {
+        *index = i;
+      }
+      return &pwm_pins[i];
+    }
+  }
+  return NULL;
+}
+
+static bool parse_pwm_width(BaseSequentialStream * chp, const pwm_pin_t * pin, char * str, pwmcnt_t * width)
+{
+  PWMDriver * driver = pwm_timers[pin->timer].driver;
+  char * endptr;
+  int32_t value;
+
+  if( driver->state != PWM_READY )
+  {
+    util_message_error(chp, "%s not started", pwm_timers[pin->timer].name);
+    return false;
+  }
+
+  if( str == NULL )
+  {
+    util_message_error(chp, "missing width");
+    return false;
+  }
+
+  value = strtol(str, &endptr, 0);
+
+  if( *endptr != '\0' || value < 0 || (uint32_t)value > driver->period )
+  {
+    util_message_error(chp, "invalid width. Range: 0-%u", driver->period);
+    return false;
+  }
+
+  *width = value;
+  return true;
+}
+
+/*! \brief stop a timer and return its pins to gpio inputs
+ */
+static void pwm_timer_stop(uint32_t timer)
+{
+  for( uint32_t i = 0; i < NELEMS(pwm_pins); i++ )
+  {
+    if( pwm_pins[i].timer == timer && pwm_pin_enabled[i] )
+    {
+      palSetPadMode(pwm_pins[i].port, pwm_pins[i].pin, PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_FLOATING);
+      pwm_pin_enabled[i] = false;
+    }
+  }
+
+  if( pwm_timers[timer].driver->state == PWM_READY )
+  {
+    pwmStop(pwm_timers[timer].driver);
+  }
+}
+
+static bool fetch_pwm_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  util_message_info(chp, "Fetch PWM Help:");
+  fetch_display_help(chp, fetch_pwm_commands);
+	return true;
+}
+
+static bool fetch_pwm_start_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  const pwm_timer_t * timer;
+  PWMConfig * config;
+  char * endptr;
+  int32_t index;
+  uint32_t divider;
+  uint32_t deadtime_bits = 0;
+  uint32_t deadtime_ns = 0;
+  uint32_t millihertz;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 4) )
+  {
+    return false;
+  }
+
+  index = token_match(data_list[0], FETCH_MAX_DATA_STRLEN, pwm_timer_tok, NELEMS(pwm_timer_tok));
+
+  if( index == TOKEN_NOT_FOUND )
+  {
+    util_message_error(chp, "invalid timer");
+    return false;
+  }
+
+  timer = &pwm_timers[index];
+
+  if( timer->driver->state == PWM_READY )
+  {
+    util_message_error(chp, "%s already started, stop it first", timer->name);
+    return false;
+  }
+
+  if( data_list[1] == NULL || data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing argument");
+    return false;
+  }
+
+  float frequency = strtof(data_list[1], &endptr);
+
+  if( *endptr != '\0' || frequency <= 0.0f )
+  {
+    util_message_error(chp, "invalid frequency");
+    return false;
+  }
+
+  int32_t resolution = strtol(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || resolution < PWM_MIN_RESOLUTION || resolution > FETCH_PWM_MAX_RESOLUTION )
+  {
+    util_message_error(chp, "invalid resolution. Range: %u-%u", PWM_MIN_RESOLUTION, FETCH_PWM_MAX_RESOLUTION);
+    return false;
+  }
+
+  if( data_list[3] != NULL )
+  {
+    if( !timer->complementary )
+    {
+      util_message_error(chp, "dead time needs complementary outputs (TIM1)");
+      return false;
+    }
+
+    int32_t ns = strtol(data_list[3], &endptr, 0);
+    uint32_t ticks = ((uint64_t)ns * timer->clock + 999999999) / 1000000000;
+
+    if( *endptr != '\0' || ns < 0 || ticks > PWM_MAX_DEADTIME_TICKS )
+    {
+      util_message_error(chp, "invalid dead time. Range: 0-%u", (uint32_t)(((uint64_t)PWM_MAX_DEADTIME_TICKS * 1000000000) / timer->clock));
+      return false;
+    }
+
+    deadtime_bits = pwm_deadtime_bits(&ticks);
+    deadtime_ns = (uint32_t)(((uint64_t)ticks * 1000000000) / timer->clock);
+  }
+
+  float target = (float)timer->clock / (frequency * (float)resolution);
+
+  if( target < 1.0f || target > (float)PWM_MAX_PRESCALER )
+  {
+    util_message_error(chp, "frequency out of range for this resolution. Max: %u", timer->clock / resolution);
+    return false;
+  }
+
+  divider = pwm_best_divider(timer->clock, target);
+
+  config = &pwm_configs[index];
+  memset(config, 0, sizeof(*config));
+  config->frequency = timer->clock / divider;
+  config->period = resolution;
+  for( uint32_t ch = 0; ch < PWM_CHANNELS; ch++ )
+  {
+    config->channels[ch].mode = PWM_OUTPUT_ACTIVE_HIGH;
+    if( timer->complementary && ch < 3 )
+    {
+      config->channels[ch].mode |= PWM_COMPLEMENTARY_OUTPUT_ACTIVE_HIGH;
+    }
+  }
+  config->bdtr = deadtime_bits;
+
+  // channels start at width 0 and pins stay gpio until enabled
+  pwmStart(timer->driver, config);
+
+  millihertz = (uint32_t)(((uint64_t)config->frequency * 1000 + resolution / 2) / resolution);
+
+  util_message_uint32(chp, "frequency_mhz", &millihertz, 1);
+  util_message_uint32(chp, "resolution", (uint32_t *)&resolution, 1);
+  util_message_uint32(chp, "clock", &config->frequency, 1);
+  if( timer->complementary )
+  {
+    util_message_uint32(chp, "deadtime_ns", &deadtime_ns, 1);
+  }
+
+  return true;
+}
+
+static bool fetch_pwm_stop_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  int32_t index;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  index = token_match(data_list[0], FETCH_MAX_DATA_STRLEN, pwm_timer_tok, NELEMS(pwm_timer_tok));
+
+  if( index == TOKEN_NOT_FOUND )
+  {
+    util_message_error(chp, "invalid timer");
+    return false;
+  }
+
+  pwm_timer_stop(index);
+
+  return true;
+}
+
+static bool fetch_pwm_enable_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  const pwm_pin_t * pin;
+  uint32_t index;
+  pwmcnt_t width;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  pin = parse_pwm_pin(data_list[0], data_list[1], &index);
+
+  if( pin == NULL )
+  {
+    util_message_error(chp, "invalid port/pin, not a PWM output");
+    return false;
+  }
+
+  if( !parse_pwm_width(chp, pin, data_list[2], &width) )
+  {
+    return false;
+  }
+
+  pwmEnableChannel(pwm_timers[pin->timer].driver, pin->channel, width);
+  palSetPadMode(pin->port, pin->pin, PAL_MODE_ALTERNATE(pin->af) | PAL_STM32_OSPEED_HIGHEST);
+  pwm_pin_enabled[index] = true;
+
+  return true;
+}
+
+static bool fetch_pwm_duty_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  const pwm_pin_t * pins[PWM_CHANNELS * 2];
+  pwmcnt_t widths[PWM_CHANNELS * 2];
+  uint32_t count = 0;
+  uint32_t index;
+  PWMDriver * driver;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, NELEMS(pins) * 3) )
+  {
+    return false;
+  }
+
+  while( data_list[count * 3] != NULL && count < NELEMS(pins) )
+  {
+    pins[count] = parse_pwm_pin(data_list[count * 3], data_list[count * 3 + 1], &index);
+
+    if( pins[count] == NULL || !pwm_pin_enabled[index] )
+    {
+      util_message_error(chp, "pin %u is not an enabled PWM output", count);
+      return false;
+    }
+
+    if( pins[count]->timer != pins[0]->timer )
+    {
+      util_message_error(chp, "all pins must be on %s", pwm_timers[pins[0]->timer].name);
+      return false;
+    }
+
+    if( !parse_pwm_width(chp, pins[count], data_list[count * 3 + 2], &widths[count]) )
+    {
+      return false;
+    }
+
+    count++;
+  }
+
+  if( count == 0 )
+  {
+    util_message_error(chp, "missing argument");
+    return false;
+  }
+
+  driver = pwm_timers[pins[0]->timer].driver;
+
+  // with UDIS set the preloaded compare values are not transferred, so a
+  // period boundary in the middle of the writes cannot split the update
+  chSysLock();
+  driver->tim->CR1 |= STM32_TIM_CR1_UDIS;
+  for( uint32_t i = 0; i < count; i++ )
+  {
+    pwmEnableChannelI(driver, pins[i]->channel, widths[i]);
+  }
+  driver->tim->CR1 &= ~STM32_TIM_CR1_UDIS;
+  chSysUnlock();
+
+  return true;
+}
+
+static bool fetch_pwm_disable_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  const pwm_pin_t * pin;
+  uint32_t index;
+  bool shared = false;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 2) )
+  {
+    return false;
+  }
+
+  pin = parse_pwm_pin(data_list[0], data_list[1], &index);
+
+  if( pin == NULL )
+  {
+    util_message_error(chp, "invalid port/pin, not a PWM output");
+    return false;
+  }
+
+  if( !pwm_pin_enabled[index] )
+  {
+    return true;
+  }
+
+  palSetPadMode(pin->port, pin->pin, PAL_STM32_MODE_INPUT | PAL_STM32_PUPDR_FLOATING);
+  pwm_pin_enabled[index] = false;
+
+  // a channel can still be driving its complementary pin
+  for( uint32_t i = 0; i < NELEMS(pwm_pins); i++ )
+  {
+    if( pwm_pin_enabled[i] && pwm_pins[i].timer == pin->timer && pwm_pins[i].channel == pin->channel )
+    {
+      shared = true;
+    }
+  }
+
+  if( !shared )
+  {
+    pwmDisableChannel(pwm_timers[pin->timer].driver, pin->channel);
+  }
+
+  return true;
+}
+
+static bool fetch_pwm_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  return fetch_pwm_reset(chp);
+}
+
+void fetch_pwm_init(BaseSequentialStream * chp)
+{
+  static bool pwm_init_flag = false;
+
+  if( pwm_init_flag )
+    return;
+
+  fetch_pwm_reset(chp);
+
+  pwm_init_flag = true;
+}
+
+/*! \brief dispatch a PWM command
+ */
+bool fetch_pwm_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  return fetch_dispatch(chp, fetch_pwm_commands, cmd_list[FETCH_TOK_SUBCMD_0], cmd_list, data_list);
+}
+
+bool fetch_pwm_reset(BaseSequentialStream * chp)
+{
+  for( uint32_t i = 0; i < PWM_TIMERS; i++ )
+  {
+    pwm_timer_stop(i);
+  }
+
+  return true;
+}
+
+/*! @} */
@@ -0,0 +1,424 @@
+/*! \file fetch_slcan.c
+  *
+  * Lawicel SLCAN bridge from a USB CDC channel to CAN1
+  *
+  * \sa fetch_can.c
+  * @defgroup fetch_slcan Fetch SLCAN
+  * @{
+  */
+
+/*!
+ * <hr>
+ *
+ *  A thread of its own reads SLCAN commands from the channel and sends
+ *  received frames back, so slcand and can-utils see a standard serial
+ *  CAN adapter and the fetch parser is never involved:
+ *
+ *      slcand -o -s6 -t hw /dev/ttyACM1 can0
+ *
+ *  Supported: Sn (n = 0..8, S7 is refused as 800k is not reachable from
+ *  42MHz), O, L, C, t, T, r, R, F, V, N, Z0/Z1. M and m are accepted and
+ *  ignored, set the hardware filters with can.filter instead.
+ *
+ *  The bridge owns the controller while it is open. can.config,
+ *  can.frames and can.reset are refused until C, a fetch reset closes it.
+ *
+ * <hr>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_version.h"
+
+#include "fetch_can.h"
+#include "fetch_slcan.h"
+
+#define SLCAN_THREAD_WA_SIZE      1024
+#define SLCAN_THREAD_PRIO         (NORMALPRIO + 1)
+#define SLCAN_MAX_LINE            32        //!< longest command, T with 8 data bytes is 26
+#define SLCAN_RX_BATCH            32        //!< frames per channel write
+#define SLCAN_MAX_FRAME_TEXT      31        //!< T, 8 id, dlc, 16 data, 4 timestamp, CR
+#define SLCAN_POLL_MS             10        //!< a bridge closed by fetch reset is noticed this late
+#define SLCAN_WRITE_TIMEOUT_MS    100
+#define SLCAN_TIMESTAMP_WRAP_MS   60000
+
+#define SLCAN_USB_EVENT           EVENT_MASK(0)
+
+#define SLCAN_OK                  "\r"
+#define SLCAN_ERROR               "\a"
+
+// F command status bits
+#define SLCAN_STATUS_ERROR_WARNING    0x04
+#define SLCAN_STATUS_DATA_OVERRUN     0x08
+#define SLCAN_STATUS_ERROR_PASSIVE    0x20
+#define SLCAN_STATUS_BUS_ERROR        0x80
+
+// CAN error status register
+#define SLCAN_ESR_EWGF            (1U << 0)
+#define SLCAN_ESR_EPVF            (1U << 1)
+#define SLCAN_ESR_BOFF            (1U << 2)
+
+//! S0 to S8
+static const uint32_t slcan_bitrates[] = {10000, 20000, 50000, 100000, 125000, 250000, 500000, 800000, 1000000};
+
+static const char slcan_hex_digits[] = "0123456789ABCDEF";
+
+static struct
+{
+  BaseAsynchronousChannel * chnp;
+  uint32_t                  bitrate;        //!< 0 until an S command
+  bool                      open;
+  bool                      timestamps;
+  uint32_t                  lost;           //!< frames dropped since the last F
+  char                      line[SLCAN_MAX_LINE + 1];
+  uint32_t                  line_length;
+  bool                      line_overflow;
+} slcan;
+
+static THD_WORKING_AREA(slcan_wa, SLCAN_THREAD_WA_SIZE);
+
+static void slcan_write(const char * buf, uint32_t length)
+{
+  chnWriteTimeout(slcan.chnp, (const uint8_t *)buf, length, MS2ST(SLCAN_WRITE_TIMEOUT_MS));
+}
+
+static void slcan_reply(const char * str)
+{
+  slcan_write(str, strlen(str));
+}
+
+/*! \brief parse a fixed number of hex digits
+ */
+static bool slcan_parse_hex(const char * str, uint32_t digits, uint32_t * value)
+{
+  *value = 0;
+
+  for( uint32_t i = 0; i < digits; i++ )
+  {
+    char c = str[i];
+
+    if( c >= '0' && c <= '9' )
+    {
+      *value = (*value << 4) | (c - '0');
+    }
+    else if( c >= 'A' && c <= 'F' )
+    {
+      *value = (*value << 4) | (c - 'A' + 10);
+    }
+    else if( c >= 'a' && c <= 'f' )
+    {
+      *value = (*value << 4) | (c - 'a' + 10);
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static char * slcan_put_hex(char * out, uint32_t value, uint32_t digits)
+{
+  for( uint32_t i = digits; i > 0; i-- )
+  {
+    out[i - 1] = slcan_hex_digits[value & 0x0f];
+    value >>= 4;
+  }
+
+  return out + digits;
+}
+
+/*! \brief t, T, r and R: tiiildd..., Tiiiiiiiildd..., riiil, Riiiiiiiil
+ */
+static bool slcan_transmit(const char * line, uint32_t length)
+{
+  bool extended = (line[0] == 'T' || line[0] == 'R');
+  bool remote = (line[0] == 'r' || line[0] == 'R');
+  uint32_t id_digits = extended ? 8 : 3;
+  uint32_t id, dlc;
+  can_frame_t frame;
+
+  if( !slcan.open || length < id_digits + 2 ||
+      !slcan_parse_hex(&line[1], id_digits, &id) ||
+      id > (extended ? 0x1fffffff : 0x7ff) ||
+      !slcan_parse_hex(&line[1 + id_digits], 1, &dlc) || dlc > 8 )
+  {
+    return false;
+  }
+
+  if( length != id_digits + 2 + (remote ? 0 : dlc * 2) )
+  {
+    return false;
+  }
+
+  frame.id = id | (extended ? CAN_FRAME_EXT : 0) | (remote ? CAN_FRAME_RTR : 0);
+  frame.dlc = dlc;
+  frame.data32[0] = 0;
+  frame.data32[1] = 0;
+
+  for( uint32_t i = 0; !remote && i < dlc; i++ )
+  {
+    uint32_t byte;
+
+    if( !slcan_parse_hex(&line[id_digits + 2 + i * 2], 2, &byte) )
+    {
+      return false;
+    }
+    frame.data[i] = byte;
+  }
+
+  return fetch_can_transmit(&frame);
+}
+
+static void slcan_command(const char * line, uint32_t length)
+{
+  char reply[8];
+  uint32_t value;
+
+  if( length == 0 )
+  {
+    slcan_reply(SLCAN_OK);
+    return;
+  }
+
+  switch( line[0] )
+  {
+    case 'S':
+      if( slcan.open || length != 2 || line[1] < '0' || line[1] >= '0' + (char)NELEMS(slcan_bitrates) ||
+          !fetch_can_bitrate_valid(slcan_bitrates[line[1] - '0']) )
+      {
+        slcan_reply(SLCAN_ERROR);
+        return;
+      }
+      slcan.bitrate = slcan_bitrates[line[1] - '0'];
+      break;
+
+    case 'O':
+    case 'L':
+      if( slcan.open || length != 1 || slcan.bitrate == 0 ||
+          !fetch_can_bridge_open(slcan.bitrate, line[0] == 'L') )
+      {
+        slcan_reply(SLCAN_ERROR);
+        return;
+      }
+      slcan.open = true;
+      slcan.lost = 0;
+      break;
+
+    case 'C':
+      if( slcan.open )
+      {
+        fetch_can_bridge_close();
+        slcan.open = false;
+      }
+      break;
+
+    case 't':
+    case 'T':
+    case 'r':
+    case 'R':
+      if( !slcan_transmit(line, length) )
+      {
+        slcan_reply(SLCAN_ERROR);
+        return;
+      }
+      slcan_reply((line[0] == 't' || line[0] == 'r') ? "z\r" : "Z\r");
+      return;
+
+    case 'F':
+      if( !slcan.open )
+      {
+        slcan_reply(SLCAN_ERROR);
+        return;
+      }
+      value = fetch_can_errors();
+      value = ((value & SLCAN_ESR_EWGF) ? SLCAN_STATUS_ERROR_WARNING : 0) |
+              ((value & SLCAN_ESR_EPVF) ? SLCAN_STATUS_ERROR_PASSIVE : 0) |
+              ((value & SLCAN_ESR_BOFF) ? SLCAN_STATUS_BUS_ERROR : 0) |
+              ((slcan.lost > 0) ? SLCAN_STATUS_DATA_OVERRUN : 0);
+      slcan.lost = 0;
+      reply[0] = 'F';
+      slcan_put_hex(&reply[1], value, 2);
+      reply[3] = '\r';
+      slcan_write(reply, 4);
+      return;
+
+    case 'V':
+      slcan_reply("V0101\r");
+      return;
+
+    case 'N':
+      reply[0] = 'N';
+      slcan_put_hex(&reply[1], *(uint32_t *)STM32F4_UNIQUE_ID_LOW, 4);
+      reply[5] = '\r';
+      slcan_write(reply, 6);
+      return;
+
+    case 'Z':
+      if( length != 2 || (line[1] != '0' && line[1] != '1') )
+      {
+        slcan_reply(SLCAN_ERROR);
+        return;
+      }
+      slcan.timestamps = (line[1] == '1');
+      break;
+
+    case 'M':
+    case 'm':
+      break;
+
+    default:
+      slcan_reply(SLCAN_ERROR);
+      return;
+  }
+
+  slcan_reply(SLCAN_OK);
+}
+
+static void slcan_read_input(void)
+{
+  uint8_t buf[64];
+  size_t count;
+
+  while( (count = chnReadTimeout(slcan.chnp, buf, sizeof(buf), TIME_IMMEDIATE)) > 0 )
+  {
+    for( size_t i = 0; i < count; i++ )
+    {
+      if( buf[i] == '\r' )
+      {
+        if( slcan.line_overflow )
+        {
+          slcan_reply(SLCAN_ERROR);
+        }
+        else
+        {
+          slcan.line[slcan.line_length] = '\0';
+          slcan_command(slcan.line, slcan.line_length);
+        }
+        slcan.line_length = 0;
+        slcan.line_overflow = false;
+      }
+      else if( buf[i] == '\n' )
+      {
+        continue;
+      }
+      else if( slcan.line_length < SLCAN_MAX_LINE )
+      {
+        slcan.line[slcan.line_length++] = buf[i];
+      }
+      else
+      {
+        slcan.line_overflow = true;
+      }
+    }
+  }
+}
+
+/*! \brief send the received frames, several per channel write
+ */
+static void slcan_forward_frames(void)
+{
+  static can_frame_t frames[SLCAN_RX_BATCH];
+  static char out[SLCAN_RX_BATCH * SLCAN_MAX_FRAME_TEXT];
+  int32_t count;
+  uint32_t lost;
+
+  do
+  {
+    char * p = out;
+
+    if( (count = fetch_can_bridge_receive(frames, SLCAN_RX_BATCH, &lost)) < 0 )
+    {
+      // closed by a fetch reset
+      slcan.open = false;
+      return;
+    }
+    slcan.lost += lost;
+
+    for( int32_t i = 0; i < count; i++ )
+    {
+      const can_frame_t * frame = &frames[i];
+      bool remote = (frame->id & CAN_FRAME_RTR) != 0;
+
+      if( frame->id & CAN_FRAME_EXT )
+      {
+        *p++ = remote ? 'R' : 'T';
+        p = slcan_put_hex(p, frame->id & 0x1fffffff, 8);
+      }
+      else
+      {
+        *p++ = remote ? 'r' : 't';
+        p = slcan_put_hex(p, frame->id & 0x7ff, 3);
+      }
+      *p++ = '0' + frame->dlc;
+
+      for( uint32_t n = 0; !remote && n < frame->dlc; n++ )
+      {
+        p = slcan_put_hex(p, frame->data[n], 2);
+      }
+
+      if( slcan.timestamps )
+      {
+        p = slcan_put_hex(p, (frame->time_us / 1000) % SLCAN_TIMESTAMP_WRAP_MS, 4);
+      }
+      *p++ = '\r';
+    }
+
+    if( p != out )
+    {
+      slcan_write(out, p - out);
+    }
+  } while( count == SLCAN_RX_BATCH );
+}
+
+static void slcan_thread(void * arg)
+{
+  event_listener_t listener;
+
+  (void)arg;
+
+  chRegSetThreadName("slcan");
+  chEvtRegisterMask(chnGetEventSource(slcan.chnp), &listener, SLCAN_USB_EVENT);
+
+  while( true )
+  {
+    // FETCH_CAN_RX_EVENT or input, the timeout catches a bridge closed elsewhere
+    chEvtWaitAnyTimeout(ALL_EVENTS, MS2ST(SLCAN_POLL_MS));
+
+    slcan_read_input();
+
+    if( slcan.open )
+    {
+      slcan_forward_frames();
+    }
+  }
+}
+
+/*! \brief start the bridge thread on a channel
+ */
+void fetch_slcan_init(BaseAsynchronousChannel * chnp)
+{
+  static bool slcan_init_flag = false;
+
+  if( slcan_init_flag )
+    return;
+
+  // the bridge can start before the shell initializes fetch
+  fetch_can_init(NULL);
+
+  slcan.chnp = chnp;
+  chThdCreateStatic(slcan_wa, sizeof(slcan_wa), SLCAN_THREAD_PRIO, slcan_thread, NULL);
+
+  slcan_init_flag = true;
+}
+
+/*! @} */
@@ -10,20 +10,69 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "util_messages.h"
 #include "util_strings.h"
 #include "util_general.h"
 #include "util_io.h"
+#include "util_ring.h"
+#include "util_timestamp.h"
 
 #include "fetch.h"
 #include "fetch_defs.h"
 #include "fetch_spi.h"
+#include "fetch_gpio.h"
 
 #ifndef MAX_SPI_BYTES
-#define MAX_SPI_BYTES   256
+#define MAX_SPI_BYTES   512     //!< a full line of hex blob data
 #endif
 
+#ifndef FETCH_SPI_STREAM_CHUNK
+#define FETCH_SPI_STREAM_CHUNK      1024      //!< bytes per DMA buffer, two are used
+#endif
+
+#define MAX_SPI_WORDS   (MAX_SPI_BYTES / 2)
+
+#ifndef SPI_MAX_PROFILES
+#define SPI_MAX_PROFILES            8
+#endif
+
+#define SPI_PROFILE_NAME_LEN        12
+
+#define SPI_STREAM_TIMEOUT_MS       1000      //!< one chunk at the slowest clock is ~50ms
+
+#ifndef FETCH_SPI_SAMPLE_DEPTH
+#define FETCH_SPI_SAMPLE_DEPTH      1024      //!< power of two
+#endif
+
+#define FETCH_SPI_SAMPLE_BATCH      128       //!< samples per spi.samples line
+#define SPI_SAMPLE_MAX_BYTES        8
+#define SPI_SAMPLE_GPTD             GPTD12
+#define SPI_SAMPLE_GPT_FREQUENCY    1000000
+#define SPI_SAMPLE_MIN_PERIOD_US    10
+#define SPI_SAMPLE_MAX_PERIOD_US    65535     //!< 16 bit timer at 1MHz
+
+#ifndef FETCH_SPI_SNIFF_BYTES
+#define FETCH_SPI_SNIFF_BYTES       4096      //!< per data line, power of two, longest transaction - 1
+#endif
+
+#ifndef FETCH_SPI_SNIFF_DEPTH
+#define FETCH_SPI_SNIFF_DEPTH       256       //!< transactions, power of two
+#endif
+
+#define FETCH_SPI_SNIFF_BATCH       64        //!< transactions per spi.transactions
+#define SPI_SNIFF_AF                5         //!< SPI2 and SPI6 on their board pins
+#define SPI_SNIFF_DMA_PRIORITY      2
+
+#define SPI_BATCH_MAX_DEPTH         4
+#define SPI_BATCH_MAX_REPEAT        65536
+#define SPI_BATCH_MAX_DELAY_US      1000000
+#define SPI_BATCH_MAX_RX            (2 * FETCH_SPI_STREAM_CHUNK)   //!< received into the stream buffer
+#define SPI_STREAM_BUFFER(n)        (&spi_stream_buffer[(n) * FETCH_SPI_STREAM_CHUNK])
+#define SPI_BATCH_MAX_STEPS         65536     //!< operations executed, repeats included
+#define SPI_BATCH_MAX_TOTAL_US      5000000   //!< all delays executed, repeats included
+
 static SPIConfig  spi_configs[6] =  { {NULL, NULL, 0, 0},
                                       {NULL, NULL, 0, 0},
                                       {NULL, NULL, 0, 0},
@@ -31,6 +80,20 @@ static SPIConfig  spi_configs[6] =  { {NULL, NULL, 0, 0},
                                       {NULL, NULL, 0, 0},
                                       {NULL, NULL, 0, 0} };
 
+enum {
+  SPI_BATCH_SELECT = 0,
+  SPI_BATCH_UNSELECT,
+  SPI_BATCH_TX,
+  SPI_BATCH_RX,
+  SPI_BATCH_XFER,
+  SPI_BATCH_DELAY,
+  SPI_BATCH_REPEAT,
+  SPI_BATCH_END
+};
+
+//! same order as the SPI_BATCH_ operations
+static const char * spi_batch_op_tok[] = {"SELECT","UNSELECT","TX","RX","XFER","DELAY","REPEAT","END"};
+
 enum {
   SPI_CONFIG_DEV = 0,
   SPI_CONFIG_CPOL,
@@ -38,27 +101,179 @@ enum {
   SPI_CONFIG_CLK_DIV,
   SPI_CONFIG_MSB_LSB,
   SPI_CONFIG_CS_PORT,
-  SPI_CONFIG_CS_PIN
+  SPI_CONFIG_CS_PIN,
+  SPI_CONFIG_FRAME
 };
 
+/*! \brief a transaction that spans several commands with chip select held
+ *
+ *  Two DMA buffers alternate: one is on the wire while the other is filled
+ *  from a command (write) or encoded out to the host (read).
+ */
+typedef struct spi_stream
+{
+  SPIDriver     * drv;          //!< NULL when no stream is open
+  bool            busy;         //!< a DMA transfer was started and not waited for
+  uint32_t        next;         //!< buffer to use for the next transfer
+  uint32_t        tx_count;
+  uint32_t        rx_count;
+} spi_stream_t;
+
+/*! \brief a named device on one of the buses
+ *
+ *  Commands take the name in place of the bus number. The bus switches
+ *  to the profile on first use and stays there until another profile, the
+ *  bus number or config takes it.
+ */
+typedef struct spi_profile
+{
+  char            name[SPI_PROFILE_NAME_LEN];
+  SPIDriver     * drv;          //!< NULL for an unused entry
+  SPIConfig       config;
+} spi_profile_t;
+
+static spi_profile_t spi_profiles[SPI_MAX_PROFILES];
+
+/*! \brief one result of a timer triggered transaction
+ */
+typedef struct spi_sample
+{
+  uint32_t  tick;                           //!< timer periods since the stream started
+  uint8_t   data[SPI_SAMPLE_MAX_BYTES];
+} spi_sample_t;
+
+/*! \brief timer triggered transactions on one bus
+ *
+ *  The bus runs a copy of its config with the sampling callback, the
+ *  original is restored when the stream stops.
+ */
+typedef struct spi_sampler
+{
+  SPIDriver         * drv;                  //!< NULL when not streaming
+  const SPIConfig   * saved_config;
+  SPIConfig           config;
+  uint32_t            length;
+  uint32_t            period_us;
+  volatile uint32_t   tick;
+  uint32_t            active_tick;          //!< tick of the transaction on the wire
+  volatile uint32_t   overruns;             //!< ticks skipped, the last transaction was still running
+  uint8_t             tx[SPI_SAMPLE_MAX_BYTES];
+  uint8_t             rx[SPI_SAMPLE_MAX_BYTES];
+} spi_sampler_t;
+
+/*! \brief one transaction seen by the sniffer
+ */
+typedef struct spi_sniff_record
+{
+  uint32_t  time_us;      //!< chip select asserted, since the sniffer started
+  uint32_t  start;        //!< bytes received before this transaction
+  uint32_t  length;
+} spi_sniff_record_t;
+
+typedef struct spi_sniffer
+{
+  bool                          running;
+  ioportid_t                    cs_port;
+  uint32_t                      cs_pin;
+  const stm32_dma_stream_t    * dma[2];           //!< SPI2 rx (MOSI), SPI6 rx (MISO)
+  volatile bool                 selected;
+  uint32_t                      start_position;   //!< DMA position when chip select was asserted
+  uint32_t                      start_us;
+  volatile uint32_t             written;          //!< bytes in finished transactions
+  uint32_t                      lost;             //!< transactions overwritten before they were drained
+  util_timestamp_t              time;             //!< chip select edge time base
+} spi_sniffer_t;
+
+static spi_sniffer_t spi_sniff = { .running = false };
+static uint8_t spi_sniff_mosi[FETCH_SPI_SNIFF_BYTES];
+static uint8_t spi_sniff_miso[FETCH_SPI_SNIFF_BYTES];
+static spi_sniff_record_t spi_sniff_buffer[FETCH_SPI_SNIFF_DEPTH];
+static util_ring_t spi_sniff_ring;
+
+static spi_sampler_t spi_sample = { .drv = NULL, .length = 1, .period_us = 0 };
+static spi_sample_t spi_sample_buffer[FETCH_SPI_SAMPLE_DEPTH];
+static util_ring_t spi_sample_ring;
+
+static spi_stream_t spi_stream = { NULL, false, 0, 0, 0 };
+static uint8_t spi_stream_buffer[2 * FETCH_SPI_STREAM_CHUNK];     //!< two chunks, spi.batch uses it whole
+static uint8_t spi_stream_fill[FETCH_SPI_STREAM_CHUNK];
+static binary_semaphore_t spi_stream_sem;
+
 // list all command function prototypes here 
 static bool fetch_spi_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_profile_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_spi_exchange_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_exchange16_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_begin_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_write_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_read_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_end_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_batch_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_stream_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_samples_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_sniff_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_spi_transactions_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_spi_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 static bool fetch_spi_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
 
 
 static fetch_command_t fetch_spi_commands[] = {
     { fetch_spi_exchange_cmd,  "exchange",  "TX/RX bytes\n" \
-                                            "Usage: exchange(<dev>,<base>,<byte 0>,[...,<byte n>])" },
+                                            "Usage: exchange(<dev>,[<base>],<byte 0>,[...,<byte n>])\n" \
+                                            "\tbytes may also be hex blobs, x:DEADBEEF {base may be left out}" },
+    { fetch_spi_exchange16_cmd, "exchange16", "TX/RX 16 bit frames {device configured with 16 bit frames}\n" \
+                                            "Usage: exchange16(<dev>,[<base>],<word 0>,[...,<word n>])\n" \
+                                            "\twords may also be hex blobs, x:DEADBEEF {big endian, 4 digits per word}" },
+    { fetch_spi_begin_cmd,     "begin",     "Assert chip select and keep it for the following commands\n" \
+                                            "Usage: begin(<dev>)" },
+    { fetch_spi_write_cmd,     "write",     "Queue bytes in an open transaction, returns before they are sent\n" \
+                                            "Usage: write(<dev>,[<base>],<byte 0>,[...,<byte n>])\n" \
+                                            "\tbytes may also be hex blobs, x:DEADBEEF" },
+    { fetch_spi_read_cmd,      "read",      "Read any number of bytes, in an open transaction or as one on its own\n" \
+                                            "Usage: read(<dev>,<count>,[<fill>])\n" \
+                                            "\tfill = byte sent while reading {default 0xff}\n" \
+                                            "\tdata is returned as several rx lines" },
+    { fetch_spi_end_cmd,       "end",       "Finish an open transaction and release chip select\n" \
+                                            "Usage: end(<dev>)" },
+    { fetch_spi_batch_cmd,     "batch",     "Run a list of operations in one command\n" \
+                                            "Usage: batch(<dev>,<base>,<op>,[<args>],...)\n" \
+                                            "\tSELECT | UNSELECT {chip select}\n" \
+                                            "\tTX,<n>,<byte 0>,...,<byte n-1> | TX,x:<hex> {rx ignored}\n" \
+                                            "\tXFER,<n>,<byte 0>,...,<byte n-1> | XFER,x:<hex> {rx kept}\n" \
+                                            "\tRX,<n> {send 0xff, rx kept}\n" \
+                                            "\tDELAY,<microseconds>\n" \
+                                            "\tREPEAT,<count>,... END {up to 4 deep}\n" \
+                                            "\tall kept rx bytes are returned together, up to 2048\n" \
+                                            "\twith repeats expanded at most 65536 operations and 5s of delays" },
+    { fetch_spi_stream_cmd,    "stream",    "Run a transaction every period, results are kept for samples\n" \
+                                            "Usage: stream(<dev>,<period>,<length>,[<base>],[<byte 0>,...])\n" \
+                                            "\tperiod = 10 ... 65535 {microseconds}, 0 stops\n" \
+                                            "\tlength = 1 ... 8 {bytes exchanged, tx padded with 0xff}\n" \
+                                            "\tone device at a time, other commands refuse it while streaming" },
+    { fetch_spi_samples_cmd,   "samples",   "Return buffered stream results\n" \
+                                            "\ttime_us = <period * tick, saturated at 2^32 - 1>, rx = <length bytes per sample>" },
+    { fetch_spi_sniff_cmd,     "sniff",     "Capture an external bus, no arguments stops\n" \
+                                            "Usage: sniff(<cs port>,<cs pin>,<cpol>,<cpha>,[<order>])\n" \
+                                            "\tSCK to both SPI2 SCK and SPI6 SCK, MOSI to SPI2 MOSI, MISO to SPI6 MOSI\n" \
+                                            "\tSPI2 and SPI6 are stopped and unusable while sniffing\n" \
+                                            "\ttransactions up to 4095 bytes, see transactions" },
+    { fetch_spi_transactions_cmd, "transactions", "Return captured transactions\n" \
+                                            "\ttime_us = <chip select asserted>, mosi/miso = <bytes of all returned transactions>\n" \
+                                            "\tlost = <transactions overwritten before they were read>" },
     { fetch_spi_config_cmd,    "config",    "Configure SPI driver\n" \
-                                            "Usage: config(<dev>,<cpol>,<cpha>,<clk div>,<order>,[<ss port>, <ss pin>])\n" \
+                                            "Usage: config(<dev>,<cpol>,<cpha>,<clk div>,<order>,[<ss port>, <ss pin>],[<frame>])\n" \
                                             "\tcpol = 0 | 1\n" \
                                             "\tcpha = 0 | 1\n" \
                                             "\tclk div = 0 ... 7\n" \
                                             "\torder = 0 {MSB first} | 1 {LSB first}\n" \
                                             "\tss port = PORTA ... PORTI {optional}\n" \
-                                            "\tss pin = 0 ... 15 {required if port specified}\n" },
+                                            "\tss pin = 0 ... 15 {required if port specified}\n" \
+                                            "\tframe = 8 | 16 {bits, default 8, 16 bit devices use exchange16}\n" },
+    { fetch_spi_profile_cmd,   "profile",   "Name a device, the name can be used in place of <dev> except in config and reset\n" \
+                                            "Usage: profile(<name>,<dev>,<cpol>,<cpha>,<clk div>,<order>,[<ss port>, <ss pin>],[<frame>])\n" \
+                                            "\tname = a letter followed by up to 10 letters or digits\n" \
+                                            "\tother arguments as for config, profile(<name>) deletes it\n" \
+                                            "\tthe bus number selects the config settings again, refused if config was never run" },
     { fetch_spi_reset_cmd,     "reset",     "Reset SPI driver\n" \
                                             "Usage: reset(<dev>)" },
     { fetch_spi_help_cmd,      "help",      "SPI command help" },
@@ -95,27 +310,359 @@ static SPIDriver * parse_spi_dev( char * str, int32_t * dev )
   }
 }
 
-static bool fetch_spi_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+/*! \brief switch a bus to a profile or back to its spi.config settings
+ *
+ *  With the same frame size only CR1 is rewritten, chip select follows the
+ *  config pointer. The DMA mode depends on the frame size, so a change of
+ *  frame size restarts the driver.
+ *
+ *  \returns NULL if the bus is in an open transaction with another config
+ */
+static SPIDriver * spi_select_config( SPIDriver * spi_drv, SPIConfig * spi_cfg )
+{
+  if( spi_drv->state == SPI_READY && spi_drv->config == spi_cfg )
+  {
+    return spi_drv;
+  }
+
+  if( spi_stream.drv == spi_drv )
+  {
+    return NULL;
+  }
+
+  if( spi_drv->state == SPI_READY && ((spi_drv->config->cr1 ^ spi_cfg->cr1) & SPI_CR1_DFF) == 0 )
+  {
+    spi_drv->spi->CR1 &= ~SPI_CR1_SPE;
+    spi_drv->spi->CR1 = spi_cfg->cr1 | SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI;
+    spi_drv->spi->CR1 |= SPI_CR1_SPE;
+    spi_drv->config = spi_cfg;
+  }
+  else
+  {
+    spiStart(spi_drv, spi_cfg);
+  }
+
+  return spi_drv;
+}
+
+static spi_profile_t * spi_find_profile( char * str )
+{
+  for( uint32_t i = 0; i < SPI_MAX_PROFILES; i++ )
+  {
+    if( spi_profiles[i].drv != NULL && strcmp(spi_profiles[i].name, str) == 0 )
+    {
+      return &spi_profiles[i];
+    }
+  }
+
+  return NULL;
+}
+
+/*! \brief a bus number or a profile name, the bus is switched to its config
+ *
+ *  A bus number selects the spi.config settings again after a profile has
+ *  used the bus, a bus never set up by spi.config is refused then.
+ *  \returns NULL for an unknown name, a bus that is streaming or a profile
+ *           bus without a config of its own
+ */
+static SPIDriver * parse_spi_target( char * str )
 {
-  char * endptr;
-  int32_t spi_dev;
   SPIDriver * spi_drv;
-  SPIConfig * spi_cfg;
+  spi_profile_t * profile;
+  int32_t spi_dev;
 
-  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 7) )
+  if( str == NULL || spi_sniff.running )
   {
-    return false;
+    return NULL;
   }
 
-  if( (spi_drv = parse_spi_dev(data_list[0], &spi_dev)) == NULL )
+  if( (spi_drv = parse_spi_dev(str, &spi_dev)) != NULL )
   {
-    util_message_error(chp, "invalid device identifier");
+    if( spi_drv == spi_sample.drv )
+    {
+      return NULL;
+    }
+
+    // stopped, or still on its own config
+    if( spi_drv->state != SPI_READY || spi_drv->config == &spi_configs[spi_dev - 1] )
+    {
+      return spi_drv;
+    }
+
+    // spi_parse_config always sets the callback, a cleared entry was never configured
+    if( spi_configs[spi_dev - 1].end_cb == NULL )
+    {
+      return NULL;
+    }
+
+    return spi_select_config(spi_drv, &spi_configs[spi_dev - 1]);
+  }
+
+  if( (profile = spi_find_profile(str)) == NULL || profile->drv == spi_sample.drv )
+  {
+    return NULL;
+  }
+
+  return spi_select_config(profile->drv, &profile->config);
+}
+
+/*! \brief true if the device was configured for 16 bit frames
+ *
+ *  The driver then moves half words by DMA and counts frames, not bytes.
+ */
+static bool spi_frame16( SPIDriver * spi_drv )
+{
+  return (spi_drv->config->cr1 & SPI_CR1_DFF) != 0;
+}
+
+/*! \brief DMA completion, wakes up spi_stream_wait()
+ *  \note also called after blocking exchanges, the semaphore is reset before
+ *        every streamed transfer
+ */
+static void spi_stream_end_cb(SPIDriver * spip)
+{
+  (void)spip;
+
+  chSysLockFromISR();
+  chBSemSignalI(&spi_stream_sem);
+  chSysUnlockFromISR();
+}
+
+static void spi_stream_start(SPIDriver * spi_drv, size_t n, const uint8_t * txbuf, uint8_t * rxbuf)
+{
+  chBSemReset(&spi_stream_sem, true);
+  spi_stream.busy = true;
+
+  if( rxbuf == NULL )
+  {
+    spiStartSend(spi_drv, n, txbuf);
+  }
+  else
+  {
+    spiStartExchange(spi_drv, n, txbuf, rxbuf);
+  }
+}
+
+/*! \brief wait for the transfer started by spi_stream_start()
+ *  \returns false if it did not complete, the driver is stopped then
+ */
+static bool spi_stream_wait(SPIDriver * spi_drv)
+{
+  if( !spi_stream.busy )
+  {
+    return true;
+  }
+
+  spi_stream.busy = false;
+
+  if( chBSemWaitTimeout(&spi_stream_sem, MS2ST(SPI_STREAM_TIMEOUT_MS)) == MSG_TIMEOUT )
+  {
+    spiStop(spi_drv);
     return false;
   }
+  return true;
+}
+
+/*! \brief wait for the last transfer and release chip select
+ */
+static bool spi_stream_close(void)
+{
+  SPIDriver * spi_drv = spi_stream.drv;
+  bool ok;
+
+  if( spi_drv == NULL )
+  {
+    return true;
+  }
+
+  ok = spi_stream_wait(spi_drv);
+
+  if( spi_drv->config->ssport != NULL )
+  {
+    palSetPad(spi_drv->config->ssport, spi_drv->config->sspad);
+  }
+
+  spi_stream.drv = NULL;
+  return ok;
+}
+
+/*! \brief timer tick, start the fixed transaction if the last one is done
+ */
+static void spi_sample_gpt_cb(GPTDriver * gptp)
+{
+  SPIDriver * spi_drv = spi_sample.drv;
+
+  (void)gptp;
+
+  chSysLockFromISR();
+  if( spi_drv->state == SPI_READY )
+  {
+    spi_sample.active_tick = spi_sample.tick;
+    if( spi_drv->config->ssport != NULL )
+    {
+      spiSelectI(spi_drv);
+    }
+    spiStartExchangeI(spi_drv, spi_sample.length, spi_sample.tx, spi_sample.rx);
+  }
+  else
+  {
+    spi_sample.overruns++;
+  }
+  chSysUnlockFromISR();
+
+  spi_sample.tick++;
+}
+
+/*! \brief transaction done, release chip select and queue the received bytes
+ */
+static void spi_sample_end_cb(SPIDriver * spip)
+{
+  spi_sample_t sample;
+
+  chSysLockFromISR();
+  if( spip->config->ssport != NULL )
+  {
+    spiUnselectI(spip);
+  }
+  chSysUnlockFromISR();
+
+  sample.tick = spi_sample.active_tick;
+  memcpy(sample.data, spi_sample.rx, SPI_SAMPLE_MAX_BYTES);
+  util_ring_put(&spi_sample_ring, &sample);
+}
+
+/*! \brief stop the timer and give the bus its own config back
+ */
+static void spi_sample_stop(void)
+{
+  SPIDriver * spi_drv = spi_sample.drv;
+  systime_t start;
+
+  if( spi_drv == NULL )
+  {
+    return;
+  }
+
+  gptStopTimer(&SPI_SAMPLE_GPTD);
+  gptStop(&SPI_SAMPLE_GPTD);
+
+  // let the last transaction finish
+  start = chVTGetSystemTime();
+  while( spi_drv->state != SPI_READY && chVTTimeElapsedSinceX(start) < MS2ST(SPI_STREAM_TIMEOUT_MS) )
+  {
+    chThdSleep(1);
+  }
+
+  if( spi_drv->state == SPI_READY )
+  {
+    spiStart(spi_drv, spi_sample.saved_config);
+  }
+  else
+  {
+    spiStop(spi_drv);
+  }
+
+  spi_sample.drv = NULL;
+}
+
+/*! \brief write position of the receive DMA, both streams move together
+ */
+static uint32_t spi_sniff_position(void)
+{
+  return (FETCH_SPI_SNIFF_BYTES - dmaStreamGetTransactionSize(spi_sniff.dma[0])) & (FETCH_SPI_SNIFF_BYTES - 1);
+}
+
+/*! \brief chip select edge, frame one transaction
+ *
+ *  The slaves only shift while SSI is clear, so bytes clocked while chip
+ *  select is high never reach the buffers and every buffered byte belongs
+ *  to a transaction.
+ */
+static void spi_sniff_cs_cb(EXTDriver * extp, expchannel_t channel)
+{
+  spi_sniff_record_t record;
+
+  (void)extp;
+
+  if( palReadPad(spi_sniff.cs_port, channel) == PAL_LOW )
+  {
+    SPI2->CR1 &= ~SPI_CR1_SSI;
+    SPI6->CR1 &= ~SPI_CR1_SSI;
+    spi_sniff.selected = true;
+    spi_sniff.start_position = spi_sniff_position();
+    spi_sniff.start_us = util_timestamp_update(&spi_sniff.time);
+  }
+  else if( spi_sniff.selected )
+  {
+    SPI2->CR1 |= SPI_CR1_SSI;
+    SPI6->CR1 |= SPI_CR1_SSI;
+    spi_sniff.selected = false;
+
+    record.time_us = spi_sniff.start_us;
+    record.start = spi_sniff.written;
+    record.length = (spi_sniff_position() - spi_sniff.start_position) & (FETCH_SPI_SNIFF_BYTES - 1);
+    spi_sniff.written += record.length;
+
+    util_ring_put(&spi_sniff_ring, &record);
+  }
+}
+
+/*! \brief bytes received since the sniffer started, including an unfinished transaction
+ */
+static uint32_t spi_sniff_received(void)
+{
+  uint32_t received;
+
+  chSysLock();
+  received = spi_sniff.written;
+  if( spi_sniff.selected )
+  {
+    received += (spi_sniff_position() - spi_sniff.start_position) & (FETCH_SPI_SNIFF_BYTES - 1);
+  }
+  chSysUnlock();
 
-  spi_cfg = &spi_configs[spi_dev-1];
+  return received;
+}
+
+/*! \brief release the EXTI line, DMA streams and both SPI blocks
+ */
+static void spi_sniff_stop(void)
+{
+  if( !spi_sniff.running )
+  {
+    return;
+  }
+
+  fetch_gpio_ext_release(spi_sniff.cs_pin);
+
+  for( uint32_t i = 0; i < 2; i++ )
+  {
+    dmaStreamDisable(spi_sniff.dma[i]);
+    dmaStreamRelease(spi_sniff.dma[i]);
+  }
+
+  SPI2->CR1 = 0;
+  SPI2->CR2 = 0;
+  SPI6->CR1 = 0;
+  SPI6->CR2 = 0;
+  rccDisableSPI2(FALSE);
+  rccDisableSPI6(FALSE);
+
+  // the external bus may still be connected, leave the SPI6 pins undriven
+  palSetPadMode(GPIOG, GPIOG_SPI6_SCK, PAL_MODE_INPUT);
+  palSetPadMode(GPIOG, GPIOG_SPI6_MOSI, PAL_MODE_INPUT);
+
+  spi_sniff.running = false;
+}
+
+/*! \brief parse the config arguments, data_list[0] is the device
+ *  \returns false after reporting the error, spi_cfg is then only partly filled in
+ */
+static bool spi_parse_config(BaseSequentialStream * chp, char * data_list[], SPIConfig * spi_cfg)
+{
+  char * endptr;
 
-  spi_cfg->end_cb = NULL;
+  spi_cfg->end_cb = spi_stream_end_cb;
   spi_cfg->ssport = NULL;
   spi_cfg->sspad = 0;
   spi_cfg->cr1 = 0;
@@ -182,7 +729,40 @@ static bool fetch_spi_config_cmd(BaseSequentialStream * chp, char * cmd_list[],
       break;
   }
 
-  if( data_list[SPI_CONFIG_CS_PORT] != NULL )
+  // the frame size is the last argument, with or without a chip select
+  uint32_t arg_count = 0;
+  uint32_t frame_arg = 0;
+
+  while( arg_count < 8 && data_list[arg_count] != NULL )
+  {
+    arg_count++;
+  }
+
+  if( arg_count == SPI_CONFIG_CS_PORT + 1 )
+  {
+    frame_arg = SPI_CONFIG_CS_PORT;
+  }
+  else if( arg_count == SPI_CONFIG_FRAME + 1 )
+  {
+    frame_arg = SPI_CONFIG_FRAME;
+  }
+
+  if( frame_arg != 0 )
+  {
+    int32_t spi_frame = strtol(data_list[frame_arg], &endptr, 0);
+
+    if( *endptr != '\0' || (spi_frame != 8 && spi_frame != 16) )
+    {
+      util_message_error(chp, "invalid frame size");
+      return false;
+    }
+    else if( spi_frame == 16 )
+    {
+      spi_cfg->cr1 |= SPI_CR1_DFF;
+    }
+  }
+
+  if( frame_arg != SPI_CONFIG_CS_PORT && data_list[SPI_CONFIG_CS_PORT] != NULL )
   {
     spi_cfg->ssport = string_to_port(data_list[SPI_CONFIG_CS_PORT]);
     spi_cfg->sspad  = string_to_pin(data_list[SPI_CONFIG_CS_PIN]);
@@ -194,86 +774,1390 @@ static bool fetch_spi_config_cmd(BaseSequentialStream * chp, char * cmd_list[],
     }
   }
 
-  // apply configuration
-  spiStart(spi_drv, spi_cfg);
-
   return true;
 }
 
-static bool fetch_spi_exchange_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+static bool fetch_spi_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
 {
-  static uint8_t tx_buffer[MAX_SPI_BYTES];
-  static uint8_t rx_buffer[MAX_SPI_BYTES];
-  uint32_t byte_count = 0;
-  int number_base = 0;
-  char * endptr;
-  int byte_value;
   int32_t spi_dev;
   SPIDriver * spi_drv;
-  SPIConfig * spi_cfg;
+  SPIConfig spi_cfg;
 
-  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, MAX_SPI_BYTES + 1) )
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 8) )
   {
     return false;
   }
-  
+
   if( (spi_drv = parse_spi_dev(data_list[0], &spi_dev)) == NULL )
   {
     util_message_error(chp, "invalid device identifier");
     return false;
   }
 
-  spi_cfg = &spi_configs[spi_dev-1];
-
-  if( spi_drv->state != SPI_READY )
+  if( spi_stream.drv == spi_drv )
   {
-    util_message_error(chp, "SPI not ready");
+    util_message_error(chp, "transaction open, use end first");
     return false;
   }
 
-  number_base = strtol(data_list[1], &endptr, 0);
-
-  if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+  if( spi_sample.drv == spi_drv )
   {
-    util_message_error(chp, "invalid number base");
+    util_message_error(chp, "streaming, stop with stream(<dev>,0) first");
     return false;
   }
 
-  for( int i = 0; i < MAX_SPI_BYTES && data_list[i+2] != NULL; i++ )
+  if( spi_sniff.running )
   {
-    byte_value = strtol(data_list[i+2], &endptr, number_base);
-    
-    if( *endptr != '\0' )
-    {
-      util_message_error(chp, "invalid data argument");
-      return false;
-    }
-    else if( byte_value < 0 || byte_value > 0xff )
-    {
-      util_message_error(chp, "invalid data byte");
-      return false;
-    }
-    else
-    {
-      tx_buffer[i] = byte_value;
-      byte_count++;
-    }
+    util_message_error(chp, "sniffing, stop with sniff() first");
+    return false;
   }
 
-  if( spi_cfg->ssport != NULL )
+  if( !spi_parse_config(chp, data_list, &spi_cfg) )
+  {
+    return false;
+  }
+
+  // apply configuration
+  spi_configs[spi_dev-1] = spi_cfg;
+  spiStart(spi_drv, &spi_configs[spi_dev-1]);
+
+  return true;
+}
+
+/*! \brief a letter followed by letters or digits, short enough for the table
+ */
+static bool spi_profile_name_valid(const char * name)
+{
+  if( name == NULL || strlen(name) >= SPI_PROFILE_NAME_LEN || !isalpha((unsigned char)name[0]) )
+  {
+    return false;
+  }
+
+  for( const char * c = name; *c != '\0'; c++ )
+  {
+    if( !isalnum((unsigned char)*c) )
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*! \brief define, replace or delete a named device profile
+ */
+static bool fetch_spi_profile_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  spi_profile_t * profile = NULL;
+  spi_profile_t * unused = NULL;
+  int32_t spi_dev;
+  SPIDriver * spi_drv;
+  SPIConfig spi_cfg;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 9) )
+  {
+    return false;
+  }
+
+  if( !spi_profile_name_valid(data_list[0]) )
+  {
+    util_message_error(chp, "invalid name, a letter then up to %u letters or digits", SPI_PROFILE_NAME_LEN - 2);
+    return false;
+  }
+
+  for( uint32_t i = 0; i < SPI_MAX_PROFILES; i++ )
+  {
+    if( spi_profiles[i].drv == NULL )
+    {
+      unused = (unused == NULL) ? &spi_profiles[i] : unused;
+    }
+    else if( strcmp(spi_profiles[i].name, data_list[0]) == 0 )
+    {
+      profile = &spi_profiles[i];
+    }
+  }
+
+  // every argument is checked before the bus is touched
+  if( data_list[1] == NULL )
+  {
+    // only a name deletes the profile
+    if( profile == NULL )
+    {
+      util_message_error(chp, "unknown profile");
+      return false;
+    }
+  }
+  else
+  {
+    if( (spi_drv = parse_spi_dev(data_list[1], &spi_dev)) == NULL )
+    {
+      util_message_error(chp, "invalid device identifier");
+      return false;
+    }
+
+    if( !spi_parse_config(chp, &data_list[1], &spi_cfg) )
+    {
+      return false;
+    }
+
+    if( profile == NULL && unused == NULL )
+    {
+      util_message_error(chp, "no free profile, up to %u", SPI_MAX_PROFILES);
+      return false;
+    }
+  }
+
+  if( profile != NULL && profile->drv == spi_sample.drv )
+  {
+    util_message_error(chp, "streaming, stop with stream(<dev>,0) first");
+    return false;
+  }
+
+  if( profile != NULL && profile->drv->config == &profile->config && profile->drv->state == SPI_READY )
+  {
+    if( spi_stream.drv == profile->drv )
+    {
+      util_message_error(chp, "transaction open, use end first");
+      return false;
+    }
+
+    // the driver must not keep a config that is about to change
+    spiStop(profile->drv);
+  }
+
+  if( data_list[1] == NULL )
+  {
+    profile->drv = NULL;
+    return true;
+  }
+
+  if( profile == NULL )
+  {
+    profile = unused;
+    strcpy(profile->name, data_list[0]);
+  }
+
+  profile->drv = spi_drv;
+  profile->config = spi_cfg;
+
+  return true;
+}
+
+static bool fetch_spi_exchange_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint8_t tx_buffer[MAX_SPI_BYTES];
+  static uint8_t rx_buffer[MAX_SPI_BYTES];
+  uint32_t byte_count = 0;
+  int number_base = 16;
+  uint32_t data_start = 1;
+  char * endptr;
+  SPIDriver * spi_drv;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, MAX_SPI_BYTES + 1) )
+  {
+    return false;
+  }
+  
+  if( (spi_drv = parse_spi_target(data_list[0])) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return false;
+  }
+
+  if( spi_drv->state != SPI_READY )
+  {
+    util_message_error(chp, "SPI not ready");
+    return false;
+  }
+
+  if( spi_frame16(spi_drv) )
+  {
+    util_message_error(chp, "16 bit frames configured, use exchange16");
+    return false;
+  }
+
+  if( spi_stream.drv == spi_drv )
+  {
+    util_message_error(chp, "transaction open, use write/read or end");
+    return false;
+  }
+
+  // the base may be left out when the data is a hex blob
+  if( !fetch_is_hex_blob(data_list[1]) )
+  {
+    number_base = strtol(data_list[1], &endptr, 0);
+
+    if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+    {
+      util_message_error(chp, "invalid number base");
+      return false;
+    }
+    data_start = 2;
+  }
+
+  if( !fetch_parse_bytes(chp, &data_list[data_start], number_base, tx_buffer, MAX_SPI_BYTES, &byte_count) )
+  {
+    return false;
+  }
+
+  if( spi_drv->config->ssport != NULL )
+  {
+    spiSelect(spi_drv);
+  }
+
+  spiExchange(spi_drv, byte_count, tx_buffer, rx_buffer);
+
+  if( spi_drv->config->ssport != NULL )
+  {
+    spiUnselect(spi_drv);
+  }
+
+  util_message_uint32(chp, "count", &byte_count, 1);
+  util_message_hex_uint8( chp, "rx", rx_buffer, byte_count);
+
+  return true;
+}
+
+/*! \brief exchange with a device configured for 16 bit frames
+ *
+ *  Every word is one frame, moved by DMA as a half word, so nothing is
+ *  swapped or split into bytes on either side.
+ */
+static bool fetch_spi_exchange16_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint16_t tx_buffer[MAX_SPI_WORDS];
+  static uint16_t rx_buffer[MAX_SPI_WORDS];
+  uint8_t * blob = (uint8_t *)rx_buffer;
+  uint32_t word_count = 0;
+  int number_base = 16;
+  uint32_t data_start = 1;
+  int32_t value;
+  char * endptr;
+  SPIDriver * spi_drv;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, MAX_SPI_WORDS + 2) )
+  {
+    return false;
+  }
+
+  if( (spi_drv = parse_spi_target(data_list[0])) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return false;
+  }
+
+  if( spi_drv->state != SPI_READY )
+  {
+    util_message_error(chp, "SPI not ready");
+    return false;
+  }
+
+  if( !spi_frame16(spi_drv) )
+  {
+    util_message_error(chp, "8 bit frames configured, use exchange");
+    return false;
+  }
+
+  if( spi_stream.drv == spi_drv )
+  {
+    util_message_error(chp, "transaction open, use end first");
+    return false;
+  }
+
+  if( !fetch_is_hex_blob(data_list[1]) )
+  {
+    number_base = strtol(data_list[1], &endptr, 0);
+
+    if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+    {
+      util_message_error(chp, "invalid number base");
+      return false;
+    }
+    data_start = 2;
+  }
+
+  for( uint32_t i = data_start; data_list[i] != NULL; i++ )
+  {
+    if( fetch_is_hex_blob(data_list[i]) )
+    {
+      // decoded into the rx buffer, it is not needed until the exchange
+      value = hex_decode(&data_list[i][2], blob, (MAX_SPI_WORDS - word_count) * 2);
+
+      if( value < 0 || (value & 1) != 0 )
+      {
+        util_message_error(chp, "invalid hex data, 4 digits per word");
+        return false;
+      }
+
+      for( int32_t n = 0; n < value; n += 2 )
+      {
+        tx_buffer[word_count++] = (blob[n] << 8) | blob[n + 1];
+      }
+      continue;
+    }
+
+    if( word_count >= MAX_SPI_WORDS )
+    {
+      util_message_error(chp, "more than %u words", MAX_SPI_WORDS);
+      return false;
+    }
+
+    value = strtol(data_list[i], &endptr, number_base);
+
+    if( *endptr != '\0' || value < 0 || value > 0xffff )
+    {
+      util_message_error(chp, "invalid data word");
+      return false;
+    }
+
+    tx_buffer[word_count++] = value;
+  }
+
+  if( spi_drv->config->ssport != NULL )
+  {
+    spiSelect(spi_drv);
+  }
+
+  spiExchange(spi_drv, word_count, tx_buffer, rx_buffer);
+
+  if( spi_drv->config->ssport != NULL )
+  {
+    spiUnselect(spi_drv);
+  }
+
+  util_message_uint32(chp, "count", &word_count, 1);
+  util_message_hex_uint16(chp, "rx", rx_buffer, word_count);
+
+  return true;
+}
+
+static bool fetch_spi_begin_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  if( (spi_drv = parse_spi_target(data_list[0])) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return false;
+  }
+
+  if( spi_drv->state != SPI_READY )
+  {
+    util_message_error(chp, "SPI not ready");
+    return false;
+  }
+
+  if( spi_frame16(spi_drv) )
+  {
+    util_message_error(chp, "16 bit frames configured, use exchange16");
+    return false;
+  }
+
+  if( spi_stream.drv != NULL )
+  {
+    util_message_error(chp, "a transaction is already open");
+    return false;
+  }
+
+  spi_stream.drv = spi_drv;
+  spi_stream.busy = false;
+  spi_stream.next = 0;
+  spi_stream.tx_count = 0;
+  spi_stream.rx_count = 0;
+
+  if( spi_drv->config->ssport != NULL )
   {
     spiSelect(spi_drv);
   }
 
-  spiExchange(spi_drv, byte_count, tx_buffer, rx_buffer);
+  return true;
+}
+
+/*! \brief send one command worth of bytes without waiting for them
+ *
+ *  The previous write is waited for first, so its DMA transfer overlaps the
+ *  reception and parsing of this command.
+ */
+static bool fetch_spi_write_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  uint8_t * buffer;
+  uint32_t byte_count = 0;
+  int number_base = 16;
+  uint32_t data_start = 1;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, MAX_SPI_BYTES + 1) )
+  {
+    return false;
+  }
+
+  if( (spi_drv = parse_spi_target(data_list[0])) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return false;
+  }
+
+  if( spi_stream.drv != spi_drv )
+  {
+    util_message_error(chp, "no open transaction, use begin first");
+    return false;
+  }
+
+  if( !fetch_is_hex_blob(data_list[1]) )
+  {
+    number_base = strtol(data_list[1], &endptr, 0);
+
+    if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+    {
+      util_message_error(chp, "invalid number base");
+      return false;
+    }
+    data_start = 2;
+  }
+
+  // the other buffer may still be on the wire
+  buffer = SPI_STREAM_BUFFER(spi_stream.next);
+
+  if( !fetch_parse_bytes(chp, &data_list[data_start], number_base, buffer, FETCH_SPI_STREAM_CHUNK, &byte_count) )
+  {
+    return false;
+  }
+
+  if( !spi_stream_wait(spi_drv) )
+  {
+    spi_stream_close();
+    util_message_error(chp, "SPI transfer timed out");
+    return false;
+  }
+
+  if( byte_count > 0 )
+  {
+    spi_stream_start(spi_drv, byte_count, buffer, NULL);
+    spi_stream.next ^= 1;
+    spi_stream.tx_count += byte_count;
+  }
+
+  util_message_uint32(chp, "count", &byte_count, 1);
+
+  return true;
+}
+
+/*! \brief read count bytes, encoding one buffer while DMA fills the other
+ */
+static bool fetch_spi_read_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  char * endptr;
+  uint32_t remaining;
+  uint32_t pending;
+  uint32_t current;
+  int32_t fill = 0xff;
+  bool own_transaction = false;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 3) )
+  {
+    return false;
+  }
+
+  if( (spi_drv = parse_spi_target(data_list[0])) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return false;
+  }
+
+  if( data_list[1] == NULL )
+  {
+    util_message_error(chp, "missing count");
+    return false;
+  }
+
+  uint32_t count = strtoul(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || count == 0 )
+  {
+    util_message_error(chp, "invalid count");
+    return false;
+  }
+
+  if( data_list[2] != NULL )
+  {
+    fill = strtol(data_list[2], &endptr, 0);
+
+    if( *endptr != '\0' || fill < 0 || fill > 0xff )
+    {
+      util_message_error(chp, "invalid fill byte");
+      return false;
+    }
+  }
+
+  if( spi_stream.drv == NULL )
+  {
+    if( spi_drv->state != SPI_READY )
+    {
+      util_message_error(chp, "SPI not ready");
+      return false;
+    }
+
+    if( spi_frame16(spi_drv) )
+    {
+      util_message_error(chp, "16 bit frames configured, use exchange16");
+      return false;
+    }
+
+    own_transaction = true;
+    spi_stream.drv = spi_drv;
+    spi_stream.busy = false;
+    spi_stream.tx_count = 0;
+    spi_stream.rx_count = 0;
+
+    if( spi_drv->config->ssport != NULL )
+    {
+      spiSelect(spi_drv);
+    }
+  }
+  else if( spi_stream.drv != spi_drv )
+  {
+    util_message_error(chp, "another device has an open transaction");
+    return false;
+  }
+
+  // queued writes must be on the wire before the read starts
+  if( !spi_stream_wait(spi_drv) )
+  {
+    spi_stream_close();
+    util_message_error(chp, "SPI transfer timed out");
+    return false;
+  }
+
+  memset(spi_stream_fill, fill, sizeof(spi_stream_fill));
+
+  remaining = count;
+  current = 0;
+  pending = (remaining < FETCH_SPI_STREAM_CHUNK) ? remaining : FETCH_SPI_STREAM_CHUNK;
+  spi_stream_start(spi_drv, pending, spi_stream_fill, SPI_STREAM_BUFFER(current));
+  remaining -= pending;
+
+  while( pending > 0 )
+  {
+    uint32_t done = pending;
+
+    if( !spi_stream_wait(spi_drv) )
+    {
+      spi_stream_close();
+      util_message_error(chp, "SPI transfer timed out");
+      return false;
+    }
+
+    pending = 0;
+    if( remaining > 0 )
+    {
+      pending = (remaining < FETCH_SPI_STREAM_CHUNK) ? remaining : FETCH_SPI_STREAM_CHUNK;
+      spi_stream_start(spi_drv, pending, spi_stream_fill, SPI_STREAM_BUFFER(current ^ 1));
+      remaining -= pending;
+    }
+
+    util_message_hex_uint8(chp, "rx", SPI_STREAM_BUFFER(current), done);
+    spi_stream.rx_count += done;
+    current ^= 1;
+  }
+
+  if( own_transaction )
+  {
+    spi_stream_close();
+  }
+
+  util_message_uint32(chp, "count", &count, 1);
+
+  return true;
+}
+
+static bool fetch_spi_end_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  uint32_t tx_count, rx_count;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 1) )
+  {
+    return false;
+  }
+
+  if( (spi_drv = parse_spi_target(data_list[0])) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return false;
+  }
+
+  if( spi_stream.drv != spi_drv )
+  {
+    util_message_error(chp, "no open transaction");
+    return false;
+  }
+
+  tx_count = spi_stream.tx_count;
+  rx_count = spi_stream.rx_count;
+
+  if( !spi_stream_close() )
+  {
+    util_message_error(chp, "SPI transfer timed out");
+    return false;
+  }
+
+  util_message_uint32(chp, "tx_count", &tx_count, 1);
+  util_message_uint32(chp, "rx_count", &rx_count, 1);
+
+  return true;
+}
+
+/*! \brief interpret a spi.batch script
+ *
+ *  Run once with spi_drv NULL to check the whole script and count the
+ *  received bytes, then again on the bus, so a bad argument never leaves a
+ *  half finished transaction behind. The check reads the script once and
+ *  multiplies each REPEAT body by its count instead of looping, so the
+ *  totals it limits cost the same to find for any repeat count.
+ *
+ *  \param[in] ssport   chip select port of the device, NULL if none
+ *  \returns false and sets *error on a bad script
+ */
+static bool spi_batch_run(SPIDriver * spi_drv, ioportid_t ssport, char * data_list[], int number_base,
+                          uint8_t * rx_buffer, uint32_t * rx_count, const char ** error)
+{
+  static uint8_t tx_buffer[MAX_SPI_BYTES];
+  uint32_t loop_start[SPI_BATCH_MAX_DEPTH];
+  uint32_t loop_remaining[SPI_BATCH_MAX_DEPTH];
+  // per nesting level while checking, totals of the body so far
+  uint64_t level_rx[SPI_BATCH_MAX_DEPTH + 1] = {0};
+  uint64_t level_steps[SPI_BATCH_MAX_DEPTH + 1] = {0};
+  uint64_t level_us[SPI_BATCH_MAX_DEPTH + 1] = {0};
+  uint32_t depth = 0;
+  uint32_t i = 0;
+  bool selected = false;
+  char * endptr;
+
+  *rx_count = 0;
+
+  while( data_list[i] != NULL )
+  {
+    int32_t op = token_match(data_list[i++], FETCH_MAX_DATA_STRLEN, spi_batch_op_tok, NELEMS(spi_batch_op_tok));
+    int32_t value = 0;
+    bool blob = false;
+
+    if( spi_drv == NULL && ++level_steps[depth] > SPI_BATCH_MAX_STEPS )
+    {
+      *error = "too many operations";
+      return false;
+    }
+
+    // TX and XFER also take their bytes as one hex blob in place of the count
+    if( (op == SPI_BATCH_TX || op == SPI_BATCH_XFER) && fetch_is_hex_blob(data_list[i]) )
+    {
+      value = hex_decode(&data_list[i++][2], tx_buffer, MAX_SPI_BYTES);
+      blob = true;
+
+      if( value <= 0 )
+      {
+        *error = "invalid hex data";
+        return false;
+      }
+    }
+    // every operation except SELECT, UNSELECT and END takes a number
+    else if( op == SPI_BATCH_TX || op == SPI_BATCH_RX || op == SPI_BATCH_XFER || op == SPI_BATCH_DELAY || op == SPI_BATCH_REPEAT )
+    {
+      if( data_list[i] == NULL )
+      {
+        *error = "missing count";
+        return false;
+      }
+
+      value = strtol(data_list[i++], &endptr, 0);
+
+      if( *endptr != '\0' || value < 0 )
+      {
+        *error = "invalid count";
+        return false;
+      }
+    }
+
+    switch( op )
+    {
+      case SPI_BATCH_SELECT:
+      case SPI_BATCH_UNSELECT:
+        if( ssport == NULL )
+        {
+          *error = "no chip select configured";
+          return false;
+        }
+        selected = (op == SPI_BATCH_SELECT);
+        if( spi_drv != NULL )
+        {
+          if( selected )
+          {
+            spiSelect(spi_drv);
+          }
+          else
+          {
+            spiUnselect(spi_drv);
+          }
+        }
+        break;
+
+      case SPI_BATCH_TX:
+      case SPI_BATCH_XFER:
+        if( value == 0 || value > MAX_SPI_BYTES )
+        {
+          *error = "invalid byte count";
+          return false;
+        }
+
+        for( int32_t n = 0; !blob && n < value; n++ )
+        {
+          int byte_value = (data_list[i] == NULL) ? -1 : strtol(data_list[i], &endptr, number_base);
+
+          if( data_list[i] == NULL || *endptr != '\0' || byte_value < 0 || byte_value > 0xff )
+          {
+            *error = "invalid data byte";
+            return false;
+          }
+          tx_buffer[n] = byte_value;
+          i++;
+        }
+
+        if( op == SPI_BATCH_XFER )
+        {
+          if( spi_drv == NULL )
+          {
+            if( (level_rx[depth] += value) > SPI_BATCH_MAX_RX )
+            {
+              *error = "too many rx bytes";
+              return false;
+            }
+          }
+          else
+          {
+            spiExchange(spi_drv, value, tx_buffer, &rx_buffer[*rx_count]);
+            *rx_count += value;
+          }
+        }
+        else if( spi_drv != NULL )
+        {
+          spiSend(spi_drv, value, tx_buffer);
+        }
+        break;
+
+      case SPI_BATCH_RX:
+        if( spi_drv == NULL )
+        {
+          if( value == 0 || (level_rx[depth] += value) > SPI_BATCH_MAX_RX )
+          {
+            *error = "too many rx bytes";
+            return false;
+          }
+        }
+        else
+        {
+          spiReceive(spi_drv, value, &rx_buffer[*rx_count]);
+          *rx_count += value;
+        }
+        break;
+
+      case SPI_BATCH_DELAY:
+        if( value > SPI_BATCH_MAX_DELAY_US )
+        {
+          *error = "delay too long";
+          return false;
+        }
+        if( spi_drv == NULL && (level_us[depth] += value) > SPI_BATCH_MAX_TOTAL_US )
+        {
+          *error = "delays too long in total";
+          return false;
+        }
+        if( spi_drv != NULL && value > 0 )
+        {
+          // short delays are polled, the tick is too coarse for them
+          if( value < 1000 )
+          {
+            chSysPolledDelayX(US2RTC(STM32_HCLK, value));
+          }
+          else
+          {
+            chThdSleepMicroseconds(value);
+          }
+        }
+        break;
+
+      case SPI_BATCH_REPEAT:
+        if( depth == SPI_BATCH_MAX_DEPTH )
+        {
+          *error = "REPEAT nested too deep";
+          return false;
+        }
+        if( value == 0 || value > SPI_BATCH_MAX_REPEAT )
+        {
+          *error = "invalid repeat count";
+          return false;
+        }
+        loop_start[depth] = i;
+        loop_remaining[depth] = value;
+        depth++;
+        level_rx[depth] = 0;
+        level_steps[depth] = 0;
+        level_us[depth] = 0;
+        break;
+
+      case SPI_BATCH_END:
+        if( depth == 0 )
+        {
+          *error = "END without REPEAT";
+          return false;
+        }
+        if( spi_drv == NULL )
+        {
+          // each level stays within the limits, so the product fits 64 bits
+          depth--;
+          level_rx[depth] += level_rx[depth + 1] * loop_remaining[depth];
+          level_steps[depth] += level_steps[depth + 1] * loop_remaining[depth];
+          level_us[depth] += level_us[depth + 1] * loop_remaining[depth];
+
+          if( level_rx[depth] > SPI_BATCH_MAX_RX )
+          {
+            *error = "too many rx bytes";
+            return false;
+          }
+          if( level_steps[depth] > SPI_BATCH_MAX_STEPS )
+          {
+            *error = "too many operations";
+            return false;
+          }
+          if( level_us[depth] > SPI_BATCH_MAX_TOTAL_US )
+          {
+            *error = "delays too long in total";
+            return false;
+          }
+        }
+        else if( --loop_remaining[depth - 1] > 0 )
+        {
+          i = loop_start[depth - 1];
+        }
+        else
+        {
+          depth--;
+        }
+        break;
+
+      default:
+        *error = "unknown operation";
+        return false;
+    }
+  }
+
+  if( depth != 0 )
+  {
+    *error = "REPEAT without END";
+    return false;
+  }
+
+  if( spi_drv == NULL )
+  {
+    *rx_count = level_rx[0];
+  }
+
+  // never leave the device selected after the command
+  if( selected && spi_drv != NULL )
+  {
+    spiUnselect(spi_drv);
+  }
+
+  return true;
+}
+
+static bool fetch_spi_batch_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  SPIDriver * spi_drv;
+  uint8_t * rx_buffer = spi_stream_buffer;
+  uint32_t rx_count;
+  const char * error = NULL;
+  int number_base;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, FETCH_MAX_DATA_ITEMS) )
+  {
+    return false;
+  }
+
+  if( (spi_drv = parse_spi_target(data_list[0])) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return false;
+  }
+
+  if( spi_drv->state != SPI_READY )
+  {
+    util_message_error(chp, "SPI not ready");
+    return false;
+  }
+
+  if( spi_frame16(spi_drv) )
+  {
+    util_message_error(chp, "16 bit frames configured, use exchange16");
+    return false;
+  }
 
-  if( spi_cfg->ssport != NULL )
+  if( spi_stream.drv != NULL )
   {
-    spiUnselect(spi_drv);
+    util_message_error(chp, "transaction open, use end first");
+    return false;
   }
 
-  util_message_uint32(chp, "count", &byte_count, 1);
-  util_message_hex_uint8( chp, "rx", rx_buffer, byte_count);
+  if( data_list[1] == NULL )
+  {
+    util_message_error(chp, "missing number base");
+    return false;
+  }
+
+  number_base = strtol(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+  {
+    util_message_error(chp, "invalid number base");
+    return false;
+  }
+
+  if( !spi_batch_run(NULL, spi_drv->config->ssport, &data_list[2], number_base, rx_buffer, &rx_count, &error) ||
+      !spi_batch_run(spi_drv, spi_drv->config->ssport, &data_list[2], number_base, rx_buffer, &rx_count, &error) )
+  {
+    util_message_error(chp, "%s", error);
+    return false;
+  }
+
+  util_message_uint32(chp, "count", &rx_count, 1);
+  util_message_hex_uint8(chp, "rx", rx_buffer, rx_count);
+
+  return true;
+}
+
+/*! \brief capture an external bus, SPI2 receives MOSI and SPI6 receives MISO
+ *
+ *  Both run as receive only slaves clocked by the external SCK, each into a
+ *  circular DMA buffer. Chip select edges frame the transactions.
+ */
+static bool fetch_spi_sniff_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  ioportid_t cs_port;
+  uint32_t cs_pin;
+  uint32_t cr1 = SPI_CR1_RXONLY | SPI_CR1_SSM | SPI_CR1_SSI;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 5) )
+  {
+    return false;
+  }
+
+  // no arguments stops the sniffer
+  if( data_list[0] == NULL )
+  {
+    spi_sniff_stop();
+    return true;
+  }
+
+  if( spi_sniff.running )
+  {
+    util_message_error(chp, "already sniffing, stop with sniff()");
+    return false;
+  }
+
+  cs_port = string_to_port(data_list[0]);
+  cs_pin = string_to_pin(data_list[1]);
+
+  if( cs_port == NULL || cs_pin == INVALID_PIN )
+  {
+    util_message_error(chp, "invalid chip select port/pin");
+    return false;
+  }
+
+  if( data_list[2] == NULL || data_list[3] == NULL )
+  {
+    util_message_error(chp, "missing cpol/cpha");
+    return false;
+  }
+
+  int32_t spi_cpol = strtol(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || spi_cpol > 1 || spi_cpol < 0 )
+  {
+    util_message_error(chp, "invalid CPOL value");
+    return false;
+  }
+  else if( spi_cpol == 1 )
+  {
+    cr1 |= SPI_CR1_CPOL;
+  }
+
+  int32_t spi_cpha = strtol(data_list[3], &endptr, 0);
+
+  if( *endptr != '\0' || spi_cpha > 1 || spi_cpha < 0 )
+  {
+    util_message_error(chp, "invalid CPHA value");
+    return false;
+  }
+  else if( spi_cpha == 1 )
+  {
+    cr1 |= SPI_CR1_CPHA;
+  }
+
+  if( data_list[4] != NULL )
+  {
+    int32_t spi_msb_lsb = strtol(data_list[4], &endptr, 0);
+
+    if( *endptr != '\0' || spi_msb_lsb > 1 || spi_msb_lsb < 0 )
+    {
+      util_message_error(chp, "invalid MSB/LSB value");
+      return false;
+    }
+    else if( spi_msb_lsb == 1 )
+    {
+      cr1 |= SPI_CR1_LSBFIRST;
+    }
+  }
+
+  if( spi_stream.drv != NULL || spi_sample.drv != NULL )
+  {
+    util_message_error(chp, "SPI transaction or stream running");
+    return false;
+  }
+
+  // the buses become inputs, the drivers give up their DMA streams
+  spiStop(&SPID2);
+  spiStop(&SPID6);
+
+  spi_sniff.dma[0] = STM32_DMA_STREAM(STM32_SPI_SPI2_RX_DMA_STREAM);
+  spi_sniff.dma[1] = STM32_DMA_STREAM(STM32_SPI_SPI6_RX_DMA_STREAM);
+
+  if( dmaStreamAllocate(spi_sniff.dma[0], SPI_SNIFF_DMA_PRIORITY, NULL, NULL) )
+  {
+    util_message_error(chp, "SPI2 DMA stream in use");
+    return false;
+  }
+
+  if( dmaStreamAllocate(spi_sniff.dma[1], SPI_SNIFF_DMA_PRIORITY, NULL, NULL) )
+  {
+    dmaStreamRelease(spi_sniff.dma[0]);
+    util_message_error(chp, "SPI6 DMA stream in use");
+    return false;
+  }
+
+  rccEnableSPI2(FALSE);
+  rccResetSPI2();
+  rccEnableSPI6(FALSE);
+  rccResetSPI6();
+
+  SPI2->CR1 = cr1;
+  SPI2->CR2 = SPI_CR2_RXDMAEN;
+  SPI6->CR1 = cr1;
+  SPI6->CR2 = SPI_CR2_RXDMAEN;
+
+  dmaStreamSetPeripheral(spi_sniff.dma[0], &SPI2->DR);
+  dmaStreamSetMemory0(spi_sniff.dma[0], spi_sniff_mosi);
+  dmaStreamSetTransactionSize(spi_sniff.dma[0], FETCH_SPI_SNIFF_BYTES);
+  dmaStreamSetMode(spi_sniff.dma[0], STM32_DMA_CR_CHSEL(STM32_DMA_GETCHANNEL(STM32_SPI_SPI2_RX_DMA_STREAM, STM32_SPI2_RX_DMA_CHN)) |
+                                     STM32_DMA_CR_PL(SPI_SNIFF_DMA_PRIORITY) | STM32_DMA_CR_DIR_P2M |
+                                     STM32_DMA_CR_MINC | STM32_DMA_CR_CIRC);
+
+  dmaStreamSetPeripheral(spi_sniff.dma[1], &SPI6->DR);
+  dmaStreamSetMemory0(spi_sniff.dma[1], spi_sniff_miso);
+  dmaStreamSetTransactionSize(spi_sniff.dma[1], FETCH_SPI_SNIFF_BYTES);
+  dmaStreamSetMode(spi_sniff.dma[1], STM32_DMA_CR_CHSEL(STM32_DMA_GETCHANNEL(STM32_SPI_SPI6_RX_DMA_STREAM, STM32_SPI6_RX_DMA_CHN)) |
+                                     STM32_DMA_CR_PL(SPI_SNIFF_DMA_PRIORITY) | STM32_DMA_CR_DIR_P2M |
+                                     STM32_DMA_CR_MINC | STM32_DMA_CR_CIRC);
+
+  dmaStreamEnable(spi_sniff.dma[0]);
+  dmaStreamEnable(spi_sniff.dma[1]);
+
+  SPI2->CR1 = cr1 | SPI_CR1_SPE;
+  SPI6->CR1 = cr1 | SPI_CR1_SPE;
+
+  palSetPadMode(GPIOI, GPIOI_SPI2_SCK, PAL_MODE_ALTERNATE(SPI_SNIFF_AF));
+  palSetPadMode(GPIOI, GPIOI_SPI2_MOSI, PAL_MODE_ALTERNATE(SPI_SNIFF_AF));
+  palSetPadMode(GPIOG, GPIOG_SPI6_SCK, PAL_MODE_ALTERNATE(SPI_SNIFF_AF));
+  palSetPadMode(GPIOG, GPIOG_SPI6_MOSI, PAL_MODE_ALTERNATE(SPI_SNIFF_AF));
+
+  spi_sniff.cs_port = cs_port;
+  spi_sniff.cs_pin = cs_pin;
+  spi_sniff.selected = false;
+  spi_sniff.written = 0;
+  spi_sniff.lost = 0;
+  util_timestamp_init(&spi_sniff.time);
+  util_ring_reset(&spi_sniff_ring);
+  spi_sniff.running = true;
+
+  if( !fetch_gpio_ext_claim(cs_port, cs_pin, EXT_CH_MODE_BOTH_EDGES, spi_sniff_cs_cb) )
+  {
+    spi_sniff_stop();
+    util_message_error(chp, "chip select EXTI line in use");
+    return false;
+  }
+
+  return true;
+}
+
+/*! \brief drain captured transactions
+ *
+ *  mosi and miso hold the bytes of all returned transactions back to back.
+ *  A transaction longer than one line of data is returned on its own and
+ *  cut to that length.
+ */
+static bool fetch_spi_transactions_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint32_t time_us[FETCH_SPI_SNIFF_BATCH];
+  static uint32_t length[FETCH_SPI_SNIFF_BATCH];
+  uint8_t * mosi = SPI_STREAM_BUFFER(0);
+  uint8_t * miso = SPI_STREAM_BUFFER(1);
+  spi_sniff_record_t record;
+  uint32_t count = 0;
+  uint32_t bytes = 0;
+  uint32_t value;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  // the stream buffers are free, nothing else runs on the buses while sniffing
+  while( count < FETCH_SPI_SNIFF_BATCH && util_ring_peek(&spi_sniff_ring, &record) )
+  {
+    uint32_t n = record.length;
+    uint32_t offset = record.start & (FETCH_SPI_SNIFF_BYTES - 1);
+
+    if( n > FETCH_SPI_STREAM_CHUNK - bytes )
+    {
+      if( count > 0 )
+      {
+        break;
+      }
+      n = FETCH_SPI_STREAM_CHUNK;
+    }
+
+    util_ring_get(&spi_sniff_ring, &record);
+
+    for( uint32_t i = 0; i < n; i++ )
+    {
+      mosi[bytes + i] = spi_sniff_mosi[(offset + i) & (FETCH_SPI_SNIFF_BYTES - 1)];
+      miso[bytes + i] = spi_sniff_miso[(offset + i) & (FETCH_SPI_SNIFF_BYTES - 1)];
+    }
+
+    // the DMA may have gone round the buffer before or during the copy
+    if( spi_sniff_received() - record.start > FETCH_SPI_SNIFF_BYTES )
+    {
+      spi_sniff.lost++;
+      continue;
+    }
+
+    time_us[count] = record.time_us;
+    length[count] = record.length;
+    bytes += n;
+    count++;
+  }
+
+  util_message_uint32(chp, "count", &count, 1);
+  value = util_ring_count(&spi_sniff_ring);
+  util_message_uint32(chp, "pending", &value, 1);
+  value = util_ring_take_overflows(&spi_sniff_ring);
+  util_message_uint32(chp, "overflows", &value, 1);
+  util_message_uint32(chp, "lost", &spi_sniff.lost, 1);
+  util_message_uint32(chp, "time_us", time_us, count);
+  util_message_uint32(chp, "length", length, count);
+  util_message_hex_uint8(chp, "mosi", mosi, bytes);
+  util_message_hex_uint8(chp, "miso", miso, bytes);
+
+  return true;
+}
+
+/*! \brief run one transaction per timer tick until stopped
+ *
+ *  The timer callback starts each exchange by DMA and the SPI callback
+ *  queues the result, so sampling does not wait for the host.
+ */
+static bool fetch_spi_stream_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static const GPTConfig spi_sample_gpt_cfg = {
+    .frequency = SPI_SAMPLE_GPT_FREQUENCY,
+    .callback  = spi_sample_gpt_cb,
+    .cr2       = 0,
+    .dier      = 0
+  };
+  SPIDriver * spi_drv;
+  spi_profile_t * profile;
+  uint32_t period_us;
+  uint32_t length;
+  uint32_t byte_count = 0;
+  int number_base = 16;
+  uint32_t data_start = 3;
+  char * endptr;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, SPI_SAMPLE_MAX_BYTES + 4) )
+  {
+    return false;
+  }
+
+  if( data_list[1] == NULL )
+  {
+    util_message_error(chp, "missing period");
+    return false;
+  }
+
+  period_us = strtoul(data_list[1], &endptr, 0);
+
+  if( *endptr != '\0' || (period_us != 0 && (period_us < SPI_SAMPLE_MIN_PERIOD_US || period_us > SPI_SAMPLE_MAX_PERIOD_US)) )
+  {
+    util_message_error(chp, "invalid period. Range: %u-%u, 0 stops", SPI_SAMPLE_MIN_PERIOD_US, SPI_SAMPLE_MAX_PERIOD_US);
+    return false;
+  }
+
+  if( period_us == 0 )
+  {
+    // the bus itself, a profile is not switched to just to stop
+    if( (spi_drv = parse_spi_dev(data_list[0], NULL)) == NULL && (profile = spi_find_profile(data_list[0])) != NULL )
+    {
+      spi_drv = profile->drv;
+    }
+
+    if( spi_drv == NULL || spi_drv != spi_sample.drv )
+    {
+      util_message_error(chp, "not streaming on this device");
+      return false;
+    }
+
+    spi_sample_stop();
+    return true;
+  }
+
+  if( spi_sample.drv != NULL )
+  {
+    util_message_error(chp, "already streaming, stop with stream(<dev>,0)");
+    return false;
+  }
+
+  if( (spi_drv = parse_spi_target(data_list[0])) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return false;
+  }
+
+  if( spi_drv->state != SPI_READY )
+  {
+    util_message_error(chp, "SPI not ready");
+    return false;
+  }
+
+  if( spi_frame16(spi_drv) )
+  {
+    util_message_error(chp, "16 bit frames configured, streams use 8 bit frames");
+    return false;
+  }
+
+  if( spi_stream.drv != NULL )
+  {
+    util_message_error(chp, "transaction open, use end first");
+    return false;
+  }
+
+  if( data_list[2] == NULL )
+  {
+    util_message_error(chp, "missing length");
+    return false;
+  }
+
+  length = strtoul(data_list[2], &endptr, 0);
+
+  if( *endptr != '\0' || length == 0 || length > SPI_SAMPLE_MAX_BYTES )
+  {
+    util_message_error(chp, "invalid length. Range: 1-%u", SPI_SAMPLE_MAX_BYTES);
+    return false;
+  }
+
+  memset(spi_sample.tx, 0xff, sizeof(spi_sample.tx));
+  memset(spi_sample.rx, 0, sizeof(spi_sample.rx));
+
+  if( data_list[3] != NULL )
+  {
+    if( !fetch_is_hex_blob(data_list[3]) )
+    {
+      number_base = strtol(data_list[3], &endptr, 0);
+
+      if( *endptr != '\0' || number_base == 1 || number_base < 0 || number_base > 36 )
+      {
+        util_message_error(chp, "invalid number base");
+        return false;
+      }
+      data_start = 4;
+    }
+
+    if( !fetch_parse_bytes(chp, &data_list[data_start], number_base, spi_sample.tx, length, &byte_count) )
+    {
+      return false;
+    }
+  }
+
+  // same bus settings, with the sampling callback
+  spi_sample.saved_config = spi_drv->config;
+  spi_sample.config = *spi_drv->config;
+  spi_sample.config.end_cb = spi_sample_end_cb;
+  spiStart(spi_drv, &spi_sample.config);
+
+  spi_sample.drv = spi_drv;
+  spi_sample.length = length;
+  spi_sample.period_us = period_us;
+  spi_sample.tick = 0;
+  spi_sample.overruns = 0;
+  util_ring_reset(&spi_sample_ring);
+
+  gptStart(&SPI_SAMPLE_GPTD, &spi_sample_gpt_cfg);
+  gptStartContinuous(&SPI_SAMPLE_GPTD, (SPI_SAMPLE_GPT_FREQUENCY / 1000000) * period_us);
+
+  return true;
+}
+
+/*! \brief drain up to one batch of stream samples
+ */
+static bool fetch_spi_samples_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint32_t time_us[FETCH_SPI_SAMPLE_BATCH];
+  uint8_t * rx = &spi_stream_fill[0];
+  spi_sample_t sample;
+  uint32_t count = 0;
+  uint32_t value;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  // the fill buffer is only used during spi.read, borrow it for the rx bytes
+  while( count < FETCH_SPI_SAMPLE_BATCH && util_ring_get(&spi_sample_ring, &sample) )
+  {
+    uint64_t time = (uint64_t)sample.tick * spi_sample.period_us;
+
+    // microseconds overflow 32 bits after ~71 minutes of streaming
+    time_us[count] = (time > UINT32_MAX) ? UINT32_MAX : (uint32_t)time;
+    memcpy(&rx[count * spi_sample.length], sample.data, spi_sample.length);
+    count++;
+  }
+
+  util_message_uint32(chp, "count", &count, 1);
+  value = util_ring_count(&spi_sample_ring);
+  util_message_uint32(chp, "pending", &value, 1);
+  value = util_ring_take_overflows(&spi_sample_ring);
+  util_message_uint32(chp, "overflows", &value, 1);
+  value = spi_sample.overruns;
+  util_message_uint32(chp, "overruns", &value, 1);
+  util_message_uint32(chp, "length", &spi_sample.length, 1);
+  util_message_uint32(chp, "time_us", time_us, count);
+  util_message_hex_uint8(chp, "rx", rx, count * spi_sample.length);
 
   return true;
 }
@@ -294,6 +2178,19 @@ static bool fetch_spi_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], c
     return false;
   }
 
+  if( spi_stream.drv == spi_drv )
+  {
+    spi_stream_close();
+  }
+
+  if( spi_sample.drv == spi_drv )
+  {
+    spi_sample_stop();
+  }
+
+  // the sniffer holds both buses
+  spi_sniff_stop();
+
   spiStop(spi_drv);
 
   return true;
@@ -311,6 +2208,43 @@ static bool fetch_spi_help_cmd(BaseSequentialStream * chp, char * cmd_list[], ch
 	return true;
 }
 
+/*! \brief look up a bus or profile for another fetch module
+ *
+ *  The device is switched to and checked for 8 bit frames with no open
+ *  transaction.
+ *  \returns NULL after reporting the error
+ */
+SPIDriver * fetch_spi_device(BaseSequentialStream * chp, char * str)
+{
+  SPIDriver * spi_drv;
+
+  if( (spi_drv = parse_spi_target(str)) == NULL )
+  {
+    util_message_error(chp, "invalid or busy device");
+    return NULL;
+  }
+
+  if( spi_drv->state != SPI_READY )
+  {
+    util_message_error(chp, "SPI not ready");
+    return NULL;
+  }
+
+  if( spi_frame16(spi_drv) )
+  {
+    util_message_error(chp, "16 bit frames configured");
+    return NULL;
+  }
+
+  if( spi_stream.drv == spi_drv )
+  {
+    util_message_error(chp, "transaction open, use spi.end first");
+    return NULL;
+  }
+
+  return spi_drv;
+}
+
 void fetch_spi_init(BaseSequentialStream * chp)
 {
   static bool spi_init_flag = false;
@@ -318,8 +2252,9 @@ void fetch_spi_init(BaseSequentialStream * chp)
   if( spi_init_flag )
     return;
 
-  // put spi initialization stuff here
-  // ...
+  chBSemObjectInit(&spi_stream_sem, true);
+  util_ring_init(&spi_sample_ring, spi_sample_buffer, sizeof(spi_sample_t), FETCH_SPI_SAMPLE_DEPTH);
+  util_ring_init(&spi_sniff_ring, spi_sniff_buffer, sizeof(spi_sniff_record_t), FETCH_SPI_SNIFF_DEPTH);
 
   spi_init_flag = true;
 }
@@ -334,6 +2269,10 @@ bool fetch_spi_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * da
 
 bool fetch_spi_reset(BaseSequentialStream * chp)
 {
+  spi_stream_close();
+  spi_sample_stop();
+  spi_sniff_stop();
+
 #if STM32_SPI_USE_SPI2
   spiStop(&SPID2);
 #endif
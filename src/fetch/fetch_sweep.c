@@ -0,0 +1,610 @@
+/*! \file fetch_sweep.c
+  *
+  * Frequency response (Bode) sweep: DAC sine stimulus -> ADC -> Goertzel
+  *
+  * \sa fetch.c
+  * @defgroup fetch_sweep Fetch Sweep
+  * @{
+  */
+
+/*!
+ * <hr>
+ *
+ *  For each frequency the internal DAC plays a sine (see fetch_dac_dds_start())
+ *  while one ADC scans the stimulus and the response channel back to back in
+ *  continuous mode. Every sample pair is fed to a single bin Goertzel filter
+ *  per channel from the ADC DMA callback, so only the filter state is kept and
+ *  the capture length is not limited by RAM.
+ *
+ *  Gain and phase are taken from the ratio of the two bins. Because both
+ *  channels are measured against the same ADC clock the DAC start time does
+ *  not matter; only the fixed delay between the two conversions of a pair is
+ *  corrected for.
+ *
+ *  Results are returned as fixed point integers:
+ *    frequency_mhz  millihertz
+ *    gain_mdb       response/stimulus in milli dB
+ *    phase_mdeg     response - stimulus in millidegrees, -180000 ... 180000
+ *
+ * <hr>
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_general.h"
+#include "util_strings.h"
+#include "util_messages.h"
+
+#include "fetch_defs.h"
+#include "fetch.h"
+#include "fetch_adc.h"
+#include "fetch_dac.h"
+
+#include "fetch_sweep.h"
+
+#ifndef FETCH_SWEEP_MAX_POINTS
+#define FETCH_SWEEP_MAX_POINTS        64
+#endif
+
+#ifndef FETCH_SWEEP_OVERSAMPLE
+#define FETCH_SWEEP_OVERSAMPLE        16      //!< preferred sample pairs per period
+#endif
+
+#ifndef FETCH_SWEEP_MIN_CYCLES
+#define FETCH_SWEEP_MIN_CYCLES        4       //!< periods integrated per point
+#endif
+
+#ifndef FETCH_SWEEP_MIN_TIME_MS
+#define FETCH_SWEEP_MIN_TIME_MS       20      //!< shortest integration per point
+#endif
+
+#ifndef FETCH_SWEEP_SETTLE_MS
+#define FETCH_SWEEP_SETTLE_MS         10      //!< settle time after a frequency change
+#endif
+
+#define SWEEP_BUFFER_DEPTH            512     //!< sample pairs, callbacks every half
+#define SWEEP_ADC_MIDSCALE            2048.0f
+#define SWEEP_SETTLE_CYCLES           4.0f
+
+#if STM32_ADC_ADCPRE == ADC_CCR_ADCPRE_DIV2
+#define SWEEP_ADCCLK                  (STM32_PCLK2 / 2)
+#elif STM32_ADC_ADCPRE == ADC_CCR_ADCPRE_DIV4
+#define SWEEP_ADCCLK                  (STM32_PCLK2 / 4)
+#elif STM32_ADC_ADCPRE == ADC_CCR_ADCPRE_DIV6
+#define SWEEP_ADCCLK                  (STM32_PCLK2 / 6)
+#else
+#define SWEEP_ADCCLK                  (STM32_PCLK2 / 8)
+#endif
+
+enum {
+  SWEEP_CONFIG_DEV = 0,
+  SWEEP_CONFIG_STIMULUS,
+  SWEEP_CONFIG_RESPONSE,
+  SWEEP_CONFIG_AMPLITUDE,
+  SWEEP_CONFIG_OFFSET,
+  SWEEP_CONFIG_COUNT
+};
+
+/*! \brief single bin Goertzel filter state
+ */
+typedef struct goertzel
+{
+  float coeff;
+  float s1;
+  float s2;
+} goertzel_t;
+
+static const char * sweep_dev_tok[] = {"ADC1", "ADC2", "ADC3"};
+static const char * sweep_ch_tok[] = {"CH0","CH1","CH2","CH3","CH4","CH5","CH6","CH7","CH8","CH9","CH10","CH11","CH12","CH13","CH14","CH15"};
+
+//! sample time codes and their length in ADC clocks, fastest first
+static const uint32_t sweep_sample_code[] = { ADC_SAMPLE_3, ADC_SAMPLE_15, ADC_SAMPLE_28, ADC_SAMPLE_56,
+                                              ADC_SAMPLE_84, ADC_SAMPLE_112, ADC_SAMPLE_144, ADC_SAMPLE_480 };
+static const uint32_t sweep_sample_clocks[] = { 3, 15, 28, 56, 84, 112, 144, 480 };
+
+static void sweep_adc_cb(ADCDriver * adcp, adcsample_t * buffer, size_t n);
+static void sweep_adc_error_cb(ADCDriver * adcp, adcerror_t err);
+
+static bool fetch_sweep_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_sweep_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_sweep_run_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+static bool fetch_sweep_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+static const char sweep_config_help_string[] = "Configure frequency sweep\n" \
+                      "Usage: config(<dev>,<stimulus>,<response>,<amplitude>,<offset>)\n" \
+                      "\tdev = ADC1 | ADC2 | ADC3\n" \
+                      "\tstimulus = CH0 ... CH15 {DAC output as seen by the ADC}\n" \
+                      "\tresponse = CH0 ... CH15\n" \
+                      "\tamplitude = <peak dac counts>\n" \
+                      "\toffset = <dac counts>";
+
+static const char sweep_run_help_string[] = "Run sweep, stimulus on DAC channel 4\n" \
+                      "Usage: run(<frequency>,...)\n" \
+                      "\tfrequency = <Hz>";
+
+static fetch_command_t fetch_sweep_commands[] = {
+  /*  function                  command string      help string */
+    { fetch_sweep_help_cmd,     "help",             "Display sweep help" },
+    { fetch_sweep_config_cmd,   "config",           sweep_config_help_string },
+    { fetch_sweep_run_cmd,      "run",              sweep_run_help_string },
+    { fetch_sweep_reset_cmd,    "reset",            "Reset sweep configuration" },
+    { NULL, NULL, NULL }
+  };
+
+static ADCDriver * sweep_adc = NULL;
+
+static uint16_t sweep_amplitude = 0;
+static uint16_t sweep_offset = 0;
+
+static adcsample_t sweep_buffer[SWEEP_BUFFER_DEPTH * 2];
+
+static goertzel_t sweep_stimulus;
+static goertzel_t sweep_response;
+
+static volatile uint32_t sweep_count = 0;
+static volatile uint32_t sweep_total = 0;
+static volatile bool sweep_done = false;
+static volatile bool sweep_error = false;
+
+static binary_semaphore_t sweep_done_sem;
+
+/*! \brief ADC conversion group, two channel continuous scan
+ */
+static ADCConversionGroup sweep_conv_grp = {
+	.circular        = true,
+	.num_channels    = 2,
+	.end_cb          = sweep_adc_cb,
+	.error_cb        = sweep_adc_error_cb,
+	/* HW dependent part.*/
+	.cr1             = 0,
+	.cr2             = ADC_CR2_SWSTART | ADC_CR2_CONT,
+	.smpr1           = 0,
+	.smpr2           = 0,
+	.sqr1            = ADC_SQR1_NUM_CH(2),
+	.sqr2            = 0,
+	.sqr3            = 0
+};
+
+static void goertzel_init(goertzel_t * g, float omega)
+{
+  g->coeff = 2.0f * cosf(omega);
+  g->s1 = 0.0f;
+  g->s2 = 0.0f;
+}
+
+static inline void goertzel_update(goertzel_t * g, adcsample_t sample)
+{
+  float s0 = ((float)sample - SWEEP_ADC_MIDSCALE) + g->coeff * g->s1 - g->s2;
+
+  g->s2 = g->s1;
+  g->s1 = s0;
+}
+
+/*! \brief bin magnitude and phase, the common e^(jw(N-1)) factor is left in
+ */
+static void goertzel_result(goertzel_t * g, float omega, float * magnitude, float * phase)
+{
+  float re = g->s1 - cosf(omega) * g->s2;
+  float im = sinf(omega) * g->s2;
+
+  *magnitude = sqrtf(re * re + im * im);
+  *phase = atan2f(im, re);
+}
+
+/*! \brief half/full buffer callback, integrate sample pairs until done
+ */
+static void sweep_adc_cb(ADCDriver * adcp, adcsample_t * buffer, size_t n)
+{
+  uint32_t count = sweep_count;
+  uint32_t total = sweep_total;
+
+  (void)adcp;
+
+  if( sweep_done )
+  {
+    return;
+  }
+
+  for( size_t i = 0; i < n && count < total; i++ )
+  {
+    goertzel_update(&sweep_stimulus, buffer[2 * i]);
+    goertzel_update(&sweep_response, buffer[2 * i + 1]);
+    count++;
+  }
+  sweep_count = count;
+
+  if( count >= total )
+  {
+    sweep_done = true;
+    chSysLockFromISR();
+    chBSemSignalI(&sweep_done_sem);
+    chSysUnlockFromISR();
+  }
+}
+
+static void sweep_adc_error_cb(ADCDriver * adcp, adcerror_t err)
+{
+  (void)adcp;
+  (void)err;
+
+  if( sweep_done )
+  {
+    return;
+  }
+
+  sweep_error = true;
+  sweep_done = true;
+  chSysLockFromISR();
+  chBSemSignalI(&sweep_done_sem);
+  chSysUnlockFromISR();
+}
+
+/*! \brief pick the slowest sample time that still oversamples the frequency
+ *  \returns index into sweep_sample_code[]
+ */
+static uint32_t sweep_select_sample_time(float frequency)
+{
+  for( int32_t i = NELEMS(sweep_sample_clocks) - 1; i >= 0; i-- )
+  {
+    float pair_rate = (float)SWEEP_ADCCLK / (2 * (sweep_sample_clocks[i] + 12));
+
+    if( pair_rate >= FETCH_SWEEP_OVERSAMPLE * frequency )
+    {
+      return i;
+    }
+  }
+  return 0;
+}
+
+static void sweep_set_sample_time(uint32_t code)
+{
+  sweep_conv_grp.smpr1 = ADC_SMPR1_SMP_AN10( code ) |
+                         ADC_SMPR1_SMP_AN11( code ) |
+                         ADC_SMPR1_SMP_AN12( code ) |
+                         ADC_SMPR1_SMP_AN13( code ) |
+                         ADC_SMPR1_SMP_AN14( code ) |
+                         ADC_SMPR1_SMP_AN15( code );
+
+  sweep_conv_grp.smpr2 = ADC_SMPR2_SMP_AN0( code ) |
+                         ADC_SMPR2_SMP_AN1( code ) |
+                         ADC_SMPR2_SMP_AN2( code ) |
+                         ADC_SMPR2_SMP_AN3( code ) |
+                         ADC_SMPR2_SMP_AN4( code ) |
+                         ADC_SMPR2_SMP_AN5( code ) |
+                         ADC_SMPR2_SMP_AN6( code ) |
+                         ADC_SMPR2_SMP_AN7( code ) |
+                         ADC_SMPR2_SMP_AN8( code ) |
+                         ADC_SMPR2_SMP_AN9( code );
+}
+
+/*! \brief measure one point
+ *  \param[in]  frequency  requested frequency in Hz
+ *  \param[out] actual     generated frequency in Hz
+ *  \param[out] gain_db    response/stimulus
+ *  \param[out] phase_deg  response - stimulus
+ */
+static bool sweep_measure(BaseSequentialStream * chp, float frequency,
+                          float * actual, float * gain_db, float * phase_deg)
+{
+  uint32_t smp;
+  float pair_rate;
+  float pair_delay;
+  float omega;
+  float cycles;
+  float stim_mag, stim_phase, resp_mag, resp_phase;
+  float phase;
+  uint32_t settle_ms;
+  uint32_t capture_ms;
+
+  if( fetch_adc_claimed(sweep_adc) )
+  {
+    util_message_error(chp, "ADC in use by the control loop");
+    util_message_info(chp, "use ctrl.stop");
+    return false;
+  }
+
+  // the stimulus is the internal DAC, channel 4
+  if( fetch_dac_claimed(4) )
+  {
+    util_message_error(chp, "DAC in use by the control loop");
+    util_message_info(chp, "use ctrl.stop");
+    return false;
+  }
+
+  if( !fetch_dac_dds_start(frequency, sweep_amplitude, sweep_offset, actual) )
+  {
+    util_message_error(chp, "frequency out of range");
+    return false;
+  }
+
+  smp = sweep_select_sample_time(*actual);
+  pair_rate = (float)SWEEP_ADCCLK / (2 * (sweep_sample_clocks[smp] + 12));
+  pair_delay = (float)(sweep_sample_clocks[smp] + 12) / SWEEP_ADCCLK;
+
+  if( pair_rate <= 2.0f * *actual )
+  {
+    util_message_error(chp, "frequency above ADC sample rate");
+    return false;
+  }
+
+  // integrate a whole number of periods to keep leakage from the offset down
+  cycles = ceilf(*actual * FETCH_SWEEP_MIN_TIME_MS / 1000.0f);
+  if( cycles < FETCH_SWEEP_MIN_CYCLES )
+  {
+    cycles = FETCH_SWEEP_MIN_CYCLES;
+  }
+
+  omega = 2.0f * (float)M_PI * *actual / pair_rate;
+  goertzel_init(&sweep_stimulus, omega);
+  goertzel_init(&sweep_response, omega);
+  sweep_set_sample_time(sweep_sample_code[smp]);
+
+  sweep_total = (uint32_t)(cycles * pair_rate / *actual + 0.5f);
+  sweep_count = 0;
+  sweep_error = false;
+  sweep_done = false;
+  chBSemReset(&sweep_done_sem, true);
+
+  settle_ms = (uint32_t)(SWEEP_SETTLE_CYCLES * 1000.0f / *actual) + 1;
+  if( settle_ms < FETCH_SWEEP_SETTLE_MS )
+  {
+    settle_ms = FETCH_SWEEP_SETTLE_MS;
+  }
+  chThdSleepMilliseconds(settle_ms);
+
+  if( sweep_adc->state != ADC_READY )
+  {
+    util_message_error(chp, "ADC not ready");
+    return false;
+  }
+
+  capture_ms = (uint32_t)(sweep_total * 1000.0f / pair_rate);
+
+  adcStartConversion(sweep_adc, &sweep_conv_grp, sweep_buffer, SWEEP_BUFFER_DEPTH);
+
+  if( chBSemWaitTimeout(&sweep_done_sem, MS2ST(capture_ms + 100)) == MSG_TIMEOUT )
+  {
+    sweep_error = true;
+  }
+
+  adcStopConversion(sweep_adc);
+
+  if( sweep_error )
+  {
+    util_message_error(chp, "ADC capture failed");
+    return false;
+  }
+
+  goertzel_result(&sweep_stimulus, omega, &stim_mag, &stim_phase);
+  goertzel_result(&sweep_response, omega, &resp_mag, &resp_phase);
+
+  if( stim_mag <= 0.0f )
+  {
+    util_message_error(chp, "no stimulus signal");
+    return false;
+  }
+
+  // the response sample of each pair is taken one conversion later
+  phase = resp_phase - stim_phase - 2.0f * (float)M_PI * *actual * pair_delay;
+  phase = fmodf(phase, 2.0f * (float)M_PI);
+  if( phase > (float)M_PI )
+  {
+    phase -= 2.0f * (float)M_PI;
+  }
+  else if( phase <= -(float)M_PI )
+  {
+    phase += 2.0f * (float)M_PI;
+  }
+
+  *gain_db = 20.0f * log10f(resp_mag / stim_mag);
+  *phase_deg = phase * 180.0f / (float)M_PI;
+
+  return true;
+}
+
+static bool fetch_sweep_help_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  util_message_info(chp, "Fetch Sweep Help:");
+  fetch_display_help(chp, fetch_sweep_commands);
+	return true;
+}
+
+static bool fetch_sweep_config_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  char * endptr;
+  ADCDriver * adc_drv;
+  int stimulus;
+  int response;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, SWEEP_CONFIG_COUNT) )
+  {
+    return false;
+  }
+
+  switch( token_match( data_list[SWEEP_CONFIG_DEV], FETCH_MAX_DATA_STRLEN,
+                       sweep_dev_tok, NELEMS(sweep_dev_tok)) )
+  {
+#if STM32_ADC_USE_ADC1
+    case 0:
+      adc_drv = &ADCD1;
+      break;
+#endif
+#if STM32_ADC_USE_ADC2
+    case 1:
+      adc_drv = &ADCD2;
+      break;
+#endif
+#if STM32_ADC_USE_ADC3
+    case 2:
+      adc_drv = &ADCD3;
+      break;
+#endif
+    default:
+      util_message_error(chp, "invalid adc device");
+      return false;
+  }
+
+  stimulus = token_match( data_list[SWEEP_CONFIG_STIMULUS], FETCH_MAX_DATA_STRLEN,
+                          sweep_ch_tok, NELEMS(sweep_ch_tok) );
+  if( stimulus == TOKEN_NOT_FOUND )
+  {
+    util_message_error(chp, "invalid stimulus channel");
+    return false;
+  }
+
+  response = token_match( data_list[SWEEP_CONFIG_RESPONSE], FETCH_MAX_DATA_STRLEN,
+                          sweep_ch_tok, NELEMS(sweep_ch_tok) );
+  if( response == TOKEN_NOT_FOUND )
+  {
+    util_message_error(chp, "invalid response channel");
+    return false;
+  }
+
+  if( data_list[SWEEP_CONFIG_AMPLITUDE] == NULL || data_list[SWEEP_CONFIG_OFFSET] == NULL )
+  {
+    util_message_error(chp, "missing amplitude or offset");
+    return false;
+  }
+
+  int32_t amplitude = strtol(data_list[SWEEP_CONFIG_AMPLITUDE], &endptr, 0);
+
+  if( *endptr != '\0' || amplitude <= 0 || amplitude > 0xfff )
+  {
+    util_message_error(chp, "invalid amplitude");
+    return false;
+  }
+
+  int32_t offset = strtol(data_list[SWEEP_CONFIG_OFFSET], &endptr, 0);
+
+  if( *endptr != '\0' || offset < 0 || offset > 0xfff )
+  {
+    util_message_error(chp, "invalid offset");
+    return false;
+  }
+
+  sweep_conv_grp.sqr3 = ADC_SQR3_SQ1_N(stimulus) | ADC_SQR3_SQ2_N(response);
+
+  sweep_adc = adc_drv;
+  sweep_amplitude = amplitude;
+  sweep_offset = offset;
+
+  return true;
+}
+
+static bool fetch_sweep_run_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  static uint32_t frequency_mhz[FETCH_SWEEP_MAX_POINTS];
+  static int32_t gain_mdb[FETCH_SWEEP_MAX_POINTS];
+  static int32_t phase_mdeg[FETCH_SWEEP_MAX_POINTS];
+  char * endptr;
+  uint32_t count = 0;
+  float actual, gain_db, phase_deg;
+  bool result = true;
+
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, FETCH_SWEEP_MAX_POINTS) )
+  {
+    return false;
+  }
+
+  if( sweep_adc == NULL )
+  {
+    util_message_error(chp, "sweep not configured");
+    return false;
+  }
+
+  if( data_list[0] == NULL )
+  {
+    util_message_error(chp, "missing frequency");
+    return false;
+  }
+
+  for( count = 0; count < FETCH_SWEEP_MAX_POINTS && data_list[count] != NULL; count++ )
+  {
+    float frequency = strtof(data_list[count], &endptr);
+
+    if( *endptr != '\0' || frequency <= 0.0f )
+    {
+      util_message_error(chp, "invalid frequency");
+      result = false;
+      break;
+    }
+
+    if( !sweep_measure(chp, frequency, &actual, &gain_db, &phase_deg) )
+    {
+      result = false;
+      break;
+    }
+
+    frequency_mhz[count] = (uint32_t)(actual * 1000.0f + 0.5f);
+    gain_mdb[count] = (int32_t)lroundf(gain_db * 1000.0f);
+    phase_mdeg[count] = (int32_t)lroundf(phase_deg * 1000.0f);
+  }
+
+  fetch_dac_dds_stop();
+
+  if( !result )
+  {
+    return false;
+  }
+
+  util_message_uint32(chp, "count", &count, 1);
+  util_message_uint32(chp, "frequency_mhz", frequency_mhz, count);
+  util_message_int32(chp, "gain_mdb", gain_mdb, count);
+  util_message_int32(chp, "phase_mdeg", phase_mdeg, count);
+
+  return true;
+}
+
+static bool fetch_sweep_reset_cmd(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  if( !fetch_input_check(chp, cmd_list, FETCH_TOK_SUBCMD_0, data_list, 0) )
+  {
+    return false;
+  }
+
+  return fetch_sweep_reset(chp);
+}
+
+void fetch_sweep_init(BaseSequentialStream * chp)
+{
+  static bool sweep_init_flag = false;
+
+  if( sweep_init_flag )
+    return;
+
+  chBSemObjectInit(&sweep_done_sem, true);
+
+  fetch_sweep_reset(chp);
+
+  sweep_init_flag = true;
+}
+
+/*! \brief dispatch a sweep command
+ */
+bool fetch_sweep_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[])
+{
+  return fetch_dispatch(chp, fetch_sweep_commands, cmd_list[FETCH_TOK_SUBCMD_0], cmd_list, data_list);
+}
+
+bool fetch_sweep_reset(BaseSequentialStream * chp)
+{
+  sweep_adc = NULL;
+  sweep_amplitude = 0;
+  sweep_offset = 0;
+
+  return true;
+}
+
+/*! @} */
@@ -20,6 +20,8 @@ bool fetch_dispatch(BaseSequentialStream* chp, fetch_command_t cmd_fn[], char *
 void fetch_display_help(BaseSequentialStream * chp, fetch_command_t cmd_fn[]);
 int  fetch_find_command(fetch_command_t cmd_fn[], char * command);
 bool fetch_input_check( BaseSequentialStream * chp, char * cmd_list[], uint32_t max_cmd, char * data_list[], uint32_t max_data );
+bool fetch_is_hex_blob( const char * str );
+bool fetch_parse_bytes( BaseSequentialStream * chp, char * data_list[], int number_base, uint8_t * buf, uint32_t max, uint32_t * count );
 
 #ifdef __cplusplus
 }
@@ -19,6 +19,12 @@ bool fetch_adc_reset(BaseSequentialStream * chp);
 
 void fetch_adc_init(BaseSequentialStream * chp);
 
+bool fetch_adc_claim(ADCDriver * adcp);
+
+void fetch_adc_release(ADCDriver * adcp);
+
+bool fetch_adc_claimed(ADCDriver * adcp);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,63 @@
+
+/*! \file fetch_can.h
+ *
+ * @addtogroup fetch_can
+ * @{
+ */
+
+#ifndef FETCH_CAN_H_
+#define FETCH_CAN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CAN_FRAME_EXT     0x80000000    //!< can_frame_t id flag, 29 bit identifier
+#define CAN_FRAME_RTR     0x40000000    //!< can_frame_t id flag, remote frame
+
+#define FETCH_CAN_RX_EVENT  EVENT_MASK(1) //!< signalled to the bridge thread
+
+/*! \brief one received frame
+ */
+typedef struct can_frame
+{
+  uint32_t  time_us;
+  uint32_t  id;           //!< identifier with the CAN_FRAME_ flags
+  uint8_t   dlc;
+  union
+  {
+    uint8_t   data[8];
+    uint32_t  data32[2];
+  };
+} can_frame_t;
+
+bool fetch_can_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+bool fetch_can_reset(BaseSequentialStream * chp);
+
+void fetch_can_init(BaseSequentialStream * chp);
+
+bool fetch_can_bitrate_valid(uint32_t bitrate);
+
+bool fetch_can_bridge_open(uint32_t bitrate, bool listen_only);
+
+void fetch_can_bridge_close(void);
+
+int32_t fetch_can_bridge_receive(can_frame_t * frames, uint32_t max, uint32_t * lost);
+
+uint32_t fetch_can_errors(void);
+
+bool fetch_can_transmit(const can_frame_t * frame);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
+
+/*! @} */
@@ -0,0 +1,30 @@
+
+/*! \file fetch_counter.h
+ *
+ * @addtogroup fetch_counter
+ * @{
+ */
+
+#ifndef FETCH_COUNTER_H_
+#define FETCH_COUNTER_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool fetch_counter_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+bool fetch_counter_reset(BaseSequentialStream * chp);
+
+void fetch_counter_init(BaseSequentialStream * chp);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
+
+/*! @} */
@@ -0,0 +1,30 @@
+
+/*! \file fetch_ctrl.h
+ *
+ * @addtogroup fetch_ctrl
+ * @{
+ */
+
+#ifndef FETCH_CTRL_H_
+#define FETCH_CTRL_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool fetch_ctrl_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+bool fetch_ctrl_reset(BaseSequentialStream * chp);
+
+void fetch_ctrl_init(BaseSequentialStream * chp);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
+
+/*! @} */
@@ -17,6 +17,18 @@ bool fetch_dac_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * da
 
 bool fetch_dac_reset(BaseSequentialStream * chp);
 
+bool fetch_dac_write_i(uint16_t channel, uint16_t value);
+
+bool fetch_dac_claim(uint16_t channel);
+
+void fetch_dac_release(void);
+
+bool fetch_dac_claimed(uint16_t channel);
+
+bool fetch_dac_dds_start(float frequency, uint16_t amplitude, uint16_t offset, float * actual);
+
+void fetch_dac_dds_stop(void);
+
 void fetch_dac_init(BaseSequentialStream * chp);
 
 #ifdef __cplusplus
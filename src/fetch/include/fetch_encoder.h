@@ -0,0 +1,32 @@
+
+/*! \file fetch_encoder.h
+ *
+ * @addtogroup fetch_encoder
+ * @{
+ */
+
+#ifndef FETCH_ENCODER_H_
+#define FETCH_ENCODER_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool fetch_encoder_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+bool fetch_encoder_reset(BaseSequentialStream * chp);
+
+void fetch_encoder_init(BaseSequentialStream * chp);
+
+bool fetch_encoder_running(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
+
+/*! @} */
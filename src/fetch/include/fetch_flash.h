@@ -0,0 +1,31 @@
+
+/*! \file fetch_flash.h
+ *
+ * @addtogroup fetch_flash
+ * @{
+ */
+
+#ifndef FETCH_FLASH_H_
+#define FETCH_FLASH_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool fetch_flash_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+bool fetch_flash_reset(BaseSequentialStream * chp);
+
+void fetch_flash_init(BaseSequentialStream * chp);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
+
+/*! @} */
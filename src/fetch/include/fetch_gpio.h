@@ -16,6 +16,10 @@ bool fetch_gpio_reset(BaseSequentialStream * chp);
 
 void fetch_gpio_init(BaseSequentialStream * chp);
 
+bool fetch_gpio_ext_claim( ioportid_t port, uint32_t pin, uint32_t edges, extcallback_t cb );
+
+void fetch_gpio_ext_release( uint32_t pin );
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,30 @@
+
+/*! \file fetch_pwm.h
+ *
+ * @addtogroup fetch_pwm
+ * @{
+ */
+
+#ifndef FETCH_PWM_H_
+#define FETCH_PWM_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool fetch_pwm_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+bool fetch_pwm_reset(BaseSequentialStream * chp);
+
+void fetch_pwm_init(BaseSequentialStream * chp);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
+
+/*! @} */
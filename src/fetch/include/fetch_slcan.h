@@ -0,0 +1,25 @@
+
+/*! \file fetch_slcan.h
+ *
+ * @addtogroup fetch_slcan
+ * @{
+ */
+
+#ifndef FETCH_SLCAN_H_
+#define FETCH_SLCAN_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void fetch_slcan_init(BaseAsynchronousChannel * chnp);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
+
+/*! @} */
@@ -16,6 +16,8 @@ bool fetch_spi_reset(BaseSequentialStream * chp);
 
 void fetch_spi_init(BaseSequentialStream * chp);
 
+SPIDriver * fetch_spi_device(BaseSequentialStream * chp, char * str);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,30 @@
+
+/*! \file fetch_sweep.h
+ *
+ * @addtogroup fetch_sweep
+ * @{
+ */
+
+#ifndef FETCH_SWEEP_H_
+#define FETCH_SWEEP_H_
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+bool fetch_sweep_dispatch(BaseSequentialStream * chp, char * cmd_list[], char * data_list[]);
+
+bool fetch_sweep_reset(BaseSequentialStream * chp);
+
+void fetch_sweep_init(BaseSequentialStream * chp);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
+
+/*! @} */
@@ -33,6 +33,7 @@
 
 #include "fetch.h"
 #include "fetch_adc.h"
+#include "fetch_slcan.h"
 #include "util_general.h"
 #include "util_version.h"
 #include "util_messages.h"
@@ -146,6 +147,7 @@ static void main_app(void)
 	sduStart(&SDU1, &serusbcfg);
 	sduObjectInit(&SDU2);
 	sduStart(&SDU2, &serusbcfg2);
+	fetch_slcan_init((BaseAsynchronousChannel *)&SDU2);
 
 	usbDisconnectBus(serusbcfg.usbp);
 	chThdSleepMilliseconds(1000);
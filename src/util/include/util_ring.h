@@ -0,0 +1,48 @@
+/*! \file util_ring.h
+ *
+ * @addtogroup util_ring
+ * @{
+ */
+
+#ifndef UTIL_RING_H_
+#define UTIL_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! \brief single producer/single consumer ring of fixed size records
+ *
+ *  The producer (usually an ISR) only writes head, the consumer (usually
+ *  the shell thread) only writes tail, so no locking is needed between them.
+ *  capacity must be a power of two.
+ */
+typedef struct util_ring
+{
+  uint8_t           * buffer;
+  size_t              elem_size;
+  uint32_t            capacity;
+  volatile uint32_t   head;
+  volatile uint32_t   tail;
+  volatile uint32_t   overflows;
+} util_ring_t;
+
+void util_ring_init(util_ring_t * ring, void * buffer, size_t elem_size, uint32_t capacity);
+void util_ring_reset(util_ring_t * ring);
+bool util_ring_put(util_ring_t * ring, const void * elem);
+bool util_ring_get(util_ring_t * ring, void * elem);
+bool util_ring_peek(util_ring_t * ring, void * elem);
+uint32_t util_ring_count(util_ring_t * ring);
+uint32_t util_ring_take_overflows(util_ring_t * ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
@@ -18,6 +18,7 @@ size_t get_longest_str_length(const char * s1, const char * s2, int max_length);
 char * _strtok(char * str, const char * delim, char ** saveptr);
 char * _strncpy(char * dest, const char * src, size_t n);
 int token_match( const char * tok_str, int tok_max_len, const char * tok_array[], int tok_max_elems );
+int32_t hex_decode( const char * str, uint8_t * buf, uint32_t max );
 
 #ifdef __cplusplus
 }
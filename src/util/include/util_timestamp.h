@@ -0,0 +1,43 @@
+/*! \file util_timestamp.h
+ *
+ * @addtogroup util_timestamp
+ * @{
+ */
+
+#ifndef UTIL_TIMESTAMP_H_
+#define UTIL_TIMESTAMP_H_
+
+#include <stdint.h>
+
+#include "ch.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UTIL_TIMESTAMP_CYCLES_PER_US  (STM32_HCLK / 1000000)
+#define UTIL_TIMESTAMP_SPAN_MS        10000     //!< realtime counter wraps after ~25s
+
+/*! \brief running microsecond count driven by the cycle counter
+ *
+ *  Short gaps are timed with the cycle counter, gaps longer than its wrap
+ *  fall back to the system tick.
+ */
+typedef struct util_timestamp
+{
+  rtcnt_t     last_cycles;
+  systime_t   last_time;
+  uint32_t    cycles;         //!< below one microsecond
+  uint32_t    us;
+} util_timestamp_t;
+
+void util_timestamp_init(util_timestamp_t * ts);
+uint32_t util_timestamp_update(util_timestamp_t * ts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
+//! @}
@@ -382,6 +382,10 @@ void util_message_uint32( BaseSequentialStream * chp, char * name, uint32_t * da
 
 void util_message_hex_uint8( BaseSequentialStream * chp, char * name, uint8_t * data, uint32_t count)
 {
+	static const char hex_digits[] = "0123456789ABCDEF";
+	uint8_t line[96];
+	uint32_t len = 0;
+
 	if(chp == NULL)
 	{
 		return;
@@ -391,16 +395,28 @@ void util_message_hex_uint8( BaseSequentialStream * chp, char * name, uint8_t *
 
 	chprintf(chp, "H8:%s:", name);
 
+	// formatted by hand and written in blocks, chprintf per byte limits
+	// large transfers (spi.read) to a fraction of the USB rate
 	for( ; count > 0; count-- )
 	{
-		chprintf(chp, "%02X", *(data++));
+		line[len++] = hex_digits[*data >> 4];
+		line[len++] = hex_digits[*data & 0x0f];
+		data++;
 
 		if( count > 1 )
 		{
-			chprintf(chp, ",");
+			line[len++] = ',';
+		}
+
+		if( len > sizeof(line) - 3 )
+		{
+			chSequentialStreamWrite(chp, line, len);
+			len = 0;
 		}
 	}
-	chprintf(chp, "\r\n");
+	line[len++] = '\r';
+	line[len++] = '\n';
+	chSequentialStreamWrite(chp, line, len);
 	chBSemSignal( &mshell_io_sem );
 }
 
@@ -0,0 +1,122 @@
+/*! \file util_ring.c
+ *
+ * Lock-free record rings for streaming data out of interrupt handlers
+ *
+ * @defgroup util_ring  Ring Buffer Utilities
+ * @{
+ */
+
+#include <string.h>
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_ring.h"
+
+/*! \brief keep the compiler from moving buffer accesses across index updates
+ */
+#define RING_BARRIER()  __asm__ volatile("" ::: "memory")
+
+/*! \brief initialize a ring over caller supplied storage
+ *  \param[in] buffer     storage for capacity * elem_size bytes
+ *  \param[in] elem_size  size of one record
+ *  \param[in] capacity   number of records, must be a power of two
+ */
+void util_ring_init(util_ring_t * ring, void * buffer, size_t elem_size, uint32_t capacity)
+{
+  chDbgAssert((capacity & (capacity - 1)) == 0, "util_ring_init(), capacity not a power of two");
+
+  ring->buffer = buffer;
+  ring->elem_size = elem_size;
+  ring->capacity = capacity;
+  util_ring_reset(ring);
+}
+
+/*! \brief discard all records
+ *  \warning only call this while the producer is stopped
+ */
+void util_ring_reset(util_ring_t * ring)
+{
+  ring->head = 0;
+  ring->tail = 0;
+  ring->overflows = 0;
+}
+
+/*! \brief add a record, producer side
+ *  \returns false and counts an overflow if the ring is full
+ */
+bool util_ring_put(util_ring_t * ring, const void * elem)
+{
+  uint32_t head = ring->head;
+
+  if( (head - ring->tail) >= ring->capacity )
+  {
+    ring->overflows++;
+    return false;
+  }
+
+  memcpy(&ring->buffer[(head & (ring->capacity - 1)) * ring->elem_size], elem, ring->elem_size);
+  RING_BARRIER();
+  ring->head = head + 1;
+
+  return true;
+}
+
+/*! \brief remove the oldest record, consumer side
+ *  \returns false if the ring is empty
+ */
+bool util_ring_get(util_ring_t * ring, void * elem)
+{
+  uint32_t tail = ring->tail;
+
+  if( tail == ring->head )
+  {
+    return false;
+  }
+
+  memcpy(elem, &ring->buffer[(tail & (ring->capacity - 1)) * ring->elem_size], ring->elem_size);
+  RING_BARRIER();
+  ring->tail = tail + 1;
+
+  return true;
+}
+
+/*! \brief copy the oldest record without removing it, consumer side
+ *  \returns false if the ring is empty
+ */
+bool util_ring_peek(util_ring_t * ring, void * elem)
+{
+  uint32_t tail = ring->tail;
+
+  if( tail == ring->head )
+  {
+    return false;
+  }
+
+  memcpy(elem, &ring->buffer[(tail & (ring->capacity - 1)) * ring->elem_size], ring->elem_size);
+
+  return true;
+}
+
+/*! \brief number of records waiting to be read
+ */
+uint32_t util_ring_count(util_ring_t * ring)
+{
+  return ring->head - ring->tail;
+}
+
+/*! \brief return the overflow count and clear it
+ */
+uint32_t util_ring_take_overflows(util_ring_t * ring)
+{
+  uint32_t count;
+
+  chSysLock();
+  count = ring->overflows;
+  ring->overflows = 0;
+  chSysUnlock();
+
+  return count;
+}
+
+//! @}
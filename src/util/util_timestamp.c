@@ -0,0 +1,51 @@
+/*! \file util_timestamp.c
+ *
+ * Microsecond timestamps for interrupt handlers
+ *
+ * @defgroup util_timestamp  Timestamp Utilities
+ * @{
+ */
+
+#include "ch.h"
+#include "hal.h"
+
+#include "util_timestamp.h"
+
+/*! \brief restart the count at zero
+ *  \note callable from any context
+ */
+void util_timestamp_init(util_timestamp_t * ts)
+{
+  ts->us = 0;
+  ts->cycles = 0;
+  ts->last_cycles = chSysGetRealtimeCounterX();
+  ts->last_time = chVTGetSystemTimeX();
+}
+
+/*! \brief advance the count to now
+ *  \return microseconds since util_timestamp_init()
+ *  \note callable from any context, but only one context per timestamp
+ */
+uint32_t util_timestamp_update(util_timestamp_t * ts)
+{
+  rtcnt_t now = chSysGetRealtimeCounterX();
+  systime_t time = chVTGetSystemTimeX();
+
+  if( (time - ts->last_time) < MS2ST(UTIL_TIMESTAMP_SPAN_MS) )
+  {
+    ts->cycles += now - ts->last_cycles;
+    ts->us += ts->cycles / UTIL_TIMESTAMP_CYCLES_PER_US;
+    ts->cycles %= UTIL_TIMESTAMP_CYCLES_PER_US;
+  }
+  else
+  {
+    ts->us += (uint32_t)(((uint64_t)(time - ts->last_time) * 1000000) / CH_CFG_ST_FREQUENCY);
+    ts->cycles = 0;
+  }
+  ts->last_cycles = now;
+  ts->last_time = time;
+
+  return ts->us;
+}
+
+//! @}